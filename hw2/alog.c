@@ -0,0 +1,251 @@
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "alog.h"
+#include "metrics.h"
+
+/* Escaping takes at most 6 bytes per byte of the method and path. */
+#define ALOG_LINE_SIZE (6 * (ALOG_PATH_MAX + 16) + 256)
+#define ALOG_CACHE_LINE 64
+
+/* The lines of one thread, from TAIL (read by the writer) up to HEAD. Like
+ * metrics blocks, rings outlive their threads and are reused by new ones. */
+typedef struct alog_ring {
+  char data[ALOG_RING_SIZE];
+  uint64_t dropped;
+  int in_use;
+  struct alog_ring *next;
+
+  /* Each index has one writer; keep them on separate cache lines. */
+  unsigned long head __attribute__((aligned(ALOG_CACHE_LINE)));
+  unsigned long tail __attribute__((aligned(ALOG_CACHE_LINE)));
+} alog_ring_t;
+
+int alog_fd = -1;
+alog_ring_t *alog_rings;
+__thread alog_ring_t *alog_local;
+pthread_key_t alog_key;
+pthread_mutex_t alog_flush_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* The calling thread's last timestamp, formatted down to the second. */
+__thread time_t alog_second = -1;
+__thread char alog_date[32];
+
+
+void alog_thread_exit(void *ring) {
+  __atomic_store_n(&((alog_ring_t *) ring)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+
+/* Returns the calling thread's ring, adopting or adding one the first time. */
+alog_ring_t *alog_ring() {
+  if (alog_local != NULL)
+    return alog_local;
+
+  alog_ring_t *ring = __atomic_load_n(&alog_rings, __ATOMIC_ACQUIRE);
+  for (; ring != NULL; ring = ring->next) {
+    int free = 0;
+    if (__atomic_compare_exchange_n(&ring->in_use, &free, 1, 0,
+          __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      break;
+  }
+  if (ring == NULL) {
+    if (posix_memalign((void **) &ring, ALOG_CACHE_LINE, sizeof(alog_ring_t)) != 0)
+      return NULL;
+    memset(ring, 0, sizeof(alog_ring_t));
+    ring->in_use = 1;
+    ring->next = __atomic_load_n(&alog_rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&alog_rings, &ring->next, ring, 1,
+          __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      ;
+  }
+  pthread_setspecific(alog_key, ring);
+  alog_local = ring;
+  return ring;
+}
+
+
+/*
+ * Hands everything the rings hold to the log file, in one writev() unless
+ * the kernel takes less. Called by the writer thread, and once more on exit.
+ */
+void alog_flush() {
+  struct iovec iov[IOV_MAX];
+  alog_ring_t *rings[IOV_MAX / 2];
+  size_t lengths[IOV_MAX / 2];
+  int count = 0, num_rings = 0;
+
+  pthread_mutex_lock(&alog_flush_mutex);
+  alog_ring_t *ring = __atomic_load_n(&alog_rings, __ATOMIC_ACQUIRE);
+  for (; ring != NULL && num_rings < IOV_MAX / 2; ring = ring->next) {
+    unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    size_t length = head - ring->tail;
+    if (length == 0)
+      continue;
+
+    size_t at = ring->tail & (ALOG_RING_SIZE - 1);
+    size_t first = ALOG_RING_SIZE - at < length ? ALOG_RING_SIZE - at : length;
+    iov[count].iov_base = ring->data + at;
+    iov[count++].iov_len = first;
+    if (first < length) {
+      iov[count].iov_base = ring->data;
+      iov[count++].iov_len = length - first;
+    }
+    rings[num_rings] = ring;
+    lengths[num_rings++] = length;
+  }
+
+  /* Lines of different rings must not interleave, so a short write is
+   * finished before the rings take more. */
+  struct iovec *next = iov;
+  while (count > 0) {
+    ssize_t written = writev(alog_fd, next, count);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written <= 0)
+      break; // The lines are lost; the rings must not fill up over it.
+    while (count > 0 && (size_t) written >= next->iov_len) {
+      written -= next->iov_len;
+      next++;
+      count--;
+    }
+    if (count > 0) {
+      next->iov_base = (char *) next->iov_base + written;
+      next->iov_len -= written;
+    }
+  }
+
+  for (int i = 0; i < num_rings; i++)
+    __atomic_store_n(&rings[i]->tail, rings[i]->tail + lengths[i], __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&alog_flush_mutex);
+}
+
+
+void *alog_writer(void *args) {
+  struct timespec interval = { 0, ALOG_FLUSH_MS * 1000000L };
+  while (1) {
+    nanosleep(&interval, NULL);
+    alog_flush();
+  }
+  return NULL;
+}
+
+
+/*
+ * Opens the access log at PATH for appending ("-" is the standard output)
+ * and starts the writer thread. Returns -1 if the file cannot be opened.
+ */
+int alog_init(char *path) {
+  alog_fd = strcmp(path, "-") == 0 ? STDOUT_FILENO
+      : open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (alog_fd < 0)
+    return -1;
+
+  pthread_key_create(&alog_key, alog_thread_exit);
+  pthread_t thread;
+  pthread_create(&thread, NULL, alog_writer, NULL);
+  pthread_detach(thread);
+  atexit(alog_flush);
+  return 0;
+}
+
+
+int alog_enabled() {
+  return alog_fd >= 0;
+}
+
+
+/* Writes the address of the peer of socket FD into ADDRESS. */
+void alog_peer_address(int fd, char address[INET_ADDRSTRLEN]) {
+  struct sockaddr_in peer;
+  socklen_t peer_length = sizeof(peer);
+  if (getpeername(fd, (struct sockaddr *) &peer, &peer_length) != 0
+      || inet_ntop(AF_INET, &peer.sin_addr, address, INET_ADDRSTRLEN) == NULL)
+    strcpy(address, "-");
+}
+
+
+/* Copies at most MAX bytes of IN to OUT as the inside of a JSON string. */
+char *alog_escape(char *out, char *in, size_t max) {
+  for (size_t i = 0; in[i] != '\0' && i < max; i++) {
+    unsigned char c = in[i];
+    if (c == '"' || c == '\\') {
+      *out++ = '\\';
+      *out++ = c;
+    } else if (c < 0x20 || c >= 0x7f) {
+      out += sprintf(out, "\\u%04x", c);
+    } else {
+      *out++ = c;
+    }
+  }
+  return out;
+}
+
+
+/*
+ * Logs a response with STATUS and BYTES bytes in all to a request from CLIENT
+ * for METHOD and PATH (NULL if the request could not be parsed), which began
+ * to arrive at STARTED (see metrics.h).
+ */
+void alog_request(char *client, char *method, char *path, int status,
+    size_t bytes, long long started) {
+  if (alog_fd < 0)
+    return;
+  alog_ring_t *ring = alog_ring();
+  if (ring == NULL)
+    return;
+
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  if (now.tv_sec != alog_second) {
+    struct tm tm;
+    gmtime_r(&now.tv_sec, &tm);
+    strftime(alog_date, sizeof(alog_date), "%Y-%m-%dT%H:%M:%S", &tm);
+    alog_second = now.tv_sec;
+  }
+  double duration_ms = started > 0 ? (metrics_now() - started) / 1e6 : 0;
+
+  char line[ALOG_LINE_SIZE];
+  char *end = line + sprintf(line, "{\"time\":\"%s.%03ldZ\",\"client\":\"%s\",\"method\":\"",
+      alog_date, now.tv_nsec / 1000000, client);
+  end = alog_escape(end, method ? method : "-", 16);
+  end += sprintf(end, "\",\"path\":\"");
+  end = alog_escape(end, path ? path : "-", ALOG_PATH_MAX);
+  end += sprintf(end, "\",\"status\":%d,\"bytes\":%zu,\"duration_ms\":%.3f}\n",
+      status, bytes, duration_ms);
+  size_t length = end - line;
+
+  unsigned long head = ring->head;
+  unsigned long tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  if (ALOG_RING_SIZE - (head - tail) < length) {
+    __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+    return;
+  }
+  size_t at = head & (ALOG_RING_SIZE - 1);
+  size_t first = ALOG_RING_SIZE - at < length ? ALOG_RING_SIZE - at : length;
+  memcpy(ring->data + at, line, first);
+  memcpy(ring->data, line + first, length - first);
+  __atomic_store_n(&ring->head, head + length, __ATOMIC_RELEASE);
+}
+
+
+/* Returns the number of lines dropped because a ring was full. */
+uint64_t alog_dropped() {
+  uint64_t dropped = 0;
+  alog_ring_t *ring = __atomic_load_n(&alog_rings, __ATOMIC_ACQUIRE);
+  for (; ring != NULL; ring = ring->next)
+    dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+  return dropped;
+}
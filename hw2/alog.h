@@ -0,0 +1,34 @@
+#ifndef __ALOG__
+#define __ALOG__
+
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* ALOG is the access log, enabled with --access-log: one JSON line per
+ * response, with the client's address, the request's method and path, the
+ * status, the bytes sent, and the time from the request's first byte until
+ * the response was sent.
+ *
+ * Threads never write the log file themselves. Each one formats its lines
+ * into a ring buffer of its own, which only it writes and only the writer
+ * thread reads, so logging a request takes no lock and no system call. The
+ * writer wakes up every ALOG_FLUSH_MS and hands whatever the rings hold to
+ * the kernel with one writev(). If a ring is full because the log cannot
+ * keep up, the line is dropped and counted instead of holding the thread up
+ * (see alog_dropped). Lines of different threads can be out of order by up
+ * to ALOG_FLUSH_MS; each carries its own timestamp. */
+
+#define ALOG_RING_SIZE (256 << 10) // Per thread. Must be a power of two.
+#define ALOG_FLUSH_MS 20
+#define ALOG_PATH_MAX 512 // Longer paths are cut short in the log.
+
+int alog_init(char *path);
+int alog_enabled();
+void alog_peer_address(int fd, char address[INET_ADDRSTRLEN]);
+void alog_request(char *client, char *method, char *path, int status,
+    size_t bytes, long long started);
+uint64_t alog_dropped();
+void alog_flush();
+
+#endif
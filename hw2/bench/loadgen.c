@@ -0,0 +1,531 @@
+/*
+ * LOADGEN sends HTTP/1.1 GET requests to a server and reports throughput and
+ * latency percentiles.
+ *
+ * By default it is open-loop: requests are due at a fixed rate whether or not
+ * earlier ones have been answered, and each request's latency counts from
+ * when it was due, not from when a connection was free to send it. A server
+ * that falls behind therefore shows up as queueing delay in the percentiles
+ * instead of quietly lowering the offered load. With a rate of 0 it is
+ * closed-loop instead: every connection sends its next request as soon as
+ * the previous response is in, which measures the maximum throughput.
+ *
+ * Paths are drawn uniformly from the files under a directory (e.g. files/),
+ * so the mix of response sizes follows that directory.
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LG_SUB_BITS 4
+#define LG_SUB_BUCKETS (1 << LG_SUB_BITS)
+#define LG_MAX_BITS 40
+#define LG_BUCKETS ((LG_MAX_BITS - LG_SUB_BITS + 1) * LG_SUB_BUCKETS)
+#define LG_MAX_STATUS 600
+#define LG_BUFFER_SIZE 16384
+#define LG_MAX_PENDING (1 << 20)
+#define LG_GRACE_NS 2000000000LL // Time given to outstanding requests at the end.
+
+/* Latencies in nanoseconds, in log-linear buckets as in metrics.c. */
+typedef struct lg_histogram {
+  uint64_t counts[LG_BUCKETS];
+  uint64_t max;
+} lg_histogram_t;
+
+enum lg_state {
+  LG_CLOSED,
+  LG_CONNECTING,
+  LG_IDLE,
+  LG_SENDING,
+  LG_RECEIVING,
+};
+
+typedef struct lg_conn {
+  int fd;
+  enum lg_state state;
+  long long due; // When the request in flight was due.
+  char request[1024];
+  size_t request_length;
+  size_t request_sent;
+  char head[LG_BUFFER_SIZE]; // The response head (and the start of the body).
+  size_t head_length;
+  long long body_remaining; // -1 until the head is complete.
+  int server_closes;
+  int status;
+} lg_conn_t;
+
+typedef struct lg_thread {
+  int epoll_fd;
+  int timer_fd;
+  lg_conn_t *conns;
+  int num_conns;
+  uint64_t random;
+
+  long long interval; // Between requests due on this thread, 0 if closed-loop.
+  long long next_due;
+  long long *pending; // Due times of requests waiting for a connection.
+  size_t pending_head;
+  size_t pending_count;
+
+  uint64_t completed;
+  uint64_t errors;
+  uint64_t unsent;
+  uint64_t bytes;
+  uint64_t statuses[LG_MAX_STATUS];
+  lg_histogram_t latency;
+} lg_thread_t;
+
+struct sockaddr_in lg_address;
+char *lg_host = "localhost";
+char **lg_paths;
+int lg_num_paths;
+int lg_keep_alive = 1;
+long long lg_began;
+long long lg_deadline;
+
+
+long long lg_now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+
+int lg_index(uint64_t value) {
+  if (value >= 1ULL << LG_MAX_BITS)
+    value = (1ULL << LG_MAX_BITS) - 1;
+  if (value < LG_SUB_BUCKETS)
+    return value;
+  int shift = 63 - __builtin_clzll(value) - LG_SUB_BITS;
+  return (shift + 1) * LG_SUB_BUCKETS + (value >> shift) - LG_SUB_BUCKETS;
+}
+
+
+uint64_t lg_bucket_end(int index) {
+  if (index < LG_SUB_BUCKETS)
+    return index + 1;
+  int shift = index / LG_SUB_BUCKETS - 1;
+  return (uint64_t) (index % LG_SUB_BUCKETS + LG_SUB_BUCKETS + 1) << shift;
+}
+
+
+/* Returns the QUANTILE of HISTOGRAM, as the upper end of its bucket. */
+uint64_t lg_quantile(lg_histogram_t *histogram, uint64_t total, double quantile) {
+  uint64_t rank = quantile * total, cumulative = 0;
+  int index = 0;
+  while (index < LG_BUCKETS - 1 && (cumulative += histogram->counts[index]) <= rank)
+    index++;
+  uint64_t end = lg_bucket_end(index);
+  return end < histogram->max ? end : histogram->max;
+}
+
+
+/* Adds the files under DIRECTORY (as request paths after PREFIX) to lg_paths. */
+void lg_add_paths(char *directory, char *prefix) {
+  DIR *dir = opendir(directory);
+  if (dir == NULL) {
+    perror(directory);
+    exit(1);
+  }
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] == '.')
+      continue;
+    char path[4096], request_path[1024];
+    struct stat file_stat;
+    snprintf(path, sizeof(path), "%s/%s", directory, entry->d_name);
+    snprintf(request_path, sizeof(request_path), "%s/%s", prefix, entry->d_name);
+    if (stat(path, &file_stat) != 0)
+      continue;
+    if (S_ISDIR(file_stat.st_mode)) {
+      lg_add_paths(path, request_path);
+    } else if (S_ISREG(file_stat.st_mode)) {
+      lg_paths = realloc(lg_paths, (lg_num_paths + 1) * sizeof(char *));
+      lg_paths[lg_num_paths++] = strdup(request_path);
+    }
+  }
+  closedir(dir);
+}
+
+
+uint64_t lg_random(lg_thread_t *thread) {
+  thread->random ^= thread->random << 13;
+  thread->random ^= thread->random >> 7;
+  thread->random ^= thread->random << 17;
+  return thread->random;
+}
+
+
+void lg_watch(lg_thread_t *thread, lg_conn_t *conn, uint32_t events) {
+  struct epoll_event event = { .events = events, .data.ptr = conn };
+  if (epoll_ctl(thread->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event) != 0)
+    epoll_ctl(thread->epoll_fd, EPOLL_CTL_ADD, conn->fd, &event);
+}
+
+
+void lg_close(lg_conn_t *conn) {
+  close(conn->fd);
+  conn->fd = -1;
+  conn->state = LG_CLOSED;
+}
+
+
+/* The request in flight on CONN failed. */
+void lg_fail(lg_thread_t *thread, lg_conn_t *conn) {
+  thread->errors++;
+  lg_close(conn);
+}
+
+
+/* Sends as much of CONN's request as the socket takes. */
+void lg_send(lg_thread_t *thread, lg_conn_t *conn) {
+  while (conn->request_sent < conn->request_length) {
+    ssize_t sent = send(conn->fd, conn->request + conn->request_sent,
+        conn->request_length - conn->request_sent, MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR)
+      continue;
+    if (sent < 0 && errno == EAGAIN) {
+      lg_watch(thread, conn, EPOLLOUT);
+      return;
+    }
+    if (sent <= 0) {
+      lg_fail(thread, conn);
+      return;
+    }
+    conn->request_sent += sent;
+  }
+  conn->state = LG_RECEIVING;
+  lg_watch(thread, conn, EPOLLIN);
+}
+
+
+/* Starts the request that was due at DUE on CONN, connecting first if needed. */
+void lg_start(lg_thread_t *thread, lg_conn_t *conn, long long due) {
+  conn->due = due;
+  conn->head_length = 0;
+  conn->body_remaining = -1;
+  conn->server_closes = !lg_keep_alive;
+  char *path = lg_paths ? lg_paths[lg_random(thread) % lg_num_paths] : "/";
+  conn->request_length = snprintf(conn->request, sizeof(conn->request),
+      "GET %s HTTP/1.1\r\nHost: %s\r\n%s\r\n", path, lg_host,
+      lg_keep_alive ? "" : "Connection: close\r\n");
+  conn->request_sent = 0;
+
+  if (conn->state == LG_IDLE) {
+    conn->state = LG_SENDING;
+    lg_send(thread, conn);
+    return;
+  }
+
+  conn->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  int one = 1;
+  setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  if (connect(conn->fd, (struct sockaddr *) &lg_address, sizeof(lg_address)) != 0
+      && errno != EINPROGRESS) {
+    lg_fail(thread, conn);
+    return;
+  }
+  conn->state = LG_CONNECTING;
+  lg_watch(thread, conn, EPOLLOUT);
+}
+
+
+/* Returns the value of the header NAME in the response head of CONN, or NULL. */
+char *lg_header(lg_conn_t *conn, char *name) {
+  size_t length = strlen(name);
+  for (char *line = strstr(conn->head, "\r\n"); line != NULL; line = strstr(line + 2, "\r\n"))
+    if (strncasecmp(line + 2, name, length) == 0 && line[2 + length] == ':')
+      return line + 3 + length;
+  return NULL;
+}
+
+
+void lg_complete(lg_thread_t *thread, lg_conn_t *conn) {
+  long long latency = lg_now() - conn->due;
+  thread->completed++;
+  if (conn->status >= 0 && conn->status < LG_MAX_STATUS)
+    thread->statuses[conn->status]++;
+  thread->latency.counts[lg_index(latency)]++;
+  if ((uint64_t) latency > thread->latency.max)
+    thread->latency.max = latency;
+
+  if (conn->server_closes) {
+    lg_close(conn);
+  } else {
+    conn->state = LG_IDLE;
+    lg_watch(thread, conn, 0);
+  }
+}
+
+
+/* Reads the response on CONN until the socket is drained or it is complete. */
+void lg_receive(lg_thread_t *thread, lg_conn_t *conn) {
+  while (1) {
+    char discard[LG_BUFFER_SIZE];
+    int in_head = conn->body_remaining < 0;
+    char *into = in_head ? conn->head + conn->head_length : discard;
+    size_t space = in_head ? sizeof(conn->head) - conn->head_length - 1 : sizeof(discard);
+    if (!in_head && (long long) space > conn->body_remaining)
+      space = conn->body_remaining;
+    if (space == 0) {
+      lg_fail(thread, conn); // The head does not fit.
+      return;
+    }
+
+    ssize_t received = recv(conn->fd, into, space, 0);
+    if (received < 0 && errno == EINTR)
+      continue;
+    if (received < 0 && errno == EAGAIN)
+      return;
+    if (received <= 0) {
+      lg_fail(thread, conn);
+      return;
+    }
+    thread->bytes += received;
+
+    if (!in_head) {
+      conn->body_remaining -= received;
+    } else {
+      conn->head_length += received;
+      conn->head[conn->head_length] = '\0';
+      char *end = strstr(conn->head, "\r\n\r\n");
+      if (end == NULL)
+        continue;
+      end[2] = '\0';
+      conn->status = conn->head_length > 12 ? atoi(conn->head + 9) : 0;
+      char *content_length = lg_header(conn, "Content-Length");
+      char *connection = lg_header(conn, "Connection");
+      if (content_length == NULL) {
+        lg_fail(thread, conn); // Only Content-Length framing is supported.
+        return;
+      }
+      if (connection != NULL && strncasecmp(connection + strspn(connection, " "), "close", 5) == 0)
+        conn->server_closes = 1;
+      size_t head_length = end + 4 - conn->head;
+      conn->body_remaining = atoll(content_length) - (conn->head_length - head_length);
+    }
+    if (conn->body_remaining == 0) {
+      lg_complete(thread, conn);
+      return;
+    }
+  }
+}
+
+
+void lg_handle(lg_thread_t *thread, lg_conn_t *conn) {
+  if (conn->state == LG_CONNECTING) {
+    int error = 0;
+    socklen_t length = sizeof(error);
+    getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &length);
+    if (error != 0) {
+      lg_fail(thread, conn);
+      return;
+    }
+    conn->state = LG_SENDING;
+  }
+  if (conn->state == LG_IDLE)
+    lg_close(conn); // The server closed a connection kept alive.
+  else if (conn->state == LG_SENDING)
+    lg_send(thread, conn);
+  else if (conn->state == LG_RECEIVING)
+    lg_receive(thread, conn);
+}
+
+
+/* Hands requests that are due to free connections, and arms the timer. */
+void lg_dispatch(lg_thread_t *thread, long long now) {
+  if (thread->interval > 0) {
+    while (thread->next_due <= now && thread->next_due < lg_deadline) {
+      if (thread->pending_count == LG_MAX_PENDING)
+        thread->unsent++;
+      else
+        thread->pending[(thread->pending_head + thread->pending_count++) % LG_MAX_PENDING]
+            = thread->next_due;
+      thread->next_due += thread->interval;
+    }
+  }
+
+  for (int i = 0; i < thread->num_conns; i++) {
+    lg_conn_t *conn = &thread->conns[i];
+    if (conn->state != LG_CLOSED && conn->state != LG_IDLE)
+      continue;
+    if (thread->interval == 0) {
+      if (now < lg_deadline)
+        lg_start(thread, conn, now);
+    } else if (thread->pending_count > 0) {
+      long long due = thread->pending[thread->pending_head];
+      thread->pending_head = (thread->pending_head + 1) % LG_MAX_PENDING;
+      thread->pending_count--;
+      lg_start(thread, conn, due);
+    }
+  }
+
+  if (thread->interval > 0 && thread->next_due < lg_deadline) {
+    struct itimerspec timer = {{0, 0}, {thread->next_due / 1000000000LL,
+      thread->next_due % 1000000000LL}};
+    timerfd_settime(thread->timer_fd, TFD_TIMER_ABSTIME, &timer, NULL);
+  }
+}
+
+
+void *lg_run(void *args) {
+  lg_thread_t *thread = args;
+  thread->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  thread->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  struct epoll_event timer_event = { .events = EPOLLIN, .data.ptr = NULL };
+  epoll_ctl(thread->epoll_fd, EPOLL_CTL_ADD, thread->timer_fd, &timer_event);
+  thread->next_due = lg_began;
+
+  while (1) {
+    long long now = lg_now();
+    lg_dispatch(thread, now);
+
+    int busy = 0;
+    for (int i = 0; i < thread->num_conns; i++)
+      busy |= thread->conns[i].state != LG_CLOSED && thread->conns[i].state != LG_IDLE;
+    if (now >= lg_deadline + LG_GRACE_NS || (now >= lg_deadline && !busy))
+      break;
+
+    struct epoll_event events[64];
+    int count = epoll_wait(thread->epoll_fd, events, 64, 100);
+    for (int i = 0; i < count; i++) {
+      if (events[i].data.ptr == NULL) {
+        uint64_t expirations;
+        if (read(thread->timer_fd, &expirations, sizeof(expirations)) < 0)
+          continue;
+      } else {
+        lg_handle(thread, events[i].data.ptr);
+      }
+    }
+  }
+
+  for (int i = 0; i < thread->num_conns; i++) {
+    lg_conn_t *conn = &thread->conns[i];
+    if (conn->state != LG_CLOSED && conn->state != LG_IDLE)
+      thread->errors++; // Still unanswered after the grace period.
+    if (conn->state != LG_CLOSED)
+      lg_close(conn);
+  }
+  thread->unsent += thread->pending_count;
+  return NULL;
+}
+
+
+void lg_usage() {
+  fprintf(stderr,
+      "Usage: loadgen [options] HOST:PORT\n"
+      "  -c CONNECTIONS  Connections to use at most (default 16).\n"
+      "  -r RATE         Requests per second, open-loop; 0 for closed-loop (default 0).\n"
+      "  -d SECONDS      How long to send requests for (default 10).\n"
+      "  -t THREADS      Threads to spread the connections over (default 1).\n"
+      "  -f DIRECTORY    Request the files under DIRECTORY, picked uniformly\n"
+      "                  (default: just /).\n"
+      "  -k              Open a connection per request instead of keeping them alive.\n"
+      "  -l LABEL        Label for the summary line.\n");
+  exit(1);
+}
+
+
+int main(int argc, char **argv) {
+  int num_conns = 16, num_threads = 1;
+  double rate = 0, duration = 10;
+  char *label = "loadgen";
+  int option;
+  while ((option = getopt(argc, argv, "c:r:d:t:f:kl:")) != -1) {
+    switch (option) {
+      case 'c': num_conns = atoi(optarg); break;
+      case 'r': rate = atof(optarg); break;
+      case 'd': duration = atof(optarg); break;
+      case 't': num_threads = atoi(optarg); break;
+      case 'f': lg_add_paths(optarg, ""); break;
+      case 'k': lg_keep_alive = 0; break;
+      case 'l': label = optarg; break;
+      default: lg_usage();
+    }
+  }
+  if (optind != argc - 1 || num_conns < 1 || num_threads < 1 || rate < 0 || duration <= 0)
+    lg_usage();
+  if (num_threads > num_conns)
+    num_threads = num_conns;
+
+  char *target = strdup(argv[optind]);
+  char *colon = strrchr(target, ':');
+  if (colon == NULL)
+    lg_usage();
+  *colon = '\0';
+  lg_host = target;
+  struct addrinfo hints = { .ai_family = AF_INET, .ai_socktype = SOCK_STREAM }, *result;
+  if (getaddrinfo(target, colon + 1, &hints, &result) != 0) {
+    fprintf(stderr, "Cannot resolve %s\n", argv[optind]);
+    return 1;
+  }
+  memcpy(&lg_address, result->ai_addr, sizeof(lg_address));
+  freeaddrinfo(result);
+
+  lg_thread_t *threads = calloc(num_threads, sizeof(lg_thread_t));
+  pthread_t *ids = calloc(num_threads, sizeof(pthread_t));
+  lg_began = lg_now();
+  lg_deadline = lg_began + (long long) (duration * 1e9);
+  for (int i = 0; i < num_threads; i++) {
+    lg_thread_t *thread = &threads[i];
+    thread->num_conns = num_conns / num_threads + (i < num_conns % num_threads);
+    thread->conns = calloc(thread->num_conns, sizeof(lg_conn_t));
+    for (int j = 0; j < thread->num_conns; j++)
+      thread->conns[j].fd = -1;
+    thread->random = 0x9e3779b97f4a7c15ULL * (i + 1);
+    thread->interval = rate > 0 ? (long long) (1e9 * num_threads / rate) : 0;
+    if (rate > 0)
+      thread->pending = malloc(LG_MAX_PENDING * sizeof(long long));
+    pthread_create(&ids[i], NULL, lg_run, thread);
+  }
+
+  lg_thread_t total;
+  memset(&total, 0, sizeof(total));
+  for (int i = 0; i < num_threads; i++) {
+    pthread_join(ids[i], NULL);
+    total.completed += threads[i].completed;
+    total.errors += threads[i].errors;
+    total.unsent += threads[i].unsent;
+    total.bytes += threads[i].bytes;
+    for (int j = 0; j < LG_MAX_STATUS; j++)
+      total.statuses[j] += threads[i].statuses[j];
+    for (int j = 0; j < LG_BUCKETS; j++)
+      total.latency.counts[j] += threads[i].latency.counts[j];
+    if (threads[i].latency.max > total.latency.max)
+      total.latency.max = threads[i].latency.max;
+  }
+
+  double elapsed = duration;
+  printf("%-24s %9.0f req/s %8.2f MB/s  p50 %8.3f  p99 %8.3f  p99.9 %8.3f  max %8.3f ms"
+      "  errors %llu  unsent %llu\n", label, total.completed / elapsed,
+      total.bytes / elapsed / 1e6,
+      lg_quantile(&total.latency, total.completed, 0.5) / 1e6,
+      lg_quantile(&total.latency, total.completed, 0.99) / 1e6,
+      lg_quantile(&total.latency, total.completed, 0.999) / 1e6,
+      total.latency.max / 1e6, (unsigned long long) total.errors,
+      (unsigned long long) total.unsent);
+  for (int status = 0; status < LG_MAX_STATUS; status++)
+    if (total.statuses[status] > 0 && (status < 200 || status >= 300))
+      printf("%-24s   %llu responses with status %d\n", "",
+          (unsigned long long) total.statuses[status], status);
+  return total.errors > 0 || total.completed == 0;
+}
@@ -0,0 +1,69 @@
+#!/bin/bash
+#
+# Benchmarks httpserver with loadgen, in --files mode and in --proxy mode
+# against stub_upstream, with pool threads and with event loops. Each
+# configuration gets a closed-loop pass (maximum throughput) and an open-loop
+# pass at BENCH_RATE requests per second (latency at a fixed load). Paths are
+# drawn from files/. Run with `make bench`; it fails if any pass has errors.
+#
+# Settings (environment): BENCH_DURATION seconds per pass (5), BENCH_CONNS
+# client connections (32), BENCH_RATE (2000), BENCH_THREADS server threads
+# or loops (4), BENCH_PORT (18080; the stub upstream uses the next port).
+#
+# A pool thread serves one connection at a time, so the pool may grow to
+# BENCH_CONNS threads; with fewer, the connections left queued behind busy
+# keep-alive ones would time out and count as errors.
+
+cd "$(dirname "$0")/.."
+
+DURATION=${BENCH_DURATION:-5}
+CONNS=${BENCH_CONNS:-32}
+RATE=${BENCH_RATE:-2000}
+THREADS=${BENCH_THREADS:-4}
+PORT=${BENCH_PORT:-18080}
+UPSTREAM_PORT=$((PORT + 1))
+
+server=
+stub=
+status=0
+trap '[ -n "$server" ] && kill $server; [ -n "$stub" ] && kill $stub' EXIT
+
+wait_for_port() {
+  for i in $(seq 50); do
+    (exec 3<>/dev/tcp/127.0.0.1/$1) 2>/dev/null && return 0
+    sleep 0.1
+  done
+  echo "Nothing is listening on port $1" >&2
+  exit 1
+}
+
+# run LABEL LOADGEN_OPTIONS SERVER_OPTIONS...
+run() {
+  label=$1
+  options=$2
+  shift 2
+  ./httpserver --port $PORT --quiet "$@" > /dev/null &
+  server=$!
+  wait_for_port $PORT
+  bench/loadgen -c $CONNS -d $DURATION -f files $options -l "$label" 127.0.0.1:$PORT \
+    || status=1
+  bench/loadgen -c $CONNS -d $DURATION -f files $options -r $RATE -l "$label @$RATE/s" \
+    127.0.0.1:$PORT || status=1
+  kill $server
+  wait $server 2> /dev/null
+  server=
+}
+
+bench/stub_upstream $UPSTREAM_PORT files &
+stub=$!
+wait_for_port $UPSTREAM_PORT
+
+echo "$DURATION s per pass, $CONNS connections, $THREADS server threads; latencies in ms"
+POOL="--num-threads $THREADS --max-threads $CONNS"
+run "files pool" "" --files files $POOL
+run "files pool close" "-k" --files files $POOL
+run "files evloop" "" --files files --event-loop --num-threads $THREADS
+run "files evloop close" "-k" --files files --event-loop --num-threads $THREADS
+run "proxy pool" "" --proxy 127.0.0.1:$UPSTREAM_PORT $POOL
+run "proxy evloop" "" --proxy 127.0.0.1:$UPSTREAM_PORT --event-loop --num-threads $THREADS
+exit $status
@@ -0,0 +1,239 @@
+/*
+ * STUB_UPSTREAM is a stand-in proxy target for benchmarks: it loads the files
+ * under a directory into memory and answers GET requests for them from a
+ * single epoll loop, with persistent connections and no disk IO, so that a
+ * --proxy benchmark measures the proxy rather than its upstream.
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define STUB_BUFFER_SIZE 8192
+
+typedef struct stub_file {
+  char *path;
+  char *head;
+  size_t head_length;
+  char *body;
+  size_t body_length;
+} stub_file_t;
+
+typedef struct stub_conn {
+  int fd;
+  char request[STUB_BUFFER_SIZE];
+  size_t request_length;
+  stub_file_t *response; // Being sent; NULL while reading a request.
+  size_t response_sent;
+  int close_after;
+} stub_conn_t;
+
+stub_file_t *stub_files;
+int stub_num_files;
+stub_file_t stub_not_found;
+
+
+char *stub_render_head(int status, size_t length, size_t *head_length) {
+  char *head = malloc(128);
+  *head_length = snprintf(head, 128, "HTTP/1.1 %s\r\nContent-Length: %zu\r\n"
+      "Content-Type: application/octet-stream\r\n\r\n",
+      status == 200 ? "200 OK" : "404 Not Found", length);
+  return head;
+}
+
+
+/* Loads the files under DIRECTORY, served as PREFIX followed by their names. */
+void stub_load(char *directory, char *prefix) {
+  DIR *dir = opendir(directory);
+  if (dir == NULL) {
+    perror(directory);
+    exit(1);
+  }
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] == '.')
+      continue;
+    char path[4096], request_path[1024];
+    struct stat file_stat;
+    snprintf(path, sizeof(path), "%s/%s", directory, entry->d_name);
+    snprintf(request_path, sizeof(request_path), "%s/%s", prefix, entry->d_name);
+    if (stat(path, &file_stat) != 0)
+      continue;
+    if (S_ISDIR(file_stat.st_mode)) {
+      stub_load(path, request_path);
+      continue;
+    }
+    FILE *file = fopen(path, "rb");
+    if (!S_ISREG(file_stat.st_mode) || file == NULL)
+      continue;
+    stub_files = realloc(stub_files, (stub_num_files + 1) * sizeof(stub_file_t));
+    stub_file_t *loaded = &stub_files[stub_num_files++];
+    loaded->path = strdup(request_path);
+    loaded->body_length = file_stat.st_size;
+    loaded->body = malloc(file_stat.st_size + 1);
+    if (fread(loaded->body, 1, file_stat.st_size, file) != (size_t) file_stat.st_size)
+      loaded->body_length = 0;
+    loaded->head = stub_render_head(200, loaded->body_length, &loaded->head_length);
+    fclose(file);
+  }
+  closedir(dir);
+}
+
+
+stub_file_t *stub_find(char *path) {
+  for (int i = 0; i < stub_num_files; i++)
+    if (strcmp(stub_files[i].path, path) == 0)
+      return &stub_files[i];
+  return &stub_not_found;
+}
+
+
+void stub_close(stub_conn_t *conn) {
+  close(conn->fd);
+  free(conn);
+}
+
+
+/* Sends the rest of the response. Returns 1 once it is all out. */
+int stub_send(int epoll_fd, stub_conn_t *conn) {
+  stub_file_t *file = conn->response;
+  while (conn->response_sent < file->head_length + file->body_length) {
+    struct iovec iov[2];
+    int count = 0;
+    size_t skip = conn->response_sent;
+    if (skip < file->head_length) {
+      iov[count].iov_base = file->head + skip;
+      iov[count++].iov_len = file->head_length - skip;
+      skip = 0;
+    } else {
+      skip -= file->head_length;
+    }
+    iov[count].iov_base = file->body + skip;
+    iov[count++].iov_len = file->body_length - skip;
+
+    ssize_t sent = writev(conn->fd, iov, count);
+    if (sent < 0 && errno == EINTR)
+      continue;
+    if (sent < 0 && errno == EAGAIN) {
+      struct epoll_event event = { .events = EPOLLOUT, .data.ptr = conn };
+      epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+      return 0;
+    }
+    if (sent <= 0) {
+      stub_close(conn);
+      return 0;
+    }
+    conn->response_sent += sent;
+  }
+
+  conn->response = NULL;
+  if (conn->close_after) {
+    stub_close(conn);
+    return 0;
+  }
+  struct epoll_event event = { .events = EPOLLIN, .data.ptr = conn };
+  epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+  return 1;
+}
+
+
+void stub_handle(int epoll_fd, stub_conn_t *conn) {
+  if (conn->response != NULL && !stub_send(epoll_fd, conn))
+    return;
+
+  while (1) {
+    /* Answer every complete request in the buffer, in order. */
+    char *end;
+    while (conn->response == NULL
+        && (end = memmem(conn->request, conn->request_length, "\r\n\r\n", 4)) != NULL) {
+      *end = '\0';
+      char *path = strchr(conn->request, ' ');
+      char *path_end = path ? strchr(path + 1, ' ') : NULL;
+      if (path_end == NULL) {
+        stub_close(conn);
+        return;
+      }
+      *path_end = '\0';
+      conn->close_after = strcasestr(path_end + 1, "Connection: close") != NULL;
+      conn->response = stub_find(path + 1);
+      conn->response_sent = 0;
+
+      size_t used = end + 4 - conn->request;
+      conn->request_length -= used;
+      memmove(conn->request, end + 4, conn->request_length);
+      if (!stub_send(epoll_fd, conn))
+        return;
+    }
+
+    if (conn->request_length == sizeof(conn->request)) {
+      stub_close(conn);
+      return;
+    }
+    ssize_t received = recv(conn->fd, conn->request + conn->request_length,
+        sizeof(conn->request) - conn->request_length, 0);
+    if (received < 0 && errno == EINTR)
+      continue;
+    if (received < 0 && errno == EAGAIN)
+      return;
+    if (received <= 0) {
+      stub_close(conn);
+      return;
+    }
+    conn->request_length += received;
+  }
+}
+
+
+int main(int argc, char **argv) {
+  if (argc != 3) {
+    fprintf(stderr, "Usage: stub_upstream PORT DIRECTORY\n");
+    return 1;
+  }
+  stub_load(argv[2], "");
+  stub_not_found.head = stub_render_head(404, 0, &stub_not_found.head_length);
+  stub_not_found.body = "";
+
+  int listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  int one = 1;
+  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  struct sockaddr_in address = { .sin_family = AF_INET,
+    .sin_addr.s_addr = htonl(INADDR_LOOPBACK), .sin_port = htons(atoi(argv[1])) };
+  if (bind(listener, (struct sockaddr *) &address, sizeof(address)) != 0
+      || listen(listener, 1024) != 0) {
+    perror("Failed to listen");
+    return 1;
+  }
+
+  int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listener, &event);
+
+  while (1) {
+    struct epoll_event events[64];
+    int count = epoll_wait(epoll_fd, events, 64, -1);
+    for (int i = 0; i < count; i++) {
+      if (events[i].data.ptr != NULL) {
+        stub_handle(epoll_fd, events[i].data.ptr);
+        continue;
+      }
+      int fd;
+      while ((fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        stub_conn_t *conn = calloc(1, sizeof(stub_conn_t));
+        conn->fd = fd;
+        struct epoll_event conn_event = { .events = EPOLLIN, .data.ptr = conn };
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &conn_event);
+      }
+    }
+  }
+}
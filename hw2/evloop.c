@@ -0,0 +1,858 @@
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "alog.h"
+#include "evloop.h"
+#include "httpserver.h"
+#include "libhttp.h"
+#include "metrics.h"
+#include "proxy.h"
+#include "relay.h"
+#include "tpool.h"
+#include "upstream.h"
+
+#define EV_MAX_EVENTS 256
+#define EV_WHEEL_SLOTS 512 // Must be a power of two.
+#define EV_WHEEL_TICK_MS 100
+
+enum ev_state {
+  EV_READ_REQUEST,  /* Waiting for a complete request from the client. */
+  EV_SEND_RESPONSE, /* Writing a prepared file_response to the client. */
+  EV_PROXY_PEEK,    /* Waiting for the request path to pick a backend by. */
+  EV_PROXY_CONNECT, /* Waiting for the non-blocking connect() to upstream. */
+  EV_PROXY_RELAY,   /* Relaying bytes between the client and upstream. */
+  EV_PROXY_HTTP,    /* Forwarding requests with the HTTP-aware proxy. */
+  EV_LINGER,        /* Discarding a request body before closing. */
+};
+
+struct ev_conn;
+struct evloop;
+
+/* A socket registered with epoll. The listening socket has no connection. */
+typedef struct ev_endpoint {
+  struct ev_conn *conn;
+  int fd;
+  uint32_t events; // Events currently registered with epoll.
+  int registered;
+} ev_endpoint_t;
+
+typedef struct ev_conn {
+  struct evloop *loop;
+  enum ev_state state;
+  ev_endpoint_t client;
+  ev_endpoint_t upstream;
+  ev_endpoint_t waiter; // The proxy's wait_fd, while it waits for the cache.
+
+  struct http_buffer *buffer; // Allocated while request bytes are buffered.
+  struct http_request *request; // In buffer, being answered; NULL if malformed.
+  int requests_served;
+  long accepted; // ev_now() when the client connected.
+  char client_address[INET_ADDRSTRLEN]; // For the access log.
+
+  struct file_response response;
+  size_t response_sent; // Bytes of head, body and file written so far.
+  long long linger_started; // metrics_now() time of the lingering close.
+  size_t lingered;          // Bytes discarded since.
+
+  relay_channel_t to_upstream;
+  relay_channel_t to_client;
+  int upstream_shut;
+  int proxy_failed;
+  upstream_t *backend;  // The backend upstream is connected to, if any.
+  uint64_t tried;       // Backends that could not be reached.
+  uint32_t hash;        // For choosing a backend with UPSTREAM_HASH.
+  long connect_started;
+  proxy_conn_t *proxy; // With the HTTP-aware proxy; owns upstream.fd then.
+
+  /* Position in the loop's timer wheel while a timeout runs. */
+  long deadline; // ev_now() time at which it runs out, 0 if none runs.
+  enum metrics_timeout timeout;
+  int timer_slot;
+  struct ev_conn *timer_prev;
+  struct ev_conn *timer_next;
+
+  int closed;
+  struct ev_conn *next_closed;
+} ev_conn_t;
+
+typedef struct evloop {
+  int epoll_fd;
+  ev_endpoint_t listener;
+  int proxy_mode;
+  ev_conn_t *closed; // Connections to free once the current batch is done.
+  relay_pool_t pipes; // Pipes for splicing proxied connections.
+
+  /* Connections whose timeout runs, in the slot of the tick (of
+   * EV_WHEEL_TICK_MS) their deadline falls in, modulo EV_WHEEL_SLOTS.
+   * Deadlines a turn of the wheel or more away wait in their slot until the
+   * wheel comes round to them, so a timeout of any length costs the same to
+   * start, restart and stop. */
+  ev_conn_t *wheel[EV_WHEEL_SLOTS];
+  long wheel_tick; // The earliest tick whose slot may hold expired timeouts.
+} evloop_t;
+
+
+void ev_read_request(evloop_t *loop, ev_conn_t *conn);
+void ev_send_response(evloop_t *loop, ev_conn_t *conn);
+
+
+long ev_now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+
+void ev_timer_stop(evloop_t *loop, ev_conn_t *conn) {
+  if (conn->deadline == 0)
+    return;
+  if (conn->timer_prev) conn->timer_prev->timer_next = conn->timer_next;
+  else loop->wheel[conn->timer_slot] = conn->timer_next;
+  if (conn->timer_next) conn->timer_next->timer_prev = conn->timer_prev;
+  conn->timer_prev = conn->timer_next = NULL;
+  conn->deadline = 0;
+}
+
+
+/*
+ * (Re)starts the timeout of CONN: unless it is stopped or restarted first,
+ * the connection is closed, and counted as having run out of TIMEOUT, once
+ * TIMEOUT_MS have passed since SINCE (an ev_now() time). A TIMEOUT_MS of -1
+ * (see server_timeout_ms) only stops the running one.
+ */
+void ev_timer_start(evloop_t *loop, ev_conn_t *conn, enum metrics_timeout timeout,
+    long since, int timeout_ms) {
+  ev_timer_stop(loop, conn);
+  if (timeout_ms < 0)
+    return;
+
+  conn->deadline = since + timeout_ms;
+  conn->timeout = timeout;
+  long tick = conn->deadline / EV_WHEEL_TICK_MS;
+  if (tick < loop->wheel_tick)
+    tick = loop->wheel_tick;
+  conn->timer_slot = tick & (EV_WHEEL_SLOTS - 1);
+  conn->timer_next = loop->wheel[conn->timer_slot];
+  if (conn->timer_next) conn->timer_next->timer_prev = conn;
+  loop->wheel[conn->timer_slot] = conn;
+}
+
+
+/*
+ * Starts the timeout for CONN, which is waiting for request bytes: the
+ * keep-alive timeout until its next request begins, then the header timeout
+ * from the request's first byte (for the first request, from the connect)
+ * until its head is complete. While the body of the last request is being
+ * skipped, the body timeout runs instead.
+ */
+void ev_timer_read(evloop_t *loop, ev_conn_t *conn) {
+  struct http_buffer *buffer = conn->buffer;
+  int header_ms = server_timeout_ms(server_header_timeout);
+  if (buffer != NULL && buffer->discard > 0)
+    ev_timer_start(loop, conn, METRICS_TIMEOUT_BODY, ev_now(),
+        server_timeout_ms(server_body_timeout));
+  else if (buffer != NULL && buffer->started > 0)
+    ev_timer_start(loop, conn, METRICS_TIMEOUT_HEADER, buffer->started / 1000000, header_ms);
+  else if (conn->requests_served > 0)
+    ev_timer_start(loop, conn, METRICS_TIMEOUT_IDLE, ev_now(),
+        server_keep_alive_timeout * 1000);
+  else
+    ev_timer_start(loop, conn, METRICS_TIMEOUT_HEADER, conn->accepted, header_ms);
+}
+
+
+int ev_set_nonblocking(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags < 0) return -1;
+  return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+
+/*
+ * Makes epoll report EVENTS for ENDPOINT. An endpoint that is not interested
+ * in anything is removed from epoll, since EPOLLHUP cannot be masked and would
+ * otherwise be reported over and over.
+ */
+void ev_watch(evloop_t *loop, ev_endpoint_t *endpoint, uint32_t events) {
+  if (events == 0) {
+    if (endpoint->registered)
+      epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, endpoint->fd, NULL);
+    endpoint->registered = 0;
+    endpoint->events = 0;
+    return;
+  }
+
+  if (endpoint->registered && endpoint->events == events)
+    return;
+
+  struct epoll_event event;
+  event.events = events;
+  event.data.ptr = endpoint;
+  if (epoll_ctl(loop->epoll_fd, endpoint->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+        endpoint->fd, &event) == -1) {
+    perror("Failed to update epoll registration");
+    return;
+  }
+  endpoint->registered = 1;
+  endpoint->events = events;
+}
+
+
+/*
+ * Closes both sockets of CONN. The memory is only released after the current
+ * batch of events, which may still refer to this connection.
+ */
+void ev_close(evloop_t *loop, ev_conn_t *conn) {
+  ev_timer_stop(loop, conn);
+  if (conn->proxy != NULL)
+    proxy_conn_free(conn->proxy);
+  client_close(conn->client.fd);
+  if (conn->upstream.fd >= 0)
+    close(conn->upstream.fd);
+  if (conn->backend != NULL)
+    upstream_release(conn->backend);
+  file_response_release(&conn->response);
+  relay_channel_release(&loop->pipes, &conn->to_upstream);
+  relay_channel_release(&loop->pipes, &conn->to_client);
+
+  conn->closed = 1;
+  conn->next_closed = loop->closed;
+  loop->closed = conn;
+}
+
+
+void ev_free_closed(evloop_t *loop) {
+  while (loop->closed != NULL) {
+    ev_conn_t *conn = loop->closed;
+    loop->closed = conn->next_closed;
+    free(conn->buffer);
+    free(conn);
+  }
+}
+
+
+/*
+ * Reads as much of the next request as is available. Once a request is
+ * complete (or the buffer is full), prepares the response and starts sending.
+ * Connections waiting for more bytes are subject to the timeouts of
+ * ev_timer_read.
+ */
+void ev_read_request(evloop_t *loop, ev_conn_t *conn) {
+  if (conn->buffer == NULL) {
+    conn->buffer = malloc(sizeof(struct http_buffer));
+    http_buffer_init(conn->buffer);
+  }
+
+  enum http_parse_status status;
+  while ((status = http_buffer_parse(conn->buffer)) == HTTP_PARSE_INCOMPLETE) {
+    ssize_t bytes_read = http_buffer_fill(conn->client.fd, conn->buffer);
+    if (bytes_read > 0 || (bytes_read < 0 && errno == EINTR))
+      continue;
+    if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      ev_timer_read(loop, conn);
+      ev_watch(loop, &conn->client, EPOLLIN);
+      return;
+    }
+    ev_close(loop, conn);
+    return;
+  }
+
+  ev_timer_stop(loop, conn);
+  conn->requests_served++;
+  metrics_parsed(conn->buffer->started);
+
+  conn->request = status == HTTP_PARSE_COMPLETE ? &conn->buffer->request : NULL;
+  if (conn->proxy_failed) {
+    prepare_bad_gateway_response(&conn->response);
+  } else {
+    /* A chunked body is not skipped; the connection ends with it instead. */
+    conn->response.keep_alive = request_keep_alive(conn->request, conn->requests_served)
+        && !conn->request->chunked;
+    prepare_files_response(conn->request, &conn->response);
+  }
+  conn->response.started = conn->buffer->started;
+
+  conn->state = EV_SEND_RESPONSE;
+  conn->response_sent = 0;
+  ev_send_response(loop, conn);
+}
+
+
+/*
+ * Reads and discards what the client sends after its last response, which
+ * has been shut down, and closes the connection once it closes its end,
+ * stalls for the body timeout or reaches the linger limits (see
+ * client_linger).
+ */
+void ev_linger(evloop_t *loop, ev_conn_t *conn) {
+  char discard[4096];
+  ssize_t received = 0;
+  while (conn->lingered < SERVER_LINGER_MAX_BYTES
+      && (received = recv(conn->client.fd, discard, sizeof(discard), 0)) > 0)
+    conn->lingered += received;
+  int wait_ms = server_linger_ms(conn->linger_started);
+  if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+      && wait_ms > 0) {
+    ev_timer_start(loop, conn, METRICS_TIMEOUT_BODY, ev_now(), wait_ms);
+    ev_watch(loop, &conn->client, EPOLLIN);
+    return;
+  }
+  ev_close(loop, conn);
+}
+
+
+/*
+ * The response has been sent. Closes the connection, or goes back to reading
+ * with the next pipelined request if one is already buffered.
+ */
+void ev_finish_response(evloop_t *loop, ev_conn_t *conn) {
+  metrics_response(conn->response.status, conn->response_sent);
+  if (conn->proxy != NULL)
+    proxy_log(conn->proxy, conn->response.status, conn->response_sent);
+  else
+    alog_request(conn->client_address, conn->request ? conn->request->method : NULL,
+        conn->request ? conn->request->path : NULL, conn->response.status,
+        conn->response_sent, conn->response.started);
+  file_response_release(&conn->response);
+  if (conn->request != NULL && conn->request->chunked) {
+    shutdown(conn->client.fd, SHUT_WR);
+    conn->state = EV_LINGER;
+    conn->linger_started = metrics_now();
+    ev_linger(loop, conn);
+    return;
+  }
+  if (!conn->response.keep_alive) {
+    ev_close(loop, conn);
+    return;
+  }
+
+  conn->state = EV_READ_REQUEST;
+  http_buffer_consume(conn->buffer);
+  if (conn->buffer->length == 0 && conn->buffer->discard == 0) {
+    free(conn->buffer);
+    conn->buffer = NULL;
+    ev_timer_read(loop, conn);
+    ev_watch(loop, &conn->client, EPOLLIN);
+    return;
+  }
+  ev_read_request(loop, conn);
+}
+
+
+/*
+ * Writes the prepared response until the socket would block, then waits for
+ * EPOLLOUT, for at most the body timeout at a time. File contents go out with
+ * http_send_file, so they are not copied through user space.
+ */
+void ev_send_response(evloop_t *loop, ev_conn_t *conn) {
+  if (file_response_send(conn->client.fd, &conn->response, &conn->response_sent) == 0) {
+    ev_finish_response(loop, conn);
+  } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+    ev_timer_start(loop, conn, METRICS_TIMEOUT_BODY, ev_now(),
+        server_timeout_ms(server_body_timeout));
+    ev_watch(loop, &conn->client, EPOLLOUT);
+  } else {
+    ev_close(loop, conn);
+  }
+}
+
+
+/*
+ * The HTTP-aware proxy cannot forward the client's request: answers it with
+ * STATUS and closes the connection.
+ */
+void ev_proxy_error(evloop_t *loop, ev_conn_t *conn, int status) {
+  ev_timer_stop(loop, conn);
+  ev_watch(loop, &conn->upstream, 0);
+  ev_watch(loop, &conn->waiter, 0);
+  if (status == 502) {
+    prepare_bad_gateway_response(&conn->response);
+  } else {
+    conn->response.keep_alive = 0;
+    prepare_error_response(&conn->response, status);
+  }
+  conn->state = EV_SEND_RESPONSE;
+  conn->response_sent = 0;
+  ev_send_response(loop, conn);
+}
+
+
+uint32_t ev_proxy_events(int wants) {
+  return (wants & PROXY_READ ? EPOLLIN : 0) | (wants & PROXY_WRITE ? EPOLLOUT : 0);
+}
+
+
+/* The HTTP-aware proxy is letting go of its upstream connection. */
+void ev_proxy_detach(proxy_conn_t *proxy) {
+  ev_conn_t *conn = proxy->data;
+  ev_watch(conn->loop, &conn->upstream, 0);
+  conn->upstream.fd = -1;
+}
+
+
+void ev_proxy_connect(evloop_t *loop, ev_conn_t *conn);
+
+
+/*
+ * Runs the HTTP-aware proxy of CONN until it has to wait, and watches the
+ * sockets it waits for, with the timeout proxy_timeout() gives. Connections
+ * to backends are made by ev_proxy_connect, as for the relay.
+ */
+void ev_proxy_http(evloop_t *loop, ev_conn_t *conn) {
+  proxy_conn_t *proxy = conn->proxy;
+  conn->state = EV_PROXY_HTTP;
+  enum metrics_timeout timeout;
+  int timeout_ms;
+
+  switch (proxy_pump(proxy)) {
+    case PROXY_WAIT:
+      timeout_ms = proxy_timeout(proxy, &timeout);
+      ev_timer_start(loop, conn, timeout, ev_now(), timeout_ms);
+      ev_watch(loop, &conn->client, ev_proxy_events(proxy->client_wants));
+      if (conn->upstream.fd >= 0)
+        ev_watch(loop, &conn->upstream, ev_proxy_events(proxy->upstream_wants));
+      conn->waiter.fd = proxy->wait_fd;
+      if (conn->waiter.fd >= 0)
+        ev_watch(loop, &conn->waiter, proxy->waiting ? EPOLLIN : 0);
+      break;
+    case PROXY_UPSTREAM:
+      ev_watch(loop, &conn->client, 0);
+      ev_watch(loop, &conn->waiter, 0);
+      conn->hash = proxy->hash;
+      conn->tried = 0;
+      ev_proxy_connect(loop, conn);
+      break;
+    case PROXY_DONE:
+      ev_close(loop, conn);
+      break;
+    case PROXY_ERROR:
+      ev_proxy_error(loop, conn, proxy->error_status);
+      break;
+  }
+}
+
+
+/*
+ * Closes the connection to the backend that CONN was trying to reach.
+ */
+void ev_proxy_drop(evloop_t *loop, ev_conn_t *conn) {
+  if (conn->upstream.fd >= 0) {
+    ev_watch(loop, &conn->upstream, 0);
+    close(conn->upstream.fd);
+    conn->upstream.fd = -1;
+  }
+  if (conn->backend != NULL) {
+    upstream_release(conn->backend);
+    conn->backend = NULL;
+  }
+}
+
+
+/*
+ * No proxy target could be reached. Like the blocking proxy, reads the
+ * client's request before answering with 502 Bad Gateway.
+ */
+void ev_bad_gateway(evloop_t *loop, ev_conn_t *conn) {
+  ev_proxy_drop(loop, conn);
+  if (conn->proxy != NULL) {
+    ev_proxy_error(loop, conn, 502);
+    return;
+  }
+
+  conn->proxy_failed = 1;
+  conn->state = EV_READ_REQUEST;
+  ev_timer_read(loop, conn);
+  ev_watch(loop, &conn->client, EPOLLIN);
+}
+
+
+/*
+ * Recomputes what each side of a relayed connection is waiting for. The
+ * client's end of file is forwarded as a half-close, and the connection is
+ * done once the upstream response has been fully delivered, or once neither
+ * side has been ready for the body timeout.
+ */
+void ev_relay_update(evloop_t *loop, ev_conn_t *conn) {
+  relay_channel_t *to_upstream = &conn->to_upstream;
+  relay_channel_t *to_client = &conn->to_client;
+
+  if (relay_channel_done(to_upstream) && !conn->upstream_shut) {
+    shutdown(conn->upstream.fd, SHUT_WR);
+    conn->upstream_shut = 1;
+  }
+
+  if (relay_channel_done(to_client)) {
+    ev_close(loop, conn);
+    return;
+  }
+
+  uint32_t client_events = 0, upstream_events = 0;
+  if (relay_channel_wants_read(to_upstream))
+    client_events |= EPOLLIN;
+  if (to_client->pending > 0)
+    client_events |= EPOLLOUT;
+  if (relay_channel_wants_read(to_client))
+    upstream_events |= EPOLLIN;
+  if (to_upstream->pending > 0)
+    upstream_events |= EPOLLOUT;
+
+  ev_timer_start(loop, conn, METRICS_TIMEOUT_BODY, ev_now(),
+      server_timeout_ms(server_body_timeout));
+  ev_watch(loop, &conn->client, client_events);
+  ev_watch(loop, &conn->upstream, upstream_events);
+}
+
+
+/*
+ * Splices whatever ENDPOINT's events allow: its incoming bytes towards the
+ * peer, and the peer's pending bytes towards it.
+ */
+void ev_relay(evloop_t *loop, ev_conn_t *conn, ev_endpoint_t *endpoint,
+    uint32_t events) {
+  int from_client = endpoint == &conn->client;
+  ev_endpoint_t *peer = from_client ? &conn->upstream : &conn->client;
+  relay_channel_t *incoming = from_client ? &conn->to_upstream : &conn->to_client;
+  relay_channel_t *outgoing = from_client ? &conn->to_client : &conn->to_upstream;
+
+  if ((events & EPOLLIN)
+      && relay_pump(&loop->pipes, incoming, endpoint->fd, peer->fd) < 0) {
+    ev_close(loop, conn);
+    return;
+  }
+  if ((events & EPOLLOUT)
+      && relay_pump(&loop->pipes, outgoing, peer->fd, endpoint->fd) < 0) {
+    ev_close(loop, conn);
+    return;
+  }
+  ev_relay_update(loop, conn);
+}
+
+
+void ev_start_relay(evloop_t *loop, ev_conn_t *conn) {
+  conn->state = EV_PROXY_RELAY;
+  ev_relay_update(loop, conn);
+}
+
+
+/*
+ * CONN is connected to its backend (with a connection from the pool if
+ * POOLED): starts relaying, or hands the connection to the HTTP-aware proxy.
+ */
+void ev_proxy_ready(evloop_t *loop, ev_conn_t *conn, int pooled) {
+  if (conn->proxy == NULL) {
+    ev_start_relay(loop, conn);
+    return;
+  }
+
+  ev_watch(loop, &conn->upstream, 0);
+  proxy_set_upstream(conn->proxy, conn->backend, conn->upstream.fd, pooled);
+  conn->backend = NULL;
+  ev_proxy_http(loop, conn);
+}
+
+
+/*
+ * Connects CONN to the backend chosen by the balancing policy, trying the
+ * others in turn if it cannot be reached, and starts relaying once connected.
+ */
+void ev_proxy_connect(evloop_t *loop, ev_conn_t *conn) {
+  conn->state = EV_PROXY_CONNECT;
+
+  upstream_t *backend;
+  while ((backend = upstream_choose(conn->hash, conn->tried)) != NULL) {
+    conn->tried |= 1ULL << upstream_index(backend);
+
+    int target_fd = upstream_get(backend);
+    if (target_fd >= 0) {
+      conn->backend = backend;
+      conn->upstream.fd = target_fd;
+      ev_set_nonblocking(target_fd);
+      ev_proxy_ready(loop, conn, 1);
+      return;
+    }
+
+    struct sockaddr_in target_address;
+    if (upstream_resolve(backend, &target_address) != 0) {
+      upstream_report(backend, 0, 0);
+      continue;
+    }
+
+    target_fd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (target_fd == -1) {
+      fprintf(stderr, "Failed to create a new socket: error %d: %s\n", errno, strerror(errno));
+      ev_close(loop, conn);
+      return;
+    }
+
+    upstream_acquire(backend);
+    conn->backend = backend;
+    conn->upstream.fd = target_fd;
+    conn->connect_started = ev_now();
+
+    if (connect(target_fd, (struct sockaddr *) &target_address,
+          sizeof(target_address)) == 0 || errno == EINPROGRESS) {
+      ev_timer_start(loop, conn, METRICS_TIMEOUT_CONNECT, conn->connect_started,
+          upstream_connect_timeout());
+      ev_watch(loop, &conn->upstream, EPOLLOUT);
+      return;
+    }
+    upstream_report(backend, 0, 0);
+    ev_proxy_drop(loop, conn);
+  }
+
+  ev_bad_gateway(loop, conn);
+}
+
+
+/* The connect of CONN failed or timed out: tries the next backend. */
+void ev_proxy_connect_failed(evloop_t *loop, ev_conn_t *conn) {
+  upstream_report(conn->backend, 0, ev_now() - conn->connect_started);
+  ev_proxy_drop(loop, conn);
+  ev_proxy_connect(loop, conn);
+}
+
+
+void ev_proxy_connected(evloop_t *loop, ev_conn_t *conn) {
+  int error = 0;
+  socklen_t error_length = sizeof(error);
+  if (getsockopt(conn->upstream.fd, SOL_SOCKET, SO_ERROR, &error, &error_length) < 0
+      || error != 0) {
+    ev_proxy_connect_failed(loop, conn);
+    return;
+  }
+
+  upstream_report(conn->backend, 1, ev_now() - conn->connect_started);
+  ev_proxy_ready(loop, conn, 0);
+}
+
+
+/*
+ * With UPSTREAM_HASH, hashes the path of the client's first request once it
+ * arrives, leaving the bytes in the socket for the relay, and then connects.
+ */
+void ev_proxy_peek(evloop_t *loop, ev_conn_t *conn) {
+  char data[LIBHTTP_REQUEST_MAX_SIZE];
+  ssize_t length = recv(conn->client.fd, data, sizeof(data), MSG_PEEK | MSG_DONTWAIT);
+  if (length < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    return;
+
+  conn->hash = proxy_request_hash(data, length > 0 ? length : 0);
+  ev_timer_stop(loop, conn);
+  ev_watch(loop, &conn->client, 0);
+  ev_proxy_connect(loop, conn);
+}
+
+
+void ev_accept(evloop_t *loop) {
+  while (1) {
+    struct sockaddr_in client_address;
+    socklen_t client_address_length = sizeof(client_address);
+    int fd = accept4(loop->listener.fd, (struct sockaddr *) &client_address,
+        &client_address_length, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        perror("Error accepting socket");
+      return;
+    }
+
+    if (client_accepted(fd, &client_address) != 0)
+      continue;
+
+    ev_conn_t *conn = calloc(1, sizeof(ev_conn_t));
+    conn->loop = loop;
+    conn->accepted = ev_now();
+    conn->client.conn = conn;
+    conn->client.fd = fd;
+    conn->upstream.conn = conn;
+    conn->upstream.fd = -1;
+    conn->waiter.conn = conn;
+    conn->waiter.fd = -1;
+    conn->response.file_fd = -1;
+    if (alog_enabled())
+      inet_ntop(AF_INET, &client_address.sin_addr, conn->client_address,
+          sizeof(conn->client_address));
+    relay_channel_init(&conn->to_upstream);
+    relay_channel_init(&conn->to_client);
+
+    if (loop->proxy_mode && server_proxy_http) {
+      conn->proxy = proxy_conn_new(fd);
+      conn->proxy->detach = ev_proxy_detach;
+      conn->proxy->data = conn;
+      ev_proxy_http(loop, conn);
+    } else if (loop->proxy_mode && upstream_policy() == UPSTREAM_HASH) {
+      conn->state = EV_PROXY_PEEK;
+      ev_timer_read(loop, conn);
+      ev_watch(loop, &conn->client, EPOLLIN);
+    } else if (loop->proxy_mode) {
+      ev_proxy_connect(loop, conn);
+    } else {
+      conn->state = EV_READ_REQUEST;
+      ev_timer_read(loop, conn);
+      ev_watch(loop, &conn->client, EPOLLIN);
+    }
+  }
+}
+
+
+void ev_handle(evloop_t *loop, ev_endpoint_t *endpoint, uint32_t events) {
+  if (endpoint->conn == NULL) {
+    ev_accept(loop);
+    return;
+  }
+
+  ev_conn_t *conn = endpoint->conn;
+  if (conn->closed)
+    return;
+
+  /* Let the read or write that is waiting discover the error. */
+  if (events & (EPOLLERR | EPOLLHUP))
+    events |= EPOLLIN | EPOLLOUT;
+
+  switch (conn->state) {
+    case EV_READ_REQUEST:
+      ev_read_request(loop, conn);
+      break;
+    case EV_SEND_RESPONSE:
+      ev_send_response(loop, conn);
+      break;
+    case EV_PROXY_PEEK:
+      ev_proxy_peek(loop, conn);
+      break;
+    case EV_PROXY_CONNECT:
+      ev_proxy_connected(loop, conn);
+      break;
+    case EV_PROXY_RELAY:
+      ev_relay(loop, conn, endpoint, events);
+      break;
+    case EV_PROXY_HTTP:
+      ev_proxy_http(loop, conn);
+      break;
+    case EV_LINGER:
+      ev_linger(loop, conn);
+      break;
+  }
+}
+
+
+/*
+ * Closes the connections whose timeout has run out, except that a proxied
+ * request the upstream kept waiting is answered with 504 first, and a
+ * connect to a backend that takes too long moves on to the next backend.
+ * Returns how long the loop may wait for events before there may be more:
+ * until the end of the next tick whose slot is not empty, or -1 if all are.
+ */
+int ev_expire(evloop_t *loop) {
+  long now = ev_now();
+  long tick = now / EV_WHEEL_TICK_MS;
+  if (tick - loop->wheel_tick >= EV_WHEEL_SLOTS)
+    loop->wheel_tick = tick - EV_WHEEL_SLOTS + 1;
+
+  for (; loop->wheel_tick <= tick; loop->wheel_tick++) {
+    ev_conn_t *conn = loop->wheel[loop->wheel_tick & (EV_WHEEL_SLOTS - 1)];
+    while (conn != NULL) {
+      ev_conn_t *next = conn->timer_next;
+      if (conn->deadline <= now) {
+        metrics_timeout(conn->timeout);
+        ev_timer_stop(loop, conn);
+        if (conn->state == EV_PROXY_CONNECT)
+          ev_proxy_connect_failed(loop, conn);
+        else if (conn->state == EV_PROXY_HTTP && proxy_expire(conn->proxy) == PROXY_ERROR)
+          ev_proxy_error(loop, conn, conn->proxy->error_status);
+        else
+          ev_close(loop, conn);
+      }
+      conn = next;
+    }
+  }
+  /* Timeouts later in the current tick are still in its slot. */
+  loop->wheel_tick = tick;
+
+  for (long ahead = tick; ahead < tick + EV_WHEEL_SLOTS; ahead++)
+    if (loop->wheel[ahead & (EV_WHEEL_SLOTS - 1)] != NULL)
+      return (ahead + 1) * EV_WHEEL_TICK_MS - now;
+  return -1;
+}
+
+
+void *ev_run(void *args) {
+  evloop_t *loop = args;
+  struct epoll_event events[EV_MAX_EVENTS];
+  tpool_pin();
+  loop->wheel_tick = ev_now() / EV_WHEEL_TICK_MS;
+  int timeout = -1;
+
+  while (1) {
+    int num_events = epoll_wait(loop->epoll_fd, events, EV_MAX_EVENTS, timeout);
+    if (num_events < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("Failed to wait for events");
+      exit(errno);
+    }
+
+    for (int i = 0; i < num_events; i++)
+      ev_handle(loop, events[i].data.ptr, events[i].events);
+
+    timeout = ev_expire(loop);
+    ev_free_closed(loop);
+  }
+
+  return NULL;
+}
+
+
+/*
+ * Starts one event loop per core (or num_threads of them if --num-threads was
+ * given), each with its own epoll instance and SO_REUSEPORT listening socket
+ * on server_port. Saves the fd of the first listening socket in
+ * *socket_number and runs the first loop on the calling thread.
+ */
+void evloop_serve_forever(int *socket_number, int proxy_mode) {
+  int num_loops = num_threads > 0 ? num_threads : sysconf(_SC_NPROCESSORS_ONLN);
+  if (num_loops < 1)
+    num_loops = 1;
+
+  evloop_t *loops = calloc(num_loops, sizeof(evloop_t));
+  for (int i = 0; i < num_loops; i++) {
+    evloop_t *loop = &loops[i];
+    loop->proxy_mode = proxy_mode;
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd == -1) {
+      perror("Failed to create epoll instance");
+      exit(errno);
+    }
+
+    loop->listener.conn = NULL;
+    loop->listener.fd = open_server_socket(server_port, 1);
+    ev_set_nonblocking(loop->listener.fd);
+    ev_watch(loop, &loop->listener, EPOLLIN);
+  }
+
+  *socket_number = loops[0].listener.fd;
+  printf("Listening on port %d with %d event loops...\n", server_port, num_loops);
+
+  for (int i = 1; i < num_loops; i++) {
+    pthread_t thread;
+    pthread_create(&thread, NULL, ev_run, &loops[i]);
+    pthread_detach(thread);
+  }
+
+  ev_run(&loops[0]);
+}
@@ -0,0 +1,13 @@
+#ifndef __EVLOOP__
+#define __EVLOOP__
+
+/* EVLOOP serves connections from non-blocking epoll loops instead of handing
+ * each accepted socket to a pool thread. Every loop runs on its own thread and
+ * owns an SO_REUSEPORT listening socket, so the kernel spreads new connections
+ * across the loops. A connection is a small state machine (read request ->
+ * send response, or connect -> relay or forward requests for the proxy), so
+ * idle or slow clients only cost memory, not a thread. */
+
+void evloop_serve_forever(int *socket_number, int proxy_mode);
+
+#endif
@@ -0,0 +1,228 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fcache.h"
+
+#define FCACHE_BUCKETS 4096
+
+pthread_mutex_t fcache_mutex = PTHREAD_MUTEX_INITIALIZER;
+fcache_entry_t *fcache_table[FCACHE_BUCKETS];
+fcache_entry_t *fcache_lru_head; // Most recently used.
+fcache_entry_t *fcache_lru_tail;
+size_t fcache_capacity;
+size_t fcache_size;
+int fcache_revalidate_ms;
+
+/* Initializes the cache to hold up to CAPACITY bytes. 0 disables it. */
+void fcache_init(size_t capacity, int revalidate_ms) {
+  fcache_capacity = capacity;
+  fcache_revalidate_ms = revalidate_ms;
+}
+
+int fcache_enabled() {
+  return fcache_capacity > 0;
+}
+
+long fcache_now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+uint32_t fcache_hash(char *key) {
+  uint32_t hash = 2166136261u;
+  for (; *key != '\0'; key++)
+    hash = (hash ^ (unsigned char) *key) * 16777619u;
+  return hash;
+}
+
+size_t fcache_entry_size(fcache_entry_t *entry) {
+  return sizeof(fcache_entry_t) + strlen(entry->key) + strlen(entry->path)
+      + entry->head_length + entry->body_length;
+}
+
+void fcache_free(fcache_entry_t *entry) {
+  free(entry->key);
+  free(entry->path);
+  free(entry->head);
+  free(entry->body);
+  free(entry);
+}
+
+void fcache_lru_unlink(fcache_entry_t *entry) {
+  if (entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+  else fcache_lru_head = entry->lru_next;
+  if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+  else fcache_lru_tail = entry->lru_prev;
+  entry->lru_prev = entry->lru_next = NULL;
+}
+
+void fcache_lru_push(fcache_entry_t *entry) {
+  entry->lru_next = fcache_lru_head;
+  if (fcache_lru_head) fcache_lru_head->lru_prev = entry;
+  else fcache_lru_tail = entry;
+  fcache_lru_head = entry;
+}
+
+/* Takes ENTRY out of the cache. Must be called with fcache_mutex held. */
+void fcache_remove(fcache_entry_t *entry) {
+  fcache_entry_t **link = &fcache_table[fcache_hash(entry->key) % FCACHE_BUCKETS];
+  while (*link != entry)
+    link = &(*link)->hash_next;
+  *link = entry->hash_next;
+  fcache_lru_unlink(entry);
+
+  fcache_size -= fcache_entry_size(entry);
+  entry->cached = 0;
+  if (--entry->refcount == 0)
+    fcache_free(entry);
+}
+
+/* Returns 1 if ST still describes the file ENTRY was made from. */
+int fcache_entry_current(fcache_entry_t *entry, struct stat *st) {
+  return (st->st_mode & S_IFMT) == entry->type && st->st_dev == entry->dev && st->st_ino == entry->ino
+      && st->st_size == entry->size && st->st_mtim.tv_sec == entry->mtime.tv_sec
+      && st->st_mtim.tv_nsec == entry->mtime.tv_nsec;
+}
+
+/*
+ * Returns the entry cached for KEY with a reference held for the caller, or
+ * NULL if there is none or the file has changed since it was cached.
+ */
+fcache_entry_t *fcache_lookup(char *key) {
+  if (!fcache_enabled())
+    return NULL;
+
+  pthread_mutex_lock(&fcache_mutex);
+  fcache_entry_t *entry = fcache_table[fcache_hash(key) % FCACHE_BUCKETS];
+  while (entry != NULL && strcmp(entry->key, key) != 0)
+    entry = entry->hash_next;
+  if (entry == NULL) {
+    pthread_mutex_unlock(&fcache_mutex);
+    return NULL;
+  }
+  entry->refcount++;
+  long checked_at = entry->checked_at;
+  pthread_mutex_unlock(&fcache_mutex);
+
+  /* Revalidate outside the lock; stat() may have to go to disk. */
+  long now = fcache_now();
+  if (now - checked_at >= fcache_revalidate_ms) {
+    struct stat st;
+    int current = stat(entry->path, &st) == 0 && fcache_entry_current(entry, &st);
+
+    pthread_mutex_lock(&fcache_mutex);
+    if (!current) {
+      if (entry->cached)
+        fcache_remove(entry);
+      entry->refcount--;
+      if (entry->refcount == 0)
+        fcache_free(entry);
+      pthread_mutex_unlock(&fcache_mutex);
+      return NULL;
+    }
+    entry->checked_at = now;
+    pthread_mutex_unlock(&fcache_mutex);
+  }
+
+  pthread_mutex_lock(&fcache_mutex);
+  if (entry->cached) {
+    fcache_lru_unlink(entry);
+    fcache_lru_push(entry);
+  }
+  pthread_mutex_unlock(&fcache_mutex);
+  return entry;
+}
+
+/* Returns 1 if a body of SIZE bytes can be cached. */
+int fcache_fits(size_t size) {
+  return fcache_enabled() && size <= FCACHE_MAX_ENTRY_SIZE && size <= fcache_capacity;
+}
+
+/*
+ * Reads the SIZE byte file FD into a new buffer, or returns NULL if it is too
+ * large to cache or could not be read.
+ */
+char *fcache_read_file(int fd, size_t size) {
+  if (!fcache_fits(size))
+    return NULL;
+
+  char *body = malloc(size + 1);
+  size_t bytes_read = 0;
+  while (bytes_read < size) {
+    ssize_t result = pread(fd, body + bytes_read, size - bytes_read, bytes_read);
+    if (result < 0 && errno == EINTR)
+      continue;
+    if (result <= 0) {
+      free(body);
+      return NULL;
+    }
+    bytes_read += result;
+  }
+  return body;
+}
+
+/*
+ * Caches BODY (a malloc()ed buffer, which the cache takes over) under KEY
+ * along with the rendered HEAD and the META it was rendered from. ST
+ * describes the file at PATH that the body was made from. Returns the new
+ * entry with a reference held for the caller, or NULL (having freed BODY) if
+ * the body is too large to cache.
+ */
+fcache_entry_t *fcache_insert(char *key, char *path, struct stat *st,
+    fcache_meta_t *meta, char *body, size_t body_length, char *head,
+    size_t head_length) {
+  if (!fcache_fits(body_length)) {
+    free(body);
+    return NULL;
+  }
+
+  fcache_entry_t *entry = calloc(1, sizeof(fcache_entry_t));
+  entry->body = body;
+  entry->body_length = body_length;
+  entry->meta = *meta;
+  entry->key = strdup(key);
+  entry->path = strdup(path);
+  entry->type = st->st_mode & S_IFMT;
+  entry->dev = st->st_dev;
+  entry->ino = st->st_ino;
+  entry->size = st->st_size;
+  entry->mtime = st->st_mtim;
+  entry->checked_at = fcache_now();
+  entry->head = malloc(head_length);
+  memcpy(entry->head, head, head_length);
+  entry->head_length = head_length;
+  entry->refcount = 2;
+  entry->cached = 1;
+
+  pthread_mutex_lock(&fcache_mutex);
+  fcache_entry_t **bucket = &fcache_table[fcache_hash(key) % FCACHE_BUCKETS];
+  for (fcache_entry_t *old = *bucket; old != NULL; old = old->hash_next) {
+    if (strcmp(old->key, key) == 0) {
+      fcache_remove(old);
+      break;
+    }
+  }
+  entry->hash_next = *bucket;
+  *bucket = entry;
+  fcache_lru_push(entry);
+  fcache_size += fcache_entry_size(entry);
+
+  while (fcache_size > fcache_capacity && fcache_lru_tail != entry)
+    fcache_remove(fcache_lru_tail);
+  pthread_mutex_unlock(&fcache_mutex);
+
+  return entry;
+}
+
+/* Drops the caller's reference to ENTRY. */
+void fcache_release(fcache_entry_t *entry) {
+  pthread_mutex_lock(&fcache_mutex);
+  if (--entry->refcount == 0)
+    fcache_free(entry);
+  pthread_mutex_unlock(&fcache_mutex);
+}
@@ -0,0 +1,61 @@
+#ifndef __FCACHE__
+#define __FCACHE__
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+/* FCACHE is a bounded in-memory cache of static files (and directory
+ * listings) for --files mode, keyed by request path. An entry holds the
+ * pre-rendered status line and headers together with the file body, so a
+ * hit is served without open(), read() or formatting. Entries are dropped
+ * in LRU order once the cache grows past its capacity, and are revalidated
+ * against the file's inode, size and mtime at most every revalidate_ms
+ * milliseconds. */
+
+/* Files larger than this are always streamed with sendfile instead. The body
+ * of an entry may differ from the file (e.g. be compressed), but size, mtime
+ * and the rest describe the file, for revalidation. */
+#define FCACHE_MAX_ENTRY_SIZE (1 << 20)
+
+/* How the body of an entry is labelled in responses built from it. */
+typedef struct fcache_meta {
+  char *type;     // Content-Type (a static string).
+  char *encoding; // Content-Encoding (a static string), or NULL for identity.
+  int vary;       // The body was chosen based on Accept-Encoding.
+} fcache_meta_t;
+
+typedef struct fcache_entry {
+  char *key;
+  char *path; // File (or directory, for a listing) the entry was made from.
+  mode_t type; // S_IFREG or S_IFDIR.
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+  long checked_at; // When the file was last stat()ed, in ms.
+  fcache_meta_t meta;
+
+  char *head; // Status line and headers, without Connection or the blank line.
+  size_t head_length;
+  char *body;
+  size_t body_length;
+
+  int refcount; // Held by the cache and by responses still being sent.
+  int cached;   // Still in the cache; otherwise freed on the last release.
+  struct fcache_entry *hash_next;
+  struct fcache_entry *lru_prev;
+  struct fcache_entry *lru_next;
+} fcache_entry_t;
+
+void fcache_init(size_t capacity, int revalidate_ms);
+int fcache_enabled();
+fcache_entry_t *fcache_lookup(char *key);
+int fcache_fits(size_t size);
+char *fcache_read_file(int fd, size_t size);
+fcache_entry_t *fcache_insert(char *key, char *path, struct stat *st,
+    fcache_meta_t *meta, char *body, size_t body_length, char *head,
+    size_t head_length);
+void fcache_release(fcache_entry_t *entry);
+
+#endif
@@ -1,9 +1,12 @@
+#define _GNU_SOURCE
+
 #include <arpa/inet.h>
-#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
@@ -11,11 +14,23 @@
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <unistd.h>
-#include <unistd.h>
 
+#include "alog.h"
+#include "evloop.h"
+#include "fcache.h"
+#include "httpserver.h"
+#include "iplimit.h"
 #include "libhttp.h"
+#include "metrics.h"
+#include "pcache.h"
+#include "proxy.h"
+#include "relay.h"
+#include "tpool.h"
+#include "upstream.h"
+#include "uring.h"
 #include "wq.h"
 
 /*
@@ -25,80 +40,584 @@
  * command line arguments (already implemented for you).
  */
 wq_t work_queue;
+tpool_t worker_pool;
 int num_threads;
 int server_port;
 char *server_files_directory;
-char *server_proxy_hostname;
-int server_proxy_port;
+char *server_proxy_targets;
+int server_proxy_http;
+int server_keep_alive_timeout;
+int server_keep_alive_requests;
+int server_header_timeout; // In seconds, like the keep-alive timeout; 0 for none.
+int server_body_timeout;
+int server_log_connections;
+int server_gzip;
+enum accept_mode server_accept_mode;
+int server_queue_high_water;
+long long server_queue_deadline; // In nanoseconds; 0 for none.
+long long server_codel_target;   // In nanoseconds; 0 turns CoDel off.
+long long server_codel_interval;
+int server_max_threads; // Pool threads with --accept queue; num_threads if fixed.
+int server_thread_idle_timeout; // In seconds.
 
 #define MAX_SIZE 8192
+#define DIRECTORY_BATCH_SIZE 65536
+
+struct linux_dirent64 {
+  ino64_t d_ino;
+  off64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+
+/*
+ * Starts RESPONSE with the status line for STATUS_CODE. Every prepare_*
+ * function calls this first, so it also resets the body of the response
+ * (but not keep_alive, which the caller chose). The caller sets STARTED
+ * afterwards if it knows when the request arrived.
+ */
+void response_start(struct file_response *response, int status_code) {
+  response->status = status_code;
+  response->started = 0;
+  http_head_start(&response->head, status_code);
+  response->body = NULL;
+  response->file_fd = -1;
+  response->cache_entry = NULL;
+  response->num_parts = 0;
+}
+
+
+void response_header(struct file_response *response, char *key, char *value) {
+  http_head_add(&response->head, key, value);
+}
+
+
+void response_end_headers(struct file_response *response) {
+  response_header(response, "Connection", response->keep_alive ? "keep-alive" : "close");
+  http_head_end(&response->head);
+}
+
+
+/*
+ * Appends LENGTH bytes at DATA to the body of RESPONSE, or LENGTH bytes of
+ * its file starting at OFFSET if DATA is NULL.
+ */
+void response_add_part(struct file_response *response, char *data, off_t offset,
+    size_t length) {
+  if (length == 0 || response->num_parts == FILE_RESPONSE_MAX_PARTS)
+    return;
+  struct file_response_part *part = &response->parts[response->num_parts++];
+  part->data = data;
+  part->offset = offset;
+  part->length = length;
+}
+
+
+/*
+ * Prepares a response without a body (400, 403, 404, ...).
+ */
+void prepare_error_response(struct file_response *response, int status_code) {
+  response_start(response, status_code);
+  response_header(response, "Content-Type", "text/html");
+  response_header(response, "Content-Length", "0");
+  response_end_headers(response);
+}
+
+
+/*
+ * Prepares the metrics page (see metrics.h).
+ */
+void prepare_metrics_response(struct file_response *response) {
+  size_t length;
+  char *body = metrics_render(&length);
+  char content_length[32];
+  snprintf(content_length, sizeof(content_length), "%zu", length);
+
+  response_start(response, 200);
+  response_header(response, "Content-Type", "text/plain; version=0.0.4");
+  response_header(response, "Content-Length", content_length);
+  response_header(response, "Cache-Control", "no-store");
+  response_end_headers(response);
+
+  response->body = body;
+  response_add_part(response, body, 0, length);
+}
+
+
+/*
+ * Describes the version of a file that a response serves: its entity tag,
+ * derived from the inode, size and modification time of the file and the
+ * content-coding of the body, its Last-Modified date, the SIZE of the body
+ * and how it is labelled (META).
+ */
+struct file_version {
+  char etag[80];
+  char last_modified[LIBHTTP_DATE_SIZE];
+  time_t mtime;
+  off_t size;
+  fcache_meta_t *meta;
+};
+
+
+void file_version_init(struct file_version *version, ino_t ino, off_t size,
+    struct timespec *mtime, fcache_meta_t *meta) {
+  snprintf(version->etag, sizeof(version->etag), "\"%lx-%llx-%llx%s%s\"",
+      (unsigned long) ino, (unsigned long long) size,
+      (unsigned long long) mtime->tv_sec * 1000000000ULL + mtime->tv_nsec,
+      meta->encoding ? "-" : "", meta->encoding ? meta->encoding : "");
+  http_format_date(mtime->tv_sec, version->last_modified);
+  version->mtime = mtime->tv_sec;
+  version->size = size;
+  version->meta = meta;
+}
+
+
+void response_version_headers(struct file_response *response,
+    struct file_version *version) {
+  response_header(response, "ETag", version->etag);
+  response_header(response, "Last-Modified", version->last_modified);
+  if (version->meta->vary)
+    response_header(response, "Vary", "Accept-Encoding");
+}
+
+
+/*
+ * Returns 1 if the client already has VERSION of the file according to its
+ * If-None-Match or, failing that, If-Modified-Since header, so that it can be
+ * answered with 304 Not Modified.
+ */
+int request_not_modified(struct http_request *request, struct file_version *version) {
+  char *if_none_match = http_request_header(request, "If-None-Match", NULL);
+  if (if_none_match != NULL)
+    return http_etag_matches(if_none_match, version->etag);
+
+  char *if_modified_since = http_request_header(request, "If-Modified-Since", NULL);
+  time_t since;
+  return if_modified_since != NULL && http_parse_date(if_modified_since, &since) == 0
+      && version->mtime <= since;
+}
+
+
+/*
+ * Works out which bytes of VERSION of a file the client asked for with a
+ * Range header. Returns the number of RANGES, 0 if none of them can be
+ * satisfied, or -1 if the whole file should be sent: there is no usable Range
+ * header, or its If-Range names another version. Dates in If-Range must match
+ * Last-Modified exactly and entity tags are compared strongly.
+ */
+int request_ranges(struct http_request *request, struct file_version *version,
+    struct http_range *ranges) {
+  char *range = http_request_header(request, "Range", NULL);
+  if (range == NULL)
+    return -1;
+
+  char *if_range = http_request_header(request, "If-Range", NULL);
+  if (if_range != NULL && strcmp(if_range, version->etag) != 0
+      && strcmp(if_range, version->last_modified) != 0)
+    return -1;
+
+  return http_parse_range(range, version->size, ranges, LIBHTTP_MAX_RANGES);
+}
+
+
+/*
+ * Prepares a 206 Partial Content response with COUNT RANGES of VERSION of a
+ * file, or 416 Range Not Satisfiable if COUNT is 0.
+ * The ranges are read from DATA if it is not NULL, and from the file of the
+ * response otherwise, which the caller sets afterwards. Several ranges are
+ * sent as a multipart/byteranges body whose boundaries are kept in BODY.
+ */
+void prepare_ranges(struct file_response *response, struct http_range *ranges,
+    int count, struct file_version *version, char *data) {
+  off_t size = version->size;
+  char *type = version->meta->type;
+  char header[128];
+
+  if (count == 0) {
+    response_start(response, 416);
+    snprintf(header, sizeof(header), "bytes */%lld", (long long) size);
+    response_header(response, "Content-Range", header);
+    response_header(response, "Content-Length", "0");
+    response_end_headers(response);
+    return;
+  }
+
+  response_start(response, 206);
+  response_header(response, "Accept-Ranges", "bytes");
+  if (version->meta->encoding != NULL)
+    response_header(response, "Content-Encoding", version->meta->encoding);
+  response_version_headers(response, version);
+
+  if (count == 1) {
+    snprintf(header, sizeof(header), "bytes %lld-%lld/%lld",
+        (long long) ranges[0].offset,
+        (long long) (ranges[0].offset + ranges[0].length - 1), (long long) size);
+    response_header(response, "Content-Type", type);
+    response_header(response, "Content-Range", header);
+    snprintf(header, sizeof(header), "%lld", (long long) ranges[0].length);
+    response_header(response, "Content-Length", header);
+    response_end_headers(response);
+
+    response_add_part(response, data ? data + ranges[0].offset : NULL,
+        ranges[0].offset, ranges[0].length);
+    return;
+  }
+
+  char boundary[32];
+  snprintf(boundary, sizeof(boundary), "%08lx%08lx", random(), random());
+
+  /* Render every part's header, then the closing boundary, into one buffer. */
+  size_t part_head_size = strlen(type) + 128;
+  char *body = malloc(count * part_head_size + 64);
+  size_t part_heads[LIBHTTP_MAX_RANGES + 1];
+  size_t length = 0;
+  off_t content_length = 0;
+  for (int i = 0; i < count; i++) {
+    part_heads[i] = length;
+    length += snprintf(body + length, part_head_size,
+        "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %lld-%lld/%lld\r\n\r\n",
+        boundary, type, (long long) ranges[i].offset,
+        (long long) (ranges[i].offset + ranges[i].length - 1), (long long) size);
+    content_length += ranges[i].length;
+  }
+  part_heads[count] = length;
+  length += snprintf(body + length, 64, "\r\n--%s--\r\n", boundary);
+  content_length += length;
+
+  snprintf(header, sizeof(header), "multipart/byteranges; boundary=%s", boundary);
+  response_header(response, "Content-Type", header);
+  snprintf(header, sizeof(header), "%lld", (long long) content_length);
+  response_header(response, "Content-Length", header);
+  response_end_headers(response);
+
+  response->body = body;
+  for (int i = 0; i < count; i++) {
+    response_add_part(response, body + part_heads[i], 0,
+        part_heads[i + 1] - part_heads[i]);
+    response_add_part(response, data ? data + ranges[i].offset : NULL,
+        ranges[i].offset, ranges[i].length);
+  }
+  response_add_part(response, body + part_heads[count], 0,
+      length - part_heads[count]);
+}
+
+
+/*
+ * Answers a GET for VERSION of a file with less than the whole file if it
+ * can: 304 Not Modified if the client has it already, or the ranges the
+ * client asked for. The ranges are read from DATA, or from the file the caller
+ * sets afterwards. Returns 0 if the whole file has to be sent instead.
+ */
+int prepare_partial_file(struct file_response *response,
+    struct http_request *request, struct file_version *version, char *data) {
+  if (request == NULL || strcmp(request->method, "GET") != 0)
+    return 0;
+
+  if (request_not_modified(request, version)) {
+    response_start(response, 304);
+    response_version_headers(response, version);
+    response_end_headers(response);
+    return 1;
+  }
+
+  struct http_range ranges[LIBHTTP_MAX_RANGES];
+  int count = request_ranges(request, version, ranges);
+  if (count < 0)
+    return 0;
+  prepare_ranges(response, ranges, count, version, data);
+  return 1;
+}
+
+
+/*
+ * Prepares a response serving a file from the static file cache, which holds
+ * everything but the Connection header, or a partial response for it.
+ */
+void prepare_cached_file(struct file_response *response,
+    struct http_request *request, fcache_entry_t *entry) {
+  /* Without headers there are no conditions or ranges to check. */
+  if (request != NULL && request->num_headers > 0) {
+    struct file_version version;
+    file_version_init(&version, entry->ino, entry->body_length, &entry->mtime,
+        &entry->meta);
+    if (prepare_partial_file(response, request, &version, entry->body)) {
+      response->cache_entry = entry;
+      return;
+    }
+  }
+
+  response_start(response, 200);
+  if (entry->head_length < LIBHTTP_HEAD_MAX_SIZE) {
+    memcpy(response->head.data, entry->head, entry->head_length);
+    response->head.length = entry->head_length;
+  }
+  response_end_headers(response);
 
+  response->cache_entry = entry;
+  response_add_part(response, entry->body, 0, entry->body_length);
+}
 
-void send_to_client(int dst, int src) {
-  void *buffer = malloc(MAX_SIZE);
-  size_t size;
-  while ((size = read(src, buffer, MAX_SIZE)) > 0)
-    http_send_data(dst, buffer, size);
 
-  free(buffer);
+/*
+ * Replaces the LENGTH byte *BODY with its gzipped form if that is smaller,
+ * and marks META accordingly.
+ */
+void gzip_body(char **body, size_t *length, fcache_meta_t *meta) {
+  size_t compressed_length;
+  char *compressed = http_gzip(*body, *length, &compressed_length);
+  if (compressed != NULL && compressed_length < *length) {
+    free(*body);
+    *body = compressed;
+    *length = compressed_length;
+    meta->encoding = "gzip";
+  } else {
+    free(compressed);
+  }
 }
 
 
 /*
- * Serves the contents the file stored at `path` to the client socket `fd`.
+ * Starts a 200 response with the whole body of VERSION.
+ */
+void response_start_version(struct file_response *response,
+    struct file_version *version) {
+  char content_length[32];
+  snprintf(content_length, sizeof(content_length), "%lld", (long long) version->size);
+
+  response_start(response, 200);
+  response_header(response, "Content-Type", version->meta->type);
+  if (version->meta->encoding != NULL)
+    response_header(response, "Content-Encoding", version->meta->encoding);
+  response_header(response, "Content-Length", content_length);
+  response_header(response, "Accept-Ranges", "bytes");
+  response_version_headers(response, version);
+}
+
+
+/*
+ * One way of answering a request for a file: the file at PATH, labelled with
+ * META and cached under KEY. With COMPRESS, the file is gzipped into the
+ * static file cache instead, if that makes it smaller. FD is the file if it
+ * is already open, and -1 otherwise.
+ */
+struct file_variant {
+  char *key;
+  char *path;
+  int fd;
+  fcache_meta_t meta;
+  int compress;
+};
+
+
+/*
+ * Prepares a response serving VARIANT of a file (or a partial response for
+ * it), for REQUEST. ST describes the file at variant->path. Small files are
+ * added to the static file cache on the way.
  * It is the caller's reponsibility to ensure that the file stored at `path` exists.
- * You can change these functions to anything you want.
  * 
  * ATTENTION: Be careful to optimize your code. Judge is
  *            sesnsitive to time-out errors.
  */
-void serve_file(int fd, char *path, struct stat *st) {
-  long size = st->st_size;
-  char *content_size = malloc(MAX_SIZE * sizeof(char));
-  sprintf(content_size, "%ld", size);
+void prepare_file(struct file_response *response, struct http_request *request,
+    struct file_variant *variant, struct stat *st) {
+  int file = variant->fd;
+  char *body = NULL;
+  size_t body_length = st->st_size;
+
+  /* Compressing only pays off if the result is cached, so it is read whole. */
+  if (variant->compress) {
+    if (file < 0)
+      file = open(variant->path, O_RDONLY);
+    if (file >= 0)
+      body = fcache_read_file(file, st->st_size);
+    if (body != NULL)
+      gzip_body(&body, &body_length, &variant->meta);
+  }
+
+  struct file_version version;
+  file_version_init(&version, st->st_ino, body_length, &st->st_mtim, &variant->meta);
+  if (body == NULL && prepare_partial_file(response, request, &version, NULL)) {
+    if (response->num_parts > 0) {
+      response->file_fd = file >= 0 ? file : open(variant->path, O_RDONLY);
+      if (response->file_fd < 0) {
+        file_response_release(response);
+        prepare_error_response(response, 404);
+      }
+    } else if (file >= 0) {
+      close(file);
+    }
+    return;
+  }
 
-  http_start_response(fd, 200);
-  http_send_header(fd, "Content-Type", http_get_mime_type(path));
-  http_send_header(fd, "Content-Length", content_size);
-  http_end_headers(fd);
+  if (file < 0)
+    file = open(variant->path, O_RDONLY);
+  if (file < 0) {
+    free(body);
+    prepare_error_response(response, 404);
+    return;
+  }
 
-  int file = open(path, 0);
-  send_to_client(fd, file);
+  response_start_version(response, &version);
+
+  if (body == NULL)
+    body = fcache_read_file(file, st->st_size);
+  if (body != NULL) {
+    /* Always fits, since fcache_read_file() accepted the file. */
+    fcache_entry_t *entry = fcache_insert(variant->key, variant->path, st,
+        &variant->meta, body, body_length, response->head.data,
+        response->head.length);
+    close(file);
+    prepare_cached_file(response, request, entry);
+    return;
+  }
 
-  close(file);
-  free(content_size);
+  response_end_headers(response);
+  response->file_fd = file;
+  response_add_part(response, NULL, 0, st->st_size);
 }
 
 
-void send_404_not_found(int fd) {
-  http_start_response(fd, 404);
-  http_send_header(fd, "Content-Type", "text/html");
-  http_end_headers(fd);
-}
+/*
+ * Prepares a response for the regular file at PATH, described by ST and open
+ * as FD unless that is -1. If the client ACCEPTS_GZIP, prefers a
+ * precompressed PATH.gz next to the file, and otherwise, with --gzip,
+ * compresses text files on the fly.
+ */
+void prepare_negotiated_file(struct file_response *response,
+    struct http_request *request, char *key, char *path, struct stat *st,
+    int fd, int accepts_gzip) {
+  struct file_variant variant;
+  variant.key = key;
+  variant.path = path;
+  variant.fd = fd;
+  variant.meta.type = http_get_mime_type(path);
+  variant.meta.encoding = NULL;
+  variant.meta.vary = accepts_gzip
+      || (server_gzip && http_type_compressible(variant.meta.type));
+  variant.compress = 0;
+
+  if (accepts_gzip) {
+    char *gzip_path = malloc(strlen(path) + strlen(".gz") + 1);
+    strcpy(gzip_path, path);
+    strcat(gzip_path, ".gz");
+
+    struct stat gzip_stat;
+    if (stat(gzip_path, &gzip_stat) == 0 && S_ISREG(gzip_stat.st_mode)) {
+      if (fd >= 0)
+        close(fd);
+      variant.path = gzip_path;
+      variant.fd = -1;
+      variant.meta.encoding = "gzip";
+      prepare_file(response, request, &variant, &gzip_stat);
+      free(gzip_path);
+      return;
+    }
+    free(gzip_path);
 
+    variant.compress = server_gzip && http_type_compressible(variant.meta.type);
+  }
+
+  prepare_file(response, request, &variant, st);
+}
 
-void serve_directory(int fd, char *path) {
-  http_start_response(fd, 200);
-  http_send_header(fd, "Content-Type", http_get_mime_type(".html"));
-  http_end_headers(fd);
 
-  DIR *dir = opendir(path);
-  if (dir) {
-    char *string = malloc(MAX_SIZE);
-    struct dirent *dirent;
-    while ((dirent = readdir(dir)) != NULL) {
-      snprintf(string, MAX_SIZE, "<a href='./%s'>%s</a><br>\n", dirent->d_name, dirent->d_name);
-      http_send_string(fd, string);
+/*
+ * Renders an HTML page linking to every entry of the directory open as FD
+ * into a new buffer of *LENGTH bytes. Entries are read with getdents64 in
+ * large batches, so that huge directories take few syscalls.
+ */
+char *render_directory(int fd, size_t *length) {
+  size_t capacity = MAX_SIZE;
+  char *body = malloc(capacity);
+  char *entries = malloc(DIRECTORY_BATCH_SIZE);
+  *length = 0;
+
+  long batch;
+  while ((batch = syscall(SYS_getdents64, fd, entries, DIRECTORY_BATCH_SIZE)) > 0) {
+    for (long offset = 0; offset < batch;) {
+      struct linux_dirent64 *dirent = (struct linux_dirent64 *) (entries + offset);
+      offset += dirent->d_reclen;
+
+      size_t needed = 2 * strlen(dirent->d_name) + 32;
+      if (*length + needed > capacity) {
+        while (*length + needed > capacity)
+          capacity *= 2;
+        body = realloc(body, capacity);
+      }
+      *length += snprintf(body + *length, capacity - *length,
+          "<a href='./%s'>%s</a><br>\n", dirent->d_name, dirent->d_name);
     }
-    free(string);
   }
-  closedir(dir);
+
+  free(entries);
+  return body;
+}
+
+
+/*
+ * Prepares an HTML page linking to every entry of the directory at `path`
+ * (or a partial response for it), for REQUEST. The page is rendered into
+ * memory so that it can carry a Content-Length, and kept in the static file
+ * cache under KEY until the directory's mtime changes. If the client
+ * ACCEPTS_GZIP, the page is compressed with --gzip.
+ */
+void prepare_directory(struct file_response *response, struct http_request *request,
+    char *key, char *path, int accepts_gzip) {
+  struct stat st;
+  int fd = open(path, O_RDONLY | O_DIRECTORY);
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    if (fd >= 0)
+      close(fd);
+    prepare_error_response(response, 404);
+    return;
+  }
+
+  size_t length;
+  char *body = render_directory(fd, &length);
+  close(fd);
+
+  fcache_meta_t meta;
+  meta.type = http_get_mime_type(".html");
+  meta.encoding = NULL;
+  meta.vary = accepts_gzip || server_gzip;
+  if (accepts_gzip && server_gzip)
+    gzip_body(&body, &length, &meta);
+
+  struct file_version version;
+  file_version_init(&version, st.st_ino, length, &st.st_mtim, &meta);
+  if (fcache_fits(length)) {
+    response_start_version(response, &version);
+    fcache_entry_t *entry = fcache_insert(key, path, &st, &meta, body, length,
+        response->head.data, response->head.length);
+    prepare_cached_file(response, request, entry);
+    return;
+  }
+
+  response_start_version(response, &version);
+  response_end_headers(response);
+  response->body = body;
+  response_add_part(response, body, 0, length);
+}
+
+
+/*
+ * Stats the file at PATH into *ST. With the io_uring engine, a regular file
+ * is opened in the same submission and *FD set to it, which saves serving it
+ * an open(); *FD is -1 otherwise.
+ */
+int files_stat(char *path, struct stat *st, int *fd) {
+  if (uring_enabled())
+    return uring_open_stat(path, st, fd);
+  *fd = -1;
+  return stat(path, st);
 }
 
 
 /*
- * Reads an HTTP request from stream (fd), and writes an HTTP response
- * containing:
+ * Prepares the response to an HTTP request (which is NULL if the request
+ * could not be parsed):
  *
  *   1) If user requested an existing file, respond with the file
  *   2) If user requested a directory and index.html exists in the directory,
@@ -106,257 +625,728 @@ void serve_directory(int fd, char *path) {
  *   3) If user requested a directory and index.html doesn't exist, send a list
  *      of files in the directory with links to each.
  *   4) Send a 404 Not Found response.
- * 
- *   Closes the client socket (fd) when finished.
  */
-void handle_files_request(int fd) {
-
-  struct http_request *request = http_request_parse(fd);
+void prepare_files_response(struct http_request *request,
+    struct file_response *response) {
 
   if (request == NULL || request->path[0] != '/') {
-    http_start_response(fd, 400);
-    http_send_header(fd, "Content-Type", "text/html");
-    http_end_headers(fd);
-    close(fd);
+    response->keep_alive = 0;
+    prepare_error_response(response, 400);
     return;
   }
 
   if (strstr(request->path, "..") != NULL) {
-    http_start_response(fd, 403);
-    http_send_header(fd, "Content-Type", "text/html");
-    http_end_headers(fd);
-    close(fd);
+    prepare_error_response(response, 403);
     return;
   }
 
-  char *path = malloc(strlen(server_files_directory) + strlen(request->path));
+  if (strcmp(request->path, METRICS_PATH) == 0) {
+    prepare_metrics_response(response);
+    return;
+  }
+
+  /*
+   * Clients that accept gzip may get a different body, which is cached under
+   * the path followed by " gzip" (request paths never contain spaces).
+   */
+  char *accept_encoding = http_request_header(request, "Accept-Encoding", NULL);
+  int accepts_gzip = accept_encoding != NULL
+      && http_accepts_encoding(accept_encoding, "gzip");
+  char gzip_key[LIBHTTP_REQUEST_MAX_SIZE + 8];
+  char *key = request->path;
+  if (accepts_gzip) {
+    snprintf(gzip_key, sizeof(gzip_key), "%s gzip", request->path);
+    key = gzip_key;
+  }
+
+  fcache_entry_t *entry = fcache_lookup(key);
+  if (entry != NULL) {
+    prepare_cached_file(response, request, entry);
+    return;
+  }
+
+  char *path = malloc(strlen(server_files_directory) + strlen(request->path) + 1);
   strcpy(path, server_files_directory);
   strcat(path, request->path);
 
   struct stat file_stat;
-  stat(path, &file_stat);
-
-  if (S_ISREG(file_stat.st_mode)) {
-    serve_file(fd, path, &file_stat);
+  int fd;
+  if (files_stat(path, &file_stat, &fd) != 0) {
+    prepare_error_response(response, 404);
+  } else if (S_ISREG(file_stat.st_mode)) {
+    prepare_negotiated_file(response, request, key, path, &file_stat, fd, accepts_gzip);
   } else if (S_ISDIR(file_stat.st_mode)) {
-    char *index_path = malloc(strlen(path) + strlen("/index.html"));
+    char *index_path = malloc(strlen(path) + strlen("/index.html") + 1);
     strcpy(index_path, path);
     strcat(index_path, "/index.html");
-    if (stat(index_path, &file_stat) == 0)
-      serve_file(fd, index_path, &file_stat);
-
+    if (files_stat(index_path, &file_stat, &fd) == 0 && S_ISREG(file_stat.st_mode))
+      prepare_negotiated_file(response, request, key, index_path, &file_stat,
+          fd, accepts_gzip);
     else
-      serve_directory(fd, path);
+      prepare_directory(response, request, key, path, accepts_gzip);
 
     free(index_path);
   } else
-    send_404_not_found(fd);
+    prepare_error_response(response, 404);
 
   free(path);
-  close(fd);
-  return;
 }
 
 
-typedef struct proxy_status {
-  int src_socket;
-  int dst_socket;
-  pthread_cond_t *cond;
-  int alive;
-} proxy_status;
+/*
+ * Decides whether the connection stays open after answering REQUEST, the
+ * REQUESTS_SERVED'th request (counting from 1) on that connection.
+ */
+int request_keep_alive(struct http_request *request, int requests_served) {
+  return request != NULL && request->keep_alive
+      && requests_served < server_keep_alive_requests;
+}
 
 
-struct proxy_status * create_proxy_status(int src, int dst, int alive, pthread_cond_t *cond) {
-  proxy_status *proxy_status = (struct proxy_status*) malloc(sizeof(proxy_status));
-  proxy_status->src_socket = src;
-  proxy_status->dst_socket = dst;
-  proxy_status->alive = alive;
-  proxy_status->cond = cond;
+/*
+ * Writes RESPONSE to the client socket `fd` from byte *SENT on, advancing
+ * *SENT. The head and in-memory parts are gathered into one sendmsg(), and
+ * file parts go out with http_send_file. Returns 0 once everything is sent,
+ * or -1 with errno set (EAGAIN if a non-blocking socket is full).
+ */
+int file_response_send(int fd, struct file_response *response, size_t *sent) {
+  int first = *sent == 0;
+  while (1) {
+    struct iovec iov[FILE_RESPONSE_MAX_PARTS + 1];
+    int count = 0;
+    size_t length = 0;
+    struct file_response_part *file_part = NULL;
+    size_t skip = *sent;
+
+    if (skip < response->head.length) {
+      iov[count].iov_base = response->head.data + skip;
+      iov[count++].iov_len = response->head.length - skip;
+      skip = 0;
+    } else {
+      skip -= response->head.length;
+    }
+    for (int i = 0; i < response->num_parts; i++) {
+      struct file_response_part *part = &response->parts[i];
+      if (skip >= part->length) {
+        skip -= part->length;
+        continue;
+      }
+      if (part->data == NULL) {
+        file_part = part;
+        break;
+      }
+      iov[count].iov_base = part->data + skip;
+      iov[count++].iov_len = part->length - skip;
+      skip = 0;
+    }
 
-  return proxy_status;
+    for (int i = 0; i < count; i++)
+      length += iov[i].iov_len;
+    if (count > 0) {
+      size_t written = http_send_iov(fd, iov, count, file_part != NULL);
+      *sent += written;
+      if (first && written > 0) {
+        metrics_first_byte(response->started);
+        first = 0;
+      }
+      if (written < length)
+        return -1;
+    }
+
+    if (file_part == NULL)
+      return 0;
+    off_t start = file_part->offset + skip;
+    off_t offset = start;
+    int result = http_send_file(fd, response->file_fd, &offset, file_part->length - skip);
+    *sent += offset - start;
+    if (result < 0)
+      return -1;
+  }
 }
 
 
-void *run_proxy(void *args) {
-  proxy_status *pstatus = (proxy_status *) args;
-  send_to_client(pstatus->dst_socket, pstatus->src_socket);
-  pstatus->alive = 0;
-  pthread_cond_signal(pstatus->cond);
-  return NULL;
+/*
+ * Sends RESPONSE, which has a file part, from its start with the io_uring
+ * engine: one submission sends everything (for files of up to a few dozen
+ * pipefuls) and closes the file. Returns 0 once it is all sent; otherwise *SENT
+ * says how far it got. Time to first byte is only known once the submission
+ * completes.
+ */
+int file_response_send_uring(int fd, struct file_response *response, size_t *sent) {
+  uring_chunk_t chunks[FILE_RESPONSE_MAX_PARTS + 1];
+  chunks[0].data = response->head.data;
+  chunks[0].length = response->head.length;
+  for (int i = 0; i < response->num_parts; i++) {
+    chunks[i + 1].data = response->parts[i].data;
+    chunks[i + 1].file_fd = response->file_fd;
+    chunks[i + 1].offset = response->parts[i].offset;
+    chunks[i + 1].length = response->parts[i].length;
+  }
+
+  int result = uring_send(fd, chunks, response->num_parts + 1, response->file_fd,
+      server_timeout_ms(server_body_timeout), sent);
+  if (*sent > 0)
+    metrics_first_byte(response->started);
+  if (result == 0)
+    response->file_fd = -1;
+  return result;
 }
 
 
-void send_502_bad_gateway(int fd, int target_fd) {
-  http_request_parse(fd);
-  http_start_response(fd, 502);
-  http_send_header(fd, "Content-Type", "text/html");
-  http_end_headers(fd);
-  http_send_string(fd, "<center><h1>502 Bad Gateway</h1><hr></center>");
-  close(target_fd);
-  close(fd);
+/*
+ * Writes a prepared response to the client socket `fd`, blocking until done,
+ * and counts it. Returns the number of bytes sent. If the response could not
+ * all be sent, e.g. because the client stopped reading for longer than
+ * server_body_timeout, its keep_alive is cleared.
+ */
+size_t send_file_response(int fd, struct file_response *response) {
+  size_t sent = 0;
+  int result = -1;
+  errno = 0;
+  if (uring_enabled() && response->file_fd >= 0)
+    result = file_response_send_uring(fd, response, &sent);
+  if (result != 0 && errno != ETIMEDOUT)
+    result = file_response_send(fd, response, &sent);
+  if (result != 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ETIMEDOUT)
+      metrics_timeout(METRICS_TIMEOUT_BODY);
+    response->keep_alive = 0;
+  }
+  metrics_response(response->status, sent);
+  return sent;
 }
 
 
-void handle_proxy(int fd, int target_fd) {
-  pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-  pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+void file_response_release(struct file_response *response) {
+  if (response->cache_entry != NULL)
+    fcache_release(response->cache_entry);
+  free(response->body);
+  response->cache_entry = NULL;
+  response->body = NULL;
+  if (response->file_fd >= 0)
+    close(response->file_fd);
+  response->file_fd = -1;
+}
 
-  proxy_status *request_status = create_proxy_status(fd, target_fd, 1, &cond);
-  proxy_status *response_status = create_proxy_status(target_fd, fd, 1, &cond);
 
-  pthread_t request_thread, response_thread;
+/* Returns a timeout of SECONDS in milliseconds, or -1 (none) if it is 0. */
+int server_timeout_ms(int seconds) {
+  return seconds > 0 ? seconds * 1000 : -1;
+}
 
-  pthread_create(&request_thread, NULL, run_proxy, request_status);
-  pthread_create(&response_thread, NULL, run_proxy, response_status);
 
-  while (request_status->alive && response_status->alive)
-    pthread_cond_wait(&cond, &mutex);
+/*
+ * Makes blocking sends to the client socket FD fail once the client has
+ * taken nothing for server_body_timeout, so that a client that stops reading
+ * cannot keep a pool thread.
+ */
+void client_send_timeout(int fd) {
+  if (server_body_timeout <= 0)
+    return;
+  struct timeval timeout = { server_body_timeout, 0 };
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
 
-  pthread_cancel(request_thread);
-  pthread_cancel(response_thread);
-  pthread_mutex_destroy(&mutex);
-  pthread_cond_destroy(&cond);
 
-  free(request_status);
-  free(response_status);
-  close(fd);
+/*
+ * Returns how long a lingering close that began at STARTED (a metrics_now()
+ * time) may wait for more from the client: server_body_timeout, but only up
+ * to SERVER_LINGER_MS after STARTED. Returns 0 once that has passed.
+ */
+int server_linger_ms(long long started) {
+  long long left = SERVER_LINGER_MS - (metrics_now() - started) / 1000000;
+  int body_ms = server_timeout_ms(server_body_timeout);
+  if (left <= 0)
+    return 0;
+  return body_ms >= 0 && body_ms < left ? body_ms : left;
+}
+
+
+/*
+ * Ends the response on the client socket `fd` and reads and discards what
+ * the client still sends, until it closes its end, stalls for
+ * server_body_timeout, or the linger limits are reached. Closing a socket
+ * with unread data resets the connection, which could destroy the response
+ * in flight.
+ */
+void client_linger(int fd) {
+  char discard[4096];
+  struct pollfd pollfd = { fd, POLLIN, 0 };
+  long long started = metrics_now();
+  size_t discarded = 0;
+  ssize_t received;
+  int wait_ms;
+  shutdown(fd, SHUT_WR);
+  while (discarded < SERVER_LINGER_MAX_BYTES && (wait_ms = server_linger_ms(started)) > 0
+      && poll(&pollfd, 1, wait_ms) > 0
+      && (received = recv(fd, discard, sizeof(discard), 0)) > 0)
+    discarded += received;
+}
+
+
+/*
+ * Reads HTTP requests from stream (fd), and writes the responses prepared by
+ * prepare_files_response. The connection is kept open between requests while
+ * the client asks for it, for up to server_keep_alive_requests requests, and
+ * pipelined requests are answered in order.
+ *
+ * Each request head must arrive within server_header_timeout of its first
+ * byte (the first one, also of the connection being picked up), and a client
+ * that stops reading the response is dropped after server_body_timeout.
+ * 
+ *   Closes the client socket (fd) when finished.
+ */
+void handle_files_request(int fd) {
+  struct http_buffer buffer;
+  http_buffer_init(&buffer);
+
+  int requests_served = 0;
+  int head_timeout = server_timeout_ms(server_header_timeout);
+  int idle_timeout = head_timeout;
+  struct http_request *request;
+  char client_address[INET_ADDRSTRLEN];
+  if (alog_enabled())
+    alog_peer_address(fd, client_address);
+  client_send_timeout(fd);
+
+  while (1) {
+    if (!http_read_request(fd, &buffer, idle_timeout, head_timeout, &request)) {
+      if (errno == ETIMEDOUT)
+        metrics_timeout(buffer.discard > 0 ? METRICS_TIMEOUT_BODY
+            : requests_served > 0 && buffer.started == 0 ? METRICS_TIMEOUT_IDLE
+            : METRICS_TIMEOUT_HEADER);
+      break;
+    }
+    requests_served++;
+    metrics_parsed(buffer.started);
+
+    /* A chunked body is not skipped; the connection ends with it instead. */
+    struct file_response response;
+    response.keep_alive = request_keep_alive(request, requests_served)
+        && !request->chunked;
+    prepare_files_response(request, &response);
+    response.started = buffer.started;
+    size_t sent = send_file_response(fd, &response);
+    alog_request(client_address, request ? request->method : NULL,
+        request ? request->path : NULL, response.status, sent, response.started);
+
+    file_response_release(&response);
+    if (request != NULL && request->chunked)
+      client_linger(fd);
+    if (!response.keep_alive)
+      break;
+    idle_timeout = server_keep_alive_timeout * 1000;
+  }
+
+  client_close(fd);
+}
+
+
+/*
+ * Prepares the 502 page sent when the proxy target cannot be reached.
+ */
+void prepare_bad_gateway_response(struct file_response *response) {
+  char *page = "<center><h1>502 Bad Gateway</h1><hr></center>";
+  char content_length[32];
+  snprintf(content_length, sizeof(content_length), "%zu", strlen(page));
+
+  response->keep_alive = 0;
+  response_start(response, 502);
+  response_header(response, "Content-Type", "text/html");
+  response_header(response, "Content-Length", content_length);
+  response_end_headers(response);
+
+  response->body = strdup(page);
+  response_add_part(response, response->body, 0, strlen(page));
+}
+
+
+/*
+ * Reads the client's request and answers it with 502 Bad Gateway, then
+ * closes the client socket (fd).
+ */
+void send_502_bad_gateway(int fd) {
+  struct http_buffer buffer;
+  struct http_request *request;
+  http_buffer_init(&buffer);
+  int head_timeout = server_timeout_ms(server_header_timeout);
+  http_read_request(fd, &buffer, head_timeout, head_timeout, &request);
+
+  struct file_response response;
+  prepare_bad_gateway_response(&response);
+  send_file_response(fd, &response);
+  file_response_release(&response);
+
+  client_close(fd);
+}
+
+
+/*
+ * Relays traffic between the client (fd) and the proxy target (target_fd) on
+ * the calling worker, then closes both sockets. The relay is given up once no
+ * bytes have moved for server_body_timeout.
+ */
+void handle_proxy(int fd, int target_fd) {
+  if (relay_run(fd, target_fd, server_timeout_ms(server_body_timeout)) != 0)
+    metrics_timeout(METRICS_TIMEOUT_BODY);
+  client_close(fd);
   close(target_fd);
-  
 }
 
 
 /*
- * Opens a connection to the proxy target (hostname=server_proxy_hostname and
- * port=server_proxy_port) and relays traffic to/from the stream fd and the
- * proxy target. HTTP requests from the client (fd) should be sent to the
- * proxy target, and HTTP responses from the proxy target should be sent to
- * the client (fd).
+ * Forwards the HTTP requests from the client (fd) one by one to the proxy
+ * targets, rewriting their headers, and relays the responses back (see
+ * proxy.h). Requests that cannot be forwarded get 400 Bad Request or 502 Bad
+ * Gateway, and ones the targets do not answer in time 504 Gateway Timeout.
+ * Closes the client socket when finished.
+ */
+void handle_http_proxy_request(int fd) {
+  proxy_conn_t *conn = proxy_conn_new(fd);
+  if (proxy_run(conn) == PROXY_ERROR) {
+    struct file_response response;
+    if (conn->error_status == 502) {
+      prepare_bad_gateway_response(&response);
+    } else {
+      response.keep_alive = 0;
+      prepare_error_response(&response, conn->error_status);
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+    proxy_log(conn, response.status, send_file_response(fd, &response));
+    file_response_release(&response);
+  }
+  proxy_conn_free(conn);
+  client_close(fd);
+}
+
+
+/*
+ * Hashes the path of the request at the start of the LENGTH bytes at DATA,
+ * for choosing a backend with UPSTREAM_HASH. Requests whose path cannot be
+ * found (e.g. the request line has not fully arrived yet) get a random hash,
+ * which spreads them out like round robin.
+ */
+uint32_t proxy_request_hash(char *data, size_t length) {
+  size_t path_length;
+  char *path = http_request_line_path(data, length, &path_length);
+  if (path == NULL)
+    return random();
+  return upstream_hash(path, path_length);
+}
+
+
+/*
+ * Picks the backend for the client (fd) with UPSTREAM_HASH: waits for the
+ * start of the request and hashes its path, leaving the data in the socket
+ * for the relay.
+ */
+uint32_t proxy_peek_hash(int fd) {
+  char data[LIBHTTP_REQUEST_MAX_SIZE];
+  struct pollfd pollfd = {fd, POLLIN, 0};
+  if (poll(&pollfd, 1, server_keep_alive_timeout * 1000) != 1)
+    return random();
+  ssize_t length = recv(fd, data, sizeof(data), MSG_PEEK | MSG_DONTWAIT);
+  return proxy_request_hash(data, length > 0 ? length : 0);
+}
+
+
+/*
+ * Takes a connection to a proxy target (one of server_proxy_targets, as
+ * chosen by the balancing policy), a pooled one if there is one, and relays
+ * traffic to/from the stream fd and the proxy target. HTTP requests from the
+ * client (fd) should be sent to the proxy target, and HTTP responses from
+ * the proxy target should be sent to the client (fd). If the chosen target
+ * cannot be found or reached, the others are tried in turn, and if none can,
+ * the client gets 502 Bad Gateway.
  *
  *   +--------+     +------------+     +--------------+
  *   | client | <-> | httpserver | <-> | proxy target |
  *   +--------+     +------------+     +--------------+
  */
 void handle_proxy_request(int fd) {
+  client_send_timeout(fd);
+  if (server_proxy_http) {
+    handle_http_proxy_request(fd);
+    return;
+  }
 
-  /*
-  * The code below does a DNS lookup of server_proxy_hostname and 
-  * opens a connection to it. Please do not modify.
-  */
-
-  struct sockaddr_in target_address;
-  memset(&target_address, 0, sizeof(target_address));
-  target_address.sin_family = AF_INET;
-  target_address.sin_port = htons(server_proxy_port);
+  uint32_t hash = 0;
+  if (upstream_policy() == UPSTREAM_HASH)
+    hash = proxy_peek_hash(fd);
 
-  struct hostent *target_dns_entry = gethostbyname2(server_proxy_hostname, AF_INET);
+  uint64_t tried = 0;
+  upstream_t *backend;
+  int pooled;
+  int target_fd = upstream_open(hash, &tried, &backend, &pooled);
 
-  int target_fd = socket(PF_INET, SOCK_STREAM, 0);
-  if (target_fd == -1) {
-    fprintf(stderr, "Failed to create a new socket: error %d: %s\n", errno, strerror(errno));
-    close(fd);
-    exit(errno);
-  }
-
-  if (target_dns_entry == NULL) {
-    fprintf(stderr, "Cannot find host: %s\n", server_proxy_hostname);
-    close(target_fd);
-    close(fd);
-    exit(ENXIO);
+  if (target_fd < 0) {
+    send_502_bad_gateway(fd);
+  } else {
+    handle_proxy(fd, target_fd);
+    upstream_release(backend);
   }
+}
 
-  char *dns_address = target_dns_entry->h_addr_list[0];
 
-  memcpy(&target_address.sin_addr, dns_address, sizeof(target_address.sin_addr));
-  int connection_status = connect(target_fd, (struct sockaddr*) &target_address,
-      sizeof(target_address));
+/*
+ * Turns away a client that the server has no time for, as cheaply as it can:
+ * with a 503 that is only sent if the socket takes it at once (or, relaying
+ * TCP, with nothing), after which the connection is closed. What the client
+ * sent so far is read and discarded first, since closing a socket with unread
+ * data resets the connection, which could destroy the 503 in flight.
+ */
+void shed_connection(int fd, enum metrics_shed_reason reason) {
+  metrics_shed(reason);
+  if (server_proxy_targets == NULL || server_proxy_http) {
+    char *response = "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\n"
+        "Retry-After: 1\r\nConnection: close\r\n\r\n";
+    ssize_t sent = send(fd, response, strlen(response), MSG_DONTWAIT | MSG_NOSIGNAL);
+    metrics_response(503, sent > 0 ? sent : 0);
+    if (alog_enabled()) {
+      char client_address[INET_ADDRSTRLEN];
+      alog_peer_address(fd, client_address);
+      alog_request(client_address, NULL, NULL, 503, sent > 0 ? sent : 0, 0);
+    }
 
-  if (connection_status < 0)
-    send_502_bad_gateway(fd, target_fd);
-  else
-    handle_proxy(fd, target_fd);
+    char discard[4096];
+    shutdown(fd, SHUT_WR);
+    while (recv(fd, discard, sizeof(discard), MSG_DONTWAIT) > 0)
+      ;
+  }
+  client_close(fd);
 }
 
 
+/*
+ * Serves connections from work_queue, except for the ones that waited longer
+ * than server_queue_deadline or that CoDel drops, whose clients have likely
+ * given up or would only add to the backlog. Returns once worker_pool has
+ * more threads than it needs.
+ */
 void * thread_handler(void *args) {
   void (*func)(int) = args;
-  while (1) {
-    int fd = wq_pop(&work_queue);
-    func(fd);
-    close(fd);
+  long long waited;
+  int fd;
+  while ((fd = tpool_pop(&worker_pool, &waited)) >= 0) {
+    metrics_queue_wait(waited);
+    int codel_drop = wq_codel_drop(&work_queue, waited);
+    if (server_queue_deadline > 0 && waited > server_queue_deadline)
+      shed_connection(fd, METRICS_SHED_DEADLINE);
+    else if (codel_drop)
+      shed_connection(fd, METRICS_SHED_CODEL);
+    else
+      func(fd);
   }
+  relay_thread_exit();
+  return NULL;
 }
 
 
 void init_thread_pool(int num_threads, void (*request_handler)(int)) {
-  pthread_t pthread[num_threads];
-  for (int i = 0; i < num_threads; i++)
-    pthread_create(&pthread[i], NULL, thread_handler, request_handler);
+  tpool_start(&worker_pool, &work_queue, num_threads, server_max_threads,
+      server_thread_idle_timeout * 1000, thread_handler, request_handler);
 }
 
 
 /*
- * Opens a TCP stream socket on all interfaces with port number PORTNO. Saves
- * the fd number of the server socket in *socket_number. For each accepted
- * connection, calls request_handler with the accepted fd number.
+ * Opens a TCP stream socket listening on all interfaces with port number
+ * PORT and returns its fd. With REUSEPORT set, several sockets can be bound to
+ * the same port and the kernel balances incoming connections between them.
  */
-void serve_forever(int *socket_number, void (*request_handler)(int)) {
+int open_server_socket(int port, int reuseport) {
+  struct sockaddr_in server_address;
 
-  struct sockaddr_in server_address, client_address;
-  size_t client_address_length = sizeof(client_address);
-  int client_socket_number;
-
-  *socket_number = socket(PF_INET, SOCK_STREAM, 0);
-  if (*socket_number == -1) {
+  int socket_number = socket(PF_INET, SOCK_STREAM, 0);
+  if (socket_number == -1) {
     perror("Failed to create a new socket");
     exit(errno);
   }
 
   int socket_option = 1;
-  if (setsockopt(*socket_number, SOL_SOCKET, SO_REUSEADDR, &socket_option,
+  if (setsockopt(socket_number, SOL_SOCKET, SO_REUSEADDR, &socket_option,
         sizeof(socket_option)) == -1) {
     perror("Failed to set socket options");
     exit(errno);
   }
 
+  if (reuseport && setsockopt(socket_number, SOL_SOCKET, SO_REUSEPORT,
+        &socket_option, sizeof(socket_option)) == -1) {
+    perror("Failed to set socket options");
+    exit(errno);
+  }
+
   memset(&server_address, 0, sizeof(server_address));
   server_address.sin_family = AF_INET;
   server_address.sin_addr.s_addr = INADDR_ANY;
-  server_address.sin_port = htons(server_port);
+  server_address.sin_port = htons(port);
 
-  if (bind(*socket_number, (struct sockaddr *) &server_address,
+  if (bind(socket_number, (struct sockaddr *) &server_address,
         sizeof(server_address)) == -1) {
     perror("Failed to bind on socket");
     exit(errno);
   }
 
-  if (listen(*socket_number, 1024) == -1) {
+  if (listen(socket_number, 1024) == -1) {
     perror("Failed to listen on socket");
     exit(errno);
   }
 
-  printf("Listening on port %d...\n", server_port);
+  return socket_number;
+}
+
+
+/*
+ * Sets up the socket of an accepted client, counts it, and prints its address
+ * unless --quiet was given. Nagle's algorithm is turned off: responses are
+ * already handed to the kernel in as few sends as possible, and with it the
+ * last, partial segment of a larger response would wait for the client's
+ * delayed ACK, some 40ms.
+ *
+ * Returns -1 if the client already has --max-conns-per-ip connections open;
+ * it has been turned away with a 503 then, and FD is closed. Otherwise, the
+ * socket must be closed with client_close().
+ */
+int client_accepted(int fd, struct sockaddr_in *client_address) {
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  metrics_connection();
+  if (server_log_connections) {
+    char address[INET_ADDRSTRLEN];
+    printf("Accepted connection from %s on port %d\n",
+        inet_ntop(AF_INET, &client_address->sin_addr, address, sizeof(address)),
+        client_address->sin_port);
+  }
+
+  if (iplimit_acquire(fd, client_address->sin_addr) != 0) {
+    shed_connection(fd, METRICS_SHED_PER_IP);
+    return -1;
+  }
+  return 0;
+}
+
+
+/* Closes the socket of a client that client_accepted() let in. */
+void client_close(int fd) {
+  iplimit_release(fd);
+  close(fd);
+}
+
+
+typedef struct accept_worker {
+  int socket_number;
+  void (*request_handler)(int);
+} accept_worker_t;
+
+
+/*
+ * Pool thread for --accept shared and --accept reuseport: accepts connections
+ * on its listening socket and serves them itself, bypassing work_queue.
+ */
+void *accept_handler(void *args) {
+  accept_worker_t *worker = args;
+  struct sockaddr_in client_address;
+  tpool_pin();
+
+  while (1) {
+    socklen_t client_address_length = sizeof(client_address);
+    int client_socket_number = accept4(worker->socket_number,
+        (struct sockaddr *) &client_address, &client_address_length, SOCK_CLOEXEC);
+    if (client_socket_number < 0) {
+      if (errno != EINTR)
+        perror("Error accepting socket");
+      continue;
+    }
+
+    if (client_accepted(client_socket_number, &client_address) == 0)
+      worker->request_handler(client_socket_number);
+  }
+
+  return NULL;
+}
+
+
+/*
+ * Runs num_threads accept_handler threads, the last one on the calling thread.
+ * With reuseport, each thread gets its own SO_REUSEPORT socket, so accepts do
+ * not contend on one socket; otherwise they all block in accept() on a shared
+ * socket and the kernel hands each connection to an idle one.
+ */
+void serve_forever_accept_pool(int *socket_number, void (*request_handler)(int),
+    int reuseport) {
+  accept_worker_t *workers = calloc(num_threads, sizeof(accept_worker_t));
+  for (int i = 0; i < num_threads; i++) {
+    workers[i].request_handler = request_handler;
+    if (i == 0 || reuseport)
+      workers[i].socket_number = open_server_socket(server_port, reuseport);
+    else
+      workers[i].socket_number = workers[0].socket_number;
+  }
+  *socket_number = workers[0].socket_number;
+
+  printf("Listening on port %d with %d accepting threads...\n", server_port, num_threads);
+
+  for (int i = 0; i < num_threads - 1; i++) {
+    pthread_t thread;
+    pthread_create(&thread, NULL, accept_handler, &workers[i]);
+    pthread_detach(thread);
+  }
+  accept_handler(&workers[num_threads - 1]);
+}
+
+
+/*
+ * Opens a TCP stream socket on all interfaces with port number PORTNO. Saves
+ * the fd number of the server socket in *socket_number. For each accepted
+ * connection, calls request_handler with the accepted fd number.
+ */
+void serve_forever(int *socket_number, void (*request_handler)(int)) {
+
+  struct sockaddr_in client_address;
+  socklen_t client_address_length;
+  int client_socket_number;
+
+  if (num_threads > 0 && server_accept_mode != ACCEPT_QUEUE) {
+    serve_forever_accept_pool(socket_number, request_handler,
+        server_accept_mode == ACCEPT_REUSEPORT);
+    return;
+  }
+
+  *socket_number = open_server_socket(server_port, 0);
+
+  if (num_threads > 0 && server_max_threads > num_threads)
+    printf("Listening on port %d with %d to %d pool threads...\n", server_port,
+        num_threads, server_max_threads);
+  else
+    printf("Listening on port %d...\n", server_port);
+
+  /* Without a pool, an idle persistent connection would block accept(). */
+  if (num_threads == 0)
+    server_keep_alive_requests = 1;
 
   wq_init(&work_queue);
+  work_queue.high_water = server_queue_high_water;
+  wq_set_codel(&work_queue, server_codel_target, server_codel_interval);
   init_thread_pool(num_threads, request_handler);
 
   while (1) {
+    client_address_length = sizeof(client_address);
     client_socket_number = accept(*socket_number,
-        (struct sockaddr *) &client_address,
-        (socklen_t *) &client_address_length);
+        (struct sockaddr *) &client_address, &client_address_length);
     if (client_socket_number < 0) {
       perror("Error accepting socket");
       continue;
     }
 
-    printf("Accepted connection from %s on port %d\n",
-        inet_ntoa(client_address.sin_addr),
-        client_address.sin_port);
+    if (client_accepted(client_socket_number, &client_address) != 0)
+      continue;
 
-    if (num_threads != 0) {
-      wq_push(&work_queue, client_socket_number);
-    } else {
+    /* The request handlers close the client socket themselves. */
+    if (num_threads == 0) {
       request_handler(client_socket_number);
-      close(client_socket_number);
+    } else if (wq_try_push(&work_queue, client_socket_number) != 0) {
+      shed_connection(client_socket_number, METRICS_SHED_HIGH_WATER);
+    } else {
+      metrics_queue_depth(work_queue.size);
     }
   }
 
@@ -374,21 +1364,143 @@ void signal_callback_handler(int signum) {
 }
 
 char *USAGE =
-  "Usage: ./httpserver --files www_directory/ --port 8000 [--num-threads 5]\n"
-  "       ./httpserver --proxy inst.eecs.berkeley.edu:80 --port 8000 [--num-threads 5]\n";
+  "Usage: ./httpserver --files www_directory/ --port 8000 [--num-threads 5] [--event-loop]\n"
+  "       ./httpserver --proxy inst.eecs.berkeley.edu:80[,HOSTNAME:PORT...] --port 8000 [--num-threads 5] [--event-loop]\n"
+  "\n"
+  "With --event-loop, connections are served by non-blocking epoll loops (one\n"
+  "per core, or --num-threads of them) instead of one pool thread each.\n"
+  "\n"
+  "Request counts and latency histograms are served on " METRICS_PATH " in the\n"
+  "Prometheus text format, except with --proxy-mode tcp, which relays every byte.\n"
+  "\n"
+  "Options:\n"
+  "  --keep-alive-timeout SECONDS  Close persistent connections idle this long (default 5).\n"
+  "  --header-timeout SECONDS      Close connections whose request head has not arrived\n"
+  "                                this long after its first byte, or after the\n"
+  "                                connection was picked up (default 10, 0 for none).\n"
+  "  --body-timeout SECONDS        Close connections whose request or response body\n"
+  "                                (with --proxy-mode tcp, whose relay) has stalled this\n"
+  "                                long, answering 504 if the proxy target has not begun\n"
+  "                                to respond by then (default 30, 0 for none).\n"
+  "  --max-conns-per-ip N          Answer connections from a client address that has N\n"
+  "                                open already with 503 (default 0, no limit).\n"
+  "  --keep-alive-requests N       Requests served per connection (default 100, 1 disables\n"
+  "                                keep-alive; always 1 without --num-threads or --event-loop).\n"
+  "  --cache-size BYTES[k|m|g]     Cache small static files in memory (default 0, disabled).\n"
+  "  --cache-revalidate MS         Re-stat cached files at most this often (default 1000).\n"
+  "  --mime-types FILE             Also map extensions to types as FILE (e.g.\n"
+  "                                /etc/mime.types) does.\n"
+  "  --gzip                        Gzip text files into the cache for clients that\n"
+  "                                accept it (needs --cache-size).\n"
+  "  --proxy-mode MODE             http (default: forward requests one by one, rewriting\n"
+  "                                hop-by-hop headers and reusing upstream connections)\n"
+  "                                or tcp (relay the raw bytes).\n"
+  "  --proxy-balance POLICY        How each proxied connection picks a target:\n"
+  "                                round-robin (default), least-conn or hash (on the\n"
+  "                                path of the first request).\n"
+  "  --proxy-connect-timeout MS    Give up connecting to a target after this long\n"
+  "                                (default 1000).\n"
+  "  --proxy-max-fails N           Eject a target after N failed or slow connects in a\n"
+  "                                row (default 3).\n"
+  "  --proxy-fail-timeout SECONDS  Skip an ejected target for this long (default 10).\n"
+  "  --proxy-cache-size BYTES[k|m|g]\n"
+  "                                Cache fresh proxied responses to GET requests in\n"
+  "                                memory (default 0, disabled).\n"
+  "  --proxy-cache-dir DIR         Move the least recently used cached responses to\n"
+  "                                files in DIR instead of dropping them.\n"
+  "  --proxy-cache-disk-size BYTES[k|m|g]\n"
+  "                                Keep at most this much in --proxy-cache-dir\n"
+  "                                (default 1g).\n"
+  "  --proxy-pool N                Keep N idle connections to each proxy target open\n"
+  "                                (default 0).\n"
+  "  --proxy-max-idle MS           Close pooled connections idle this long (default 10000).\n"
+  "  --proxy-dns-ttl SECONDS       Look the proxy targets up again after this long\n"
+  "                                (default 30).\n"
+  "  --accept MODE                 How pool threads get connections with --num-threads:\n"
+  "                                queue (default: one acceptor feeds the work queue),\n"
+  "                                shared (every thread accepts on one socket) or\n"
+  "                                reuseport (every thread has its own SO_REUSEPORT socket).\n"
+  "  --max-threads N               With --accept queue, add pool threads up to N while\n"
+  "                                connections wait for one (default --num-threads, a\n"
+  "                                fixed pool; --num-threads is 1 then unless given).\n"
+  "  --thread-idle-timeout SECONDS Stop pool threads beyond --num-threads that have been\n"
+  "                                idle this long (default 60).\n"
+  "  --cpu-affinity MODE           none (default), cores (pin each pool thread, accepting\n"
+  "                                thread or event loop to one CPU, spreading them evenly)\n"
+  "                                or numa (pin each to the CPUs of one NUMA node).\n"
+  "  --io-engine ENGINE            blocking (default) or io_uring: look files up and send\n"
+  "                                them with batched io_uring submissions instead of one\n"
+  "                                system call at a time (--files; falls back to blocking\n"
+  "                                if the kernel lacks io_uring).\n"
+  "  --access-log FILE             Append a JSON line per response to FILE (- for the\n"
+  "                                standard output), written by a background thread.\n"
+  "  --queue-high-water N          With --accept queue, answer new connections with 503\n"
+  "                                while N are waiting for a pool thread (default 4096).\n"
+  "  --queue-deadline MS           Answer connections that waited longer than this for a\n"
+  "                                pool thread with 503 instead (default 0, no deadline).\n"
+  "  --codel-target MS             Answer queued connections with 503 as CoDel decides,\n"
+  "                                to keep their wait near MS (default 0, off).\n"
+  "  --codel-interval MS           How long waits may stay above --codel-target before\n"
+  "                                CoDel starts dropping (default 100).\n"
+  "  --quiet                       Do not print a line for every accepted connection.\n";
 
 void exit_with_usage() {
   fprintf(stderr, "%s", USAGE);
   exit(EXIT_SUCCESS);
 }
 
+/* Parses the value of FLAG, a size in bytes with an optional k, m or g. */
+size_t parse_size(char *flag, char *size_str) {
+  char *suffix;
+  size_t size = 0;
+  if (!size_str || (size = strtoul(size_str, &suffix, 10), suffix == size_str)) {
+    fprintf(stderr, "Expected size after %s\n", flag);
+    exit_with_usage();
+  }
+  if (*suffix == 'k' || *suffix == 'K') size <<= 10;
+  else if (*suffix == 'm' || *suffix == 'M') size <<= 20;
+  else if (*suffix == 'g' || *suffix == 'G') size <<= 30;
+  return size;
+}
+
 int main(int argc, char **argv) {
   signal(SIGINT, signal_callback_handler);
   signal(SIGPIPE, SIG_IGN);
 
   /* Default settings */
   server_port = 8000;
+  server_keep_alive_timeout = 5;
+  server_keep_alive_requests = 100;
+  server_header_timeout = 10;
+  server_body_timeout = 30;
+  server_log_connections = 1;
+  server_gzip = 0;
+  server_accept_mode = ACCEPT_QUEUE;
+  server_queue_high_water = WQ_CAPACITY;
+  server_queue_deadline = 0;
+  server_codel_target = 0;
+  server_codel_interval = 100 * 1000000LL;
+  server_max_threads = 0;
+  server_thread_idle_timeout = 60;
+  server_proxy_http = 1;
+  size_t cache_size = 0;
+  int cache_revalidate_ms = 1000;
+  size_t proxy_cache_size = 0;
+  char *proxy_cache_dir = NULL;
+  size_t proxy_cache_disk_size = 1 << 30;
+  upstream_config_t proxy_config;
+  proxy_config.policy = UPSTREAM_ROUND_ROBIN;
+  proxy_config.pool_size = 0;
+  proxy_config.max_idle_ms = 10000;
+  proxy_config.dns_ttl_ms = 30 * 1000;
+  proxy_config.connect_timeout_ms = 1000;
+  proxy_config.max_fails = 3;
+  proxy_config.fail_timeout_ms = 10 * 1000;
   void (*request_handler)(int) = NULL;
+  int max_conns_per_ip = 0;
+  enum tpool_affinity cpu_affinity = TPOOL_AFFINITY_NONE;
+  int event_loop = 0;
+  int io_uring = 0;
 
   int i;
   for (i = 1; i < argc; i++) {
@@ -409,15 +1521,7 @@ int main(int argc, char **argv) {
         exit_with_usage();
       }
 
-      char *colon_pointer = strchr(proxy_target, ':');
-      if (colon_pointer != NULL) {
-        *colon_pointer = '\0';
-        server_proxy_hostname = proxy_target;
-        server_proxy_port = atoi(colon_pointer + 1);
-      } else {
-        server_proxy_hostname = proxy_target;
-        server_proxy_port = 80;
-      }
+      server_proxy_targets = proxy_target;
     } else if (strcmp("--port", argv[i]) == 0) {
       char *server_port_string = argv[++i];
       if (!server_port_string) {
@@ -431,6 +1535,209 @@ int main(int argc, char **argv) {
         fprintf(stderr, "Expected positive integer after --num-threads\n");
         exit_with_usage();
       }
+    } else if (strcmp("--max-threads", argv[i]) == 0) {
+      char *max_threads_str = argv[++i];
+      if (!max_threads_str || (server_max_threads = atoi(max_threads_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --max-threads\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--thread-idle-timeout", argv[i]) == 0) {
+      char *timeout_str = argv[++i];
+      if (!timeout_str || (server_thread_idle_timeout = atoi(timeout_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --thread-idle-timeout\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--cpu-affinity", argv[i]) == 0) {
+      char *mode = argv[++i];
+      if (mode && strcmp(mode, "none") == 0) {
+        cpu_affinity = TPOOL_AFFINITY_NONE;
+      } else if (mode && strcmp(mode, "cores") == 0) {
+        cpu_affinity = TPOOL_AFFINITY_CORES;
+      } else if (mode && strcmp(mode, "numa") == 0) {
+        cpu_affinity = TPOOL_AFFINITY_NUMA;
+      } else {
+        fprintf(stderr, "Expected none, cores or numa after --cpu-affinity\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--keep-alive-timeout", argv[i]) == 0) {
+      char *timeout_str = argv[++i];
+      if (!timeout_str || (server_keep_alive_timeout = atoi(timeout_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --keep-alive-timeout\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--header-timeout", argv[i]) == 0) {
+      char *timeout_str = argv[++i];
+      if (!timeout_str || (server_header_timeout = atoi(timeout_str)) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --header-timeout\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--body-timeout", argv[i]) == 0) {
+      char *timeout_str = argv[++i];
+      if (!timeout_str || (server_body_timeout = atoi(timeout_str)) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --body-timeout\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--max-conns-per-ip", argv[i]) == 0) {
+      char *max_str = argv[++i];
+      if (!max_str || (max_conns_per_ip = atoi(max_str)) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --max-conns-per-ip\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--keep-alive-requests", argv[i]) == 0) {
+      char *requests_str = argv[++i];
+      if (!requests_str || (server_keep_alive_requests = atoi(requests_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --keep-alive-requests\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--cache-size", argv[i]) == 0) {
+      cache_size = parse_size(argv[i], argv[i + 1]);
+      i++;
+    } else if (strcmp("--cache-revalidate", argv[i]) == 0) {
+      char *revalidate_str = argv[++i];
+      if (!revalidate_str || (cache_revalidate_ms = atoi(revalidate_str)) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --cache-revalidate\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--proxy-cache-size", argv[i]) == 0) {
+      proxy_cache_size = parse_size(argv[i], argv[i + 1]);
+      i++;
+    } else if (strcmp("--proxy-cache-dir", argv[i]) == 0) {
+      proxy_cache_dir = argv[++i];
+      if (!proxy_cache_dir) {
+        fprintf(stderr, "Expected directory after --proxy-cache-dir\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--proxy-cache-disk-size", argv[i]) == 0) {
+      proxy_cache_disk_size = parse_size(argv[i], argv[i + 1]);
+      i++;
+    } else if (strcmp("--proxy-pool", argv[i]) == 0) {
+      char *pool_str = argv[++i];
+      if (!pool_str || (proxy_config.pool_size = atoi(pool_str)) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --proxy-pool\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--proxy-max-idle", argv[i]) == 0) {
+      char *max_idle_str = argv[++i];
+      if (!max_idle_str || (proxy_config.max_idle_ms = atoi(max_idle_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --proxy-max-idle\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--proxy-dns-ttl", argv[i]) == 0) {
+      char *ttl_str = argv[++i];
+      if (!ttl_str || (proxy_config.dns_ttl_ms = atoi(ttl_str)) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --proxy-dns-ttl\n");
+        exit_with_usage();
+      }
+      proxy_config.dns_ttl_ms *= 1000;
+    } else if (strcmp("--proxy-mode", argv[i]) == 0) {
+      char *mode = argv[++i];
+      if (mode && strcmp(mode, "http") == 0) {
+        server_proxy_http = 1;
+      } else if (mode && strcmp(mode, "tcp") == 0) {
+        server_proxy_http = 0;
+      } else {
+        fprintf(stderr, "Expected http or tcp after --proxy-mode\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--proxy-balance", argv[i]) == 0) {
+      char *policy = argv[++i];
+      if (policy && strcmp(policy, "round-robin") == 0) {
+        proxy_config.policy = UPSTREAM_ROUND_ROBIN;
+      } else if (policy && strcmp(policy, "least-conn") == 0) {
+        proxy_config.policy = UPSTREAM_LEAST_CONN;
+      } else if (policy && strcmp(policy, "hash") == 0) {
+        proxy_config.policy = UPSTREAM_HASH;
+      } else {
+        fprintf(stderr, "Expected round-robin, least-conn or hash after --proxy-balance\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--proxy-connect-timeout", argv[i]) == 0) {
+      char *timeout_str = argv[++i];
+      if (!timeout_str || (proxy_config.connect_timeout_ms = atoi(timeout_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --proxy-connect-timeout\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--proxy-max-fails", argv[i]) == 0) {
+      char *max_fails_str = argv[++i];
+      if (!max_fails_str || (proxy_config.max_fails = atoi(max_fails_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --proxy-max-fails\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--proxy-fail-timeout", argv[i]) == 0) {
+      char *fail_timeout_str = argv[++i];
+      if (!fail_timeout_str || (proxy_config.fail_timeout_ms = atoi(fail_timeout_str)) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --proxy-fail-timeout\n");
+        exit_with_usage();
+      }
+      proxy_config.fail_timeout_ms *= 1000;
+    } else if (strcmp("--accept", argv[i]) == 0) {
+      char *mode = argv[++i];
+      if (mode && strcmp(mode, "queue") == 0) {
+        server_accept_mode = ACCEPT_QUEUE;
+      } else if (mode && strcmp(mode, "shared") == 0) {
+        server_accept_mode = ACCEPT_SHARED;
+      } else if (mode && strcmp(mode, "reuseport") == 0) {
+        server_accept_mode = ACCEPT_REUSEPORT;
+      } else {
+        fprintf(stderr, "Expected queue, shared or reuseport after --accept\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--io-engine", argv[i]) == 0) {
+      char *engine = argv[++i];
+      if (engine && strcmp(engine, "blocking") == 0) {
+        io_uring = 0;
+      } else if (engine && strcmp(engine, "io_uring") == 0) {
+        io_uring = 1;
+      } else {
+        fprintf(stderr, "Expected blocking or io_uring after --io-engine\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--queue-high-water", argv[i]) == 0) {
+      char *high_water_str = argv[++i];
+      if (!high_water_str || (server_queue_high_water = atoi(high_water_str)) < 1
+          || server_queue_high_water > WQ_CAPACITY) {
+        fprintf(stderr, "Expected integer from 1 to %d after --queue-high-water\n", WQ_CAPACITY);
+        exit_with_usage();
+      }
+    } else if (strcmp("--queue-deadline", argv[i]) == 0) {
+      char *deadline_str = argv[++i];
+      if (!deadline_str || (server_queue_deadline = atoi(deadline_str)) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --queue-deadline\n");
+        exit_with_usage();
+      }
+      server_queue_deadline *= 1000000;
+    } else if (strcmp("--codel-target", argv[i]) == 0) {
+      char *target_str = argv[++i];
+      if (!target_str || (server_codel_target = atoi(target_str)) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --codel-target\n");
+        exit_with_usage();
+      }
+      server_codel_target *= 1000000;
+    } else if (strcmp("--codel-interval", argv[i]) == 0) {
+      char *interval_str = argv[++i];
+      if (!interval_str || (server_codel_interval = atoi(interval_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --codel-interval\n");
+        exit_with_usage();
+      }
+      server_codel_interval *= 1000000;
+    } else if (strcmp("--mime-types", argv[i]) == 0) {
+      char *mime_types_path = argv[++i];
+      if (!mime_types_path || http_load_mime_types(mime_types_path) != 0) {
+        fprintf(stderr, "Expected a readable mime.types file after --mime-types\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--gzip", argv[i]) == 0) {
+      server_gzip = 1;
+    } else if (strcmp("--access-log", argv[i]) == 0) {
+      char *access_log_path = argv[++i];
+      if (!access_log_path || alog_init(access_log_path) != 0) {
+        fprintf(stderr, "Expected a writable file after --access-log\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--quiet", argv[i]) == 0) {
+      server_log_connections = 0;
+    } else if (strcmp("--event-loop", argv[i]) == 0) {
+      event_loop = 1;
     } else if (strcmp("--help", argv[i]) == 0) {
       exit_with_usage();
     } else {
@@ -439,13 +1746,49 @@ int main(int argc, char **argv) {
     }
   }
 
-  if (server_files_directory == NULL && server_proxy_hostname == NULL) {
+  if (server_files_directory == NULL && server_proxy_targets == NULL) {
     fprintf(stderr, "Please specify either \"--files [DIRECTORY]\" or \n"
-                    "                      \"--proxy [HOSTNAME:PORT]\"\n");
+                    "                      \"--proxy [HOSTNAME:PORT[,...]]\"\n");
+    exit_with_usage();
+  }
+
+  /* Without a cache, every compressible response would be marked as varying
+   * on Accept-Encoding, yet be sent uncompressed. */
+  if (server_gzip && cache_size == 0) {
+    fprintf(stderr, "Expected --cache-size with --gzip\n");
+    exit_with_usage();
+  }
+  /* Only entries evicted from memory are spilled. */
+  if (proxy_cache_dir != NULL && proxy_cache_size == 0) {
+    fprintf(stderr, "Expected --proxy-cache-size with --proxy-cache-dir\n");
+    exit_with_usage();
+  }
+
+  if (server_max_threads > 0 && num_threads == 0 && !event_loop
+      && server_accept_mode == ACCEPT_QUEUE)
+    num_threads = 1;
+  if (server_max_threads < num_threads)
+    server_max_threads = num_threads;
+  if (tpool_set_affinity(cpu_affinity) != 0)
+    fprintf(stderr, "The CPUs to pin threads to are not known; not pinning them\n");
+
+  if (iplimit_init(max_conns_per_ip) != 0) {
+    perror("Failed to set up --max-conns-per-ip");
+    exit(EXIT_FAILURE);
+  }
+  if (io_uring && uring_init() != 0)
+    fprintf(stderr, "io_uring is not available; using blocking I/O\n");
+  fcache_init(cache_size, cache_revalidate_ms);
+  pcache_init(proxy_cache_size, proxy_cache_dir, proxy_cache_disk_size);
+  if (server_proxy_targets != NULL && upstream_init(server_proxy_targets, &proxy_config) != 0) {
+    fprintf(stderr, "Expected 1 to %d proxy targets\n", UPSTREAM_MAX_BACKENDS);
     exit_with_usage();
   }
 
-  serve_forever(&server_fd, request_handler);
+  if (event_loop)
+    evloop_serve_forever(&server_fd, request_handler == handle_proxy_request);
+  else
+    serve_forever(&server_fd, request_handler);
 
   return EXIT_SUCCESS;
 }
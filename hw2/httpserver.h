@@ -0,0 +1,94 @@
+#ifndef HTTPSERVER_H
+#define HTTPSERVER_H
+
+#include <netinet/in.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "fcache.h"
+#include "libhttp.h"
+#include "tpool.h"
+#include "wq.h"
+
+enum accept_mode {
+  ACCEPT_QUEUE,    // One thread accepts and pushes sockets into work_queue.
+  ACCEPT_SHARED,   // Every pool thread accepts on one shared socket.
+  ACCEPT_REUSEPORT // Every pool thread accepts on its own SO_REUSEPORT socket.
+};
+
+/*
+ * Global configuration variables, set up in main() using the command line
+ * arguments. Shared with the event loop (evloop.c).
+ */
+extern wq_t work_queue;
+extern tpool_t worker_pool;
+extern int num_threads;
+extern int server_port;
+extern char *server_files_directory;
+extern char *server_proxy_targets;
+extern int server_proxy_http;
+extern int server_keep_alive_timeout;
+extern int server_keep_alive_requests;
+extern int server_header_timeout;
+extern int server_body_timeout;
+extern int server_log_connections;
+extern int server_gzip;
+extern enum accept_mode server_accept_mode;
+
+#define FILE_RESPONSE_MAX_PARTS (2 * LIBHTTP_MAX_RANGES + 1)
+
+/* A lingering close (see client_linger) ends this long after the shutdown,
+ * or once this much has been discarded, however the client keeps sending. */
+#define SERVER_LINGER_MS 5000
+#define SERVER_LINGER_MAX_BYTES (1 << 20)
+
+/*
+ * A piece of a response body: LENGTH bytes at DATA, or, if DATA is NULL,
+ * LENGTH bytes of the response's FILE_FD starting at OFFSET.
+ */
+struct file_response_part {
+  char *data;
+  off_t offset;
+  size_t length;
+};
+
+/*
+ * A response to a files request, prepared without touching the client socket
+ * so that it can be sent either by a blocking worker (send_file_response) or
+ * incrementally by the event loop.
+ *
+ * The status line and headers are rendered into HEAD, and the body is sent as
+ * the sequence of PARTS. Parts point into BODY (memory owned by the response,
+ * e.g. a directory listing or multipart/byteranges boundaries), into the body
+ * of CACHE_ENTRY, or into FILE_FD. KEEP_ALIVE is set by the caller before
+ * preparing, and decides the Connection header.
+ */
+struct file_response {
+  int status;
+  int keep_alive;
+  long long started; // When the request began to arrive (see metrics.h), or 0.
+  struct http_head head;
+  char *body;
+  int file_fd;
+  fcache_entry_t *cache_entry;
+  int num_parts;
+  struct file_response_part parts[FILE_RESPONSE_MAX_PARTS];
+};
+
+void prepare_files_response(struct http_request *request,
+    struct file_response *response);
+void prepare_error_response(struct file_response *response, int status_code);
+void prepare_bad_gateway_response(struct file_response *response);
+uint32_t proxy_request_hash(char *data, size_t length);
+int request_keep_alive(struct http_request *request, int requests_served);
+int file_response_send(int fd, struct file_response *response, size_t *sent);
+size_t send_file_response(int fd, struct file_response *response);
+void file_response_release(struct file_response *response);
+
+int server_timeout_ms(int seconds);
+int server_linger_ms(long long started);
+int client_accepted(int fd, struct sockaddr_in *client_address);
+void client_close(int fd);
+int open_server_socket(int port, int reuseport);
+
+#endif
@@ -0,0 +1,109 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+
+#include "iplimit.h"
+
+#define IPLIMIT_BUCKETS 4096 // Must be a power of two.
+
+typedef struct iplimit_entry {
+  uint32_t address; // In network byte order.
+  int count;
+  struct iplimit_entry *next;
+} iplimit_entry_t;
+
+int iplimit_max;
+iplimit_entry_t *iplimit_table[IPLIMIT_BUCKETS];
+pthread_mutex_t iplimit_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* The address each fd was counted for, or 0 (no client has it) if none. */
+uint32_t *iplimit_owners;
+int iplimit_num_fds;
+
+
+/*
+ * Limits every client address to MAX_PER_IP open connections, or lifts the
+ * limit if it is 0. Returns -1 if the table of fds cannot be allocated.
+ */
+int iplimit_init(int max_per_ip) {
+  if (max_per_ip <= 0)
+    return 0;
+
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) != 0 || limit.rlim_cur == RLIM_INFINITY
+      || limit.rlim_cur > (1 << 24))
+    limit.rlim_cur = 1 << 24;
+  iplimit_owners = calloc(limit.rlim_cur, sizeof(uint32_t));
+  if (iplimit_owners == NULL)
+    return -1;
+  iplimit_num_fds = limit.rlim_cur;
+  iplimit_max = max_per_ip;
+  return 0;
+}
+
+
+int iplimit_enabled() {
+  return iplimit_max > 0;
+}
+
+
+iplimit_entry_t **iplimit_bucket(uint32_t address) {
+  return &iplimit_table[(address * 2654435761u) >> 20 & (IPLIMIT_BUCKETS - 1)];
+}
+
+
+/*
+ * Counts the accepted socket FD against the client at ADDRESS. Returns -1,
+ * counting nothing, if that client already has the most connections allowed.
+ */
+int iplimit_acquire(int fd, struct in_addr address) {
+  if (iplimit_max <= 0 || fd < 0 || fd >= iplimit_num_fds || address.s_addr == 0)
+    return 0;
+
+  pthread_mutex_lock(&iplimit_mutex);
+  iplimit_entry_t **bucket = iplimit_bucket(address.s_addr);
+  iplimit_entry_t *entry = *bucket;
+  while (entry != NULL && entry->address != address.s_addr)
+    entry = entry->next;
+  if (entry == NULL && (entry = malloc(sizeof(iplimit_entry_t))) != NULL) {
+    entry->address = address.s_addr;
+    entry->count = 0;
+    entry->next = *bucket;
+    *bucket = entry;
+  }
+
+  int result = 0;
+  if (entry == NULL || entry->count >= iplimit_max) {
+    result = -1;
+  } else {
+    entry->count++;
+    iplimit_owners[fd] = address.s_addr;
+  }
+  pthread_mutex_unlock(&iplimit_mutex);
+  return result;
+}
+
+
+/*
+ * Uncounts the socket FD, if iplimit_acquire() counted it. Must be called
+ * before FD is closed: once it is, another thread may accept a socket with
+ * the same number.
+ */
+void iplimit_release(int fd) {
+  if (iplimit_max <= 0 || fd < 0 || fd >= iplimit_num_fds || iplimit_owners[fd] == 0)
+    return;
+
+  pthread_mutex_lock(&iplimit_mutex);
+  uint32_t address = iplimit_owners[fd];
+  iplimit_owners[fd] = 0;
+  iplimit_entry_t **link = iplimit_bucket(address);
+  while (*link != NULL && (*link)->address != address)
+    link = &(*link)->next;
+  iplimit_entry_t *entry = *link;
+  if (entry != NULL && --entry->count == 0) {
+    *link = entry->next;
+    free(entry);
+  }
+  pthread_mutex_unlock(&iplimit_mutex);
+}
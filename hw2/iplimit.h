@@ -0,0 +1,19 @@
+#ifndef __IPLIMIT__
+#define __IPLIMIT__
+
+#include <netinet/in.h>
+
+/* IPLIMIT caps the connections one client address may have open at once,
+ * with --max-conns-per-ip, so that a few clients cannot take every worker.
+ *
+ * The open connections are counted per address in a hash table under one
+ * mutex, which is only taken when a connection is accepted and when it is
+ * closed. The address each socket was counted for is remembered by fd, so
+ * that closing needs nothing but the fd. */
+
+int iplimit_init(int max_per_ip);
+int iplimit_enabled();
+int iplimit_acquire(int fd, struct in_addr address);
+void iplimit_release(int fd);
+
+#endif
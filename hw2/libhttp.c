@@ -1,78 +1,534 @@
+#define _GNU_SOURCE
+
+#include <ctype.h>
 #include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
+#include <zlib.h>
 
 #include "libhttp.h"
 
-#define LIBHTTP_REQUEST_MAX_SIZE 8192
-
 void http_fatal_error(char *message) {
   fprintf(stderr, "%s\n", message);
   exit(ENOBUFS);
 }
 
-struct http_request *http_request_parse(int fd) {
-  struct http_request *request = malloc(sizeof(struct http_request));
-  if (!request) http_fatal_error("Malloc failed");
-
-  char *read_buffer = malloc(LIBHTTP_REQUEST_MAX_SIZE + 1);
-  if (!read_buffer) http_fatal_error("Malloc failed");
-
-  int bytes_read = read(fd, read_buffer, LIBHTTP_REQUEST_MAX_SIZE);
-  read_buffer[bytes_read] = '\0'; /* Always null-terminate. */
-
-  char *read_start, *read_end;
-  size_t read_size;
-
-  do {
-    /* Read in the HTTP method: "[A-Z]*" */
-    read_start = read_end = read_buffer;
-    while (*read_end >= 'A' && *read_end <= 'Z') read_end++;
-    read_size = read_end - read_start;
-    if (read_size == 0) break;
-    request->method = malloc(read_size + 1);
-    memcpy(request->method, read_start, read_size);
-    request->method[read_size] = '\0';
-
-    /* Read in a space character. */
-    read_start = read_end;
-    if (*read_end != ' ') break;
-    read_end++;
-
-    /* Read in the path: "[^ \n]*" */
-    read_start = read_end;
-    while (*read_end != '\0' && *read_end != ' ' && *read_end != '\n') read_end++;
-    read_size = read_end - read_start;
-    if (read_size == 0) break;
-    request->path = malloc(read_size + 1);
-    memcpy(request->path, read_start, read_size);
-    request->path[read_size] = '\0';
-
-    /* Read in HTTP version and rest of request line: ".*" */
-    read_start = read_end;
-    while (*read_end != '\0' && *read_end != '\n') read_end++;
-    if (*read_end != '\n') break;
-    read_end++;
-
-    free(read_buffer);
-    return request;
-  } while (0);
-
-  /* An error occurred. */
-  free(request);
-  free(read_buffer);
+void http_buffer_init(struct http_buffer *buffer) {
+  buffer->start = 0;
+  buffer->length = 0;
+  buffer->consumed = 0;
+  buffer->discard = 0;
+  buffer->state = HTTP_STATE_REQUEST_LINE;
+  buffer->line_start = 0;
+  buffer->scan = 0;
+  buffer->started = 0;
+}
+
+/*
+ * Drops the request returned by the last http_buffer_parse call, keeping any
+ * pipelined bytes that follow it, and resets the parser for the next request.
+ */
+void http_buffer_consume(struct http_buffer *buffer) {
+  buffer->start += buffer->consumed;
+  if (buffer->start >= buffer->length) {
+    buffer->discard += buffer->start - buffer->length;
+    buffer->start = buffer->length = 0;
+  }
+  buffer->consumed = 0;
+  buffer->state = HTTP_STATE_REQUEST_LINE;
+  buffer->line_start = 0;
+  buffer->scan = 0;
+  buffer->started = 0;
+}
+
+/*
+ * Reads once from FD into the free space of BUFFER, skipping body bytes of an
+ * earlier request. The unconsumed bytes are moved to the front of the buffer
+ * first if it is full. Returns the result of read(), so a non-blocking FD
+ * gives -1 with errno EAGAIN when there is nothing to read.
+ */
+ssize_t http_buffer_fill(int fd, struct http_buffer *buffer) {
+  if (buffer->length == LIBHTTP_REQUEST_MAX_SIZE && buffer->start > 0) {
+    buffer->length -= buffer->start;
+    memmove(buffer->data, buffer->data + buffer->start, buffer->length);
+    buffer->start = 0;
+  }
+
+  char *end = buffer->data + buffer->length;
+  ssize_t bytes_read = read(fd, end, LIBHTTP_REQUEST_MAX_SIZE - buffer->length);
+  if (bytes_read <= 0)
+    return bytes_read;
+
+  if (buffer->discard > 0) {
+    size_t skip = buffer->discard < (size_t) bytes_read ? buffer->discard : bytes_read;
+    memmove(end, end + skip, bytes_read - skip);
+    buffer->discard -= skip;
+    buffer->length += bytes_read - skip;
+  } else {
+    buffer->length += bytes_read;
+  }
+  return bytes_read;
+}
+
+/*
+ * Returns 1 if the comma-separated header VALUE contains TOKEN.
+ */
+int http_header_has_token(char *value, char *token) {
+  size_t token_length = strlen(token);
+  while (*value != '\0') {
+    while (*value == ' ' || *value == '\t' || *value == ',') value++;
+    char *token_end = value;
+    while (*token_end != '\0' && *token_end != ',') token_end++;
+    char *trimmed = token_end;
+    while (trimmed > value && (trimmed[-1] == ' ' || trimmed[-1] == '\t')) trimmed--;
+    if ((size_t) (trimmed - value) == token_length
+        && strncasecmp(value, token, token_length) == 0)
+      return 1;
+    value = token_end;
+  }
+  return 0;
+}
+
+/*
+ * Parses the request line "METHOD PATH [HTTP/1.x]" of LENGTH bytes at LINE.
+ * The method and path are null-terminated in place. Returns -1 if malformed.
+ */
+int http_parse_request_line(struct http_buffer *buffer, char *line, size_t length) {
+  struct http_request *request = &buffer->request;
+  char *base = buffer->data + buffer->start;
+  char *end = line + length;
+
+  /* Read in the HTTP method: "[A-Z]*" */
+  char *read_end = line;
+  while (read_end < end && *read_end >= 'A' && *read_end <= 'Z') read_end++;
+  if (read_end == line || read_end == end || *read_end != ' ')
+    return -1;
+  buffer->method_offset = line - base;
+  *read_end++ = '\0';
+
+  /* Read in the path: "[^ ]*" */
+  char *path = read_end;
+  while (read_end < end && *read_end != ' ') read_end++;
+  if (read_end == path)
+    return -1;
+  buffer->path_offset = path - base;
+
+  /* Read in the HTTP version, if any. */
+  request->version = 0;
+  if (end - read_end >= 9 && strncmp(read_end, " HTTP/1.", 8) == 0
+      && read_end[8] >= '1' && read_end[8] <= '9')
+    request->version = 1;
+  *read_end = '\0';
+
+  /* HTTP/1.1 connections are persistent unless the client says otherwise. */
+  request->keep_alive = request->version == 1;
+  request->content_length = 0;
+  request->has_content_length = 0;
+  request->chunked = 0;
+  request->num_headers = 0;
+  return 0;
+}
+
+/*
+ * Finds the path in the first LENGTH bytes of a request at DATA without
+ * parsing or consuming it, e.g. in data peeked from a socket. Returns the
+ * path (not null-terminated) and its length, without the query string, or
+ * NULL if the request line is malformed or has not fully arrived.
+ */
+char *http_request_line_path(char *data, size_t length, size_t *path_length) {
+  char *end = data + length;
+  char *path = data;
+  while (path < end && *path >= 'A' && *path <= 'Z') path++;
+  if (path == data || path == end || *path != ' ')
+    return NULL;
+  path++;
+
+  char *path_end = path;
+  while (path_end < end && *path_end != ' ' && *path_end != '\r' && *path_end != '\n')
+    path_end++;
+  if (path_end == path || path_end == end)
+    return NULL;
+
+  char *query = memchr(path, '?', path_end - path);
+  *path_length = (query ? query : path_end) - path;
+  return path;
+}
+
+/*
+ * Parses the Content-Length VALUE into *LENGTH. Returns -1 unless it is all
+ * digits, and small enough for an off_t.
+ */
+int http_parse_content_length(char *value, size_t *length) {
+  if (*value == '\0')
+    return -1;
+  long long result = 0;
+  for (; *value != '\0'; value++) {
+    if (*value < '0' || *value > '9' || result > (LLONG_MAX - (*value - '0')) / 10)
+      return -1;
+    result = result * 10 + (*value - '0');
+  }
+  *length = result;
+  return 0;
+}
+
+/*
+ * Parses the header line "Name: value" of LENGTH bytes at LINE, records it as
+ * a slice and picks out the headers libhttp acts on. Returns -1 if malformed.
+ *
+ * Where the body ends must be beyond doubt, or a proxy and the server behind
+ * it could disagree on it: a second Content-Length or Transfer-Encoding is
+ * malformed, as is one that cannot be recorded for forwarding.
+ */
+int http_parse_header_line(struct http_buffer *buffer, char *line, size_t length) {
+  struct http_request *request = &buffer->request;
+  char *base = buffer->data + buffer->start;
+  char *end = line + length;
+
+  char *colon = memchr(line, ':', length);
+  if (colon == NULL || colon == line)
+    return -1;
+
+  char *value = colon + 1;
+  while (value < end && (*value == ' ' || *value == '\t')) value++;
+  char *value_end = end;
+  while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t')) value_end--;
+  *colon = '\0';
+  *value_end = '\0';
+
+  if (strcasecmp(line, "Connection") == 0) {
+    if (http_header_has_token(value, "close"))
+      request->keep_alive = 0;
+    else if (http_header_has_token(value, "keep-alive"))
+      request->keep_alive = 1;
+  } else if (strcasecmp(line, "Content-Length") == 0) {
+    if (request->has_content_length || request->num_headers == LIBHTTP_MAX_HEADERS
+        || http_parse_content_length(value, &request->content_length) < 0)
+      return -1;
+    request->has_content_length = 1;
+  } else if (strcasecmp(line, "Transfer-Encoding") == 0) {
+    if (request->chunked || request->num_headers == LIBHTTP_MAX_HEADERS)
+      return -1;
+    request->chunked = 1;
+  }
+
+  if (request->num_headers < LIBHTTP_MAX_HEADERS) {
+    struct http_header *header = &request->headers[request->num_headers++];
+    header->name.offset = line - base;
+    header->name.length = colon - line;
+    header->value.offset = value - base;
+    header->value.length = value_end - value;
+  }
+  return 0;
+}
+
+/* Returns the CLOCK_MONOTONIC time in nanoseconds. */
+long long http_now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/*
+ * Drops the previous request and parses as much of the next one as BUFFER
+ * holds, resuming where the last call stopped, so no byte is looked at twice.
+ *
+ * Returns HTTP_PARSE_COMPLETE once the request head has been read; the request
+ * is then available as buffer->request until the next call. Returns
+ * HTTP_PARSE_INCOMPLETE if more bytes have to be read first, and
+ * HTTP_PARSE_MALFORMED if the request is invalid or its head does not fit in
+ * the buffer. Nothing is allocated.
+ *
+ * The body of a request with Content-Length is skipped by the next call. One
+ * with Transfer-Encoding is left to the caller, which must either decode it
+ * or close the connection after answering (see request->chunked); sending
+ * both headers is malformed (RFC 7230, section 3.3.3).
+ */
+enum http_parse_status http_buffer_parse(struct http_buffer *buffer) {
+  if (buffer->consumed > 0)
+    http_buffer_consume(buffer);
+
+  char *base = buffer->data + buffer->start;
+  size_t available = buffer->length - buffer->start;
+  if (buffer->started == 0 && available > 0)
+    buffer->started = http_now();
+
+  while (buffer->state == HTTP_STATE_REQUEST_LINE || buffer->state == HTTP_STATE_HEADERS) {
+    char *line = base + buffer->line_start;
+    char *newline = memchr(base + buffer->scan, '\n', available - buffer->scan);
+    if (newline == NULL) {
+      buffer->scan = available;
+      if (available == LIBHTTP_REQUEST_MAX_SIZE)
+        buffer->state = HTTP_STATE_ERROR;
+      else
+        return HTTP_PARSE_INCOMPLETE;
+      break;
+    }
+
+    size_t line_length = newline - line;
+    if (line_length > 0 && line[line_length - 1] == '\r')
+      line_length--;
+    buffer->line_start = buffer->scan = newline + 1 - base;
+
+    if (buffer->state == HTTP_STATE_REQUEST_LINE) {
+      if (line_length == 0)
+        continue; /* Tolerate empty lines before the request line. */
+      if (http_parse_request_line(buffer, line, line_length) < 0)
+        buffer->state = HTTP_STATE_ERROR;
+      else
+        buffer->state = HTTP_STATE_HEADERS;
+    } else if (line_length == 0) {
+      buffer->state = HTTP_STATE_DONE;
+    } else if (http_parse_header_line(buffer, line, line_length) < 0) {
+      buffer->state = HTTP_STATE_ERROR;
+    }
+  }
+
+  struct http_request *request = &buffer->request;
+  if (request->chunked && request->has_content_length)
+    buffer->state = HTTP_STATE_ERROR;
+  if (buffer->state == HTTP_STATE_ERROR)
+    return HTTP_PARSE_MALFORMED;
+
+  request->base = base;
+  request->method = base + buffer->method_offset;
+  request->path = base + buffer->path_offset;
+  buffer->consumed = buffer->line_start + request->content_length;
+  return HTTP_PARSE_COMPLETE;
+}
+
+/*
+ * Returns the value of the header NAME in REQUEST (null-terminated, LENGTH
+ * bytes long if LENGTH is not NULL), or NULL if the client did not send it.
+ */
+char *http_request_header(struct http_request *request, char *name, size_t *length) {
+  for (int i = 0; i < request->num_headers; i++) {
+    struct http_header *header = &request->headers[i];
+    if (strcasecmp(request->base + header->name.offset, name) == 0) {
+      if (length != NULL)
+        *length = header->value.length;
+      return request->base + header->value.offset;
+    }
+  }
   return NULL;
+}
+
+/*
+ * Returns 1 if the Accept-Encoding header VALUE allows the content-coding
+ * CODING, named either explicitly or by "*", with a q-value above 0.
+ */
+int http_accepts_encoding(char *value, char *coding) {
+  size_t coding_length = strlen(coding);
+  int wildcard = 0;
 
+  while (*value != '\0') {
+    while (*value == ' ' || *value == '\t' || *value == ',') value++;
+    char *item_end = value;
+    while (*item_end != '\0' && *item_end != ',') item_end++;
+    char *name_end = value;
+    while (name_end < item_end && *name_end != ';' && *name_end != ' '
+        && *name_end != '\t') name_end++;
+
+    /* Only q=0 (or 0.0, 0.00, ...) refuses a coding. */
+    int accepted = 1;
+    char *q = strstr(name_end, "q=");
+    if (q != NULL && q < item_end) {
+      accepted = 0;
+      for (q += 2; q < item_end && (*q == '0' || *q == '.' || *q == '1'); q++)
+        if (*q == '1')
+          accepted = 1;
+      if (q < item_end && *q >= '2' && *q <= '9')
+        accepted = 1;
+    }
+
+    if ((size_t) (name_end - value) == coding_length
+        && strncasecmp(value, coding, coding_length) == 0)
+      return accepted;
+    if (name_end - value == 1 && *value == '*')
+      wildcard = accepted;
+    value = item_end;
+  }
+  return wildcard;
 }
 
-char* http_get_response_message(int status_code) {
+/*
+ * Returns 1 if the If-None-Match header VALUE, a comma-separated list of
+ * entity tags or "*", matches ETAG using the weak comparison of RFC 7232,
+ * section 2.3.2 (a W/ prefix is ignored on either side).
+ */
+int http_etag_matches(char *value, char *etag) {
+  if (strncmp(etag, "W/", 2) == 0)
+    etag += 2;
+  size_t etag_length = strlen(etag);
+
+  while (*value != '\0') {
+    while (*value == ' ' || *value == '\t' || *value == ',') value++;
+    char *tag_end = value;
+    while (*tag_end != '\0' && *tag_end != ',') tag_end++;
+    char *trimmed = tag_end;
+    while (trimmed > value && (trimmed[-1] == ' ' || trimmed[-1] == '\t')) trimmed--;
+    if (trimmed - value == 1 && *value == '*')
+      return 1;
+    if (strncmp(value, "W/", 2) == 0)
+      value += 2;
+    if ((size_t) (trimmed - value) == etag_length
+        && strncmp(value, etag, etag_length) == 0)
+      return 1;
+    value = tag_end;
+  }
+  return 0;
+}
+
+/*
+ * Parses the decimal number at *CURSOR, advancing it. Returns -1 if there is
+ * no number there. One too large for an off_t is taken as the largest, which
+ * is past the end of any representation: a last-byte-pos then extends to the
+ * end (RFC 7233, section 2.1), and a first-byte-pos is not satisfiable.
+ */
+off_t http_parse_offset(char **cursor) {
+  char *digits = *cursor;
+  long long number = 0;
+  for (; **cursor >= '0' && **cursor <= '9'; (*cursor)++) {
+    if (number > (LLONG_MAX - (**cursor - '0')) / 10)
+      number = LLONG_MAX;
+    else
+      number = number * 10 + (**cursor - '0');
+  }
+  return *cursor == digits ? -1 : number;
+}
+
+/*
+ * Parses the value of a Range header for a representation of SIZE bytes into
+ * at most MAX_RANGES RANGES (RFC 7233, section 2.1), in the order requested.
+ * Returns the number of satisfiable ranges, 0 if none is satisfiable (416), or
+ * -1 if the header should be ignored and the whole representation sent: it is
+ * malformed, uses a unit other than bytes, asks for too many ranges, or asks
+ * for more bytes in total than the representation has (overlapping ranges).
+ */
+int http_parse_range(char *value, off_t size, struct http_range *ranges,
+    int max_ranges) {
+  if (strncasecmp(value, "bytes=", 6) != 0)
+    return -1;
+
+  char *cursor = value + 6;
+  int specs = 0, count = 0;
+  off_t total = 0;
+  while (1) {
+    while (*cursor == ' ' || *cursor == '\t')
+      cursor++;
+    if (*cursor == ',') {
+      cursor++;
+      continue;
+    }
+    if (*cursor == '\0')
+      break;
+
+    off_t first, last;
+    if (*cursor == '-') {
+      cursor++;
+      off_t suffix = http_parse_offset(&cursor);
+      if (suffix < 0)
+        return -1;
+      first = suffix < size ? size - suffix : 0;
+      last = suffix > 0 ? size - 1 : -1;
+    } else {
+      first = http_parse_offset(&cursor);
+      if (first < 0 || *cursor++ != '-')
+        return -1;
+      last = size - 1;
+      if (*cursor >= '0' && *cursor <= '9') {
+        last = http_parse_offset(&cursor);
+        if (last < first)
+          return -1;
+        if (last > size - 1)
+          last = size - 1;
+      }
+    }
+
+    while (*cursor == ' ' || *cursor == '\t')
+      cursor++;
+    if (*cursor != ',' && *cursor != '\0')
+      return -1;
+    specs++;
+
+    if (first >= size || last < first)
+      continue;
+    if (count == max_ranges)
+      return -1;
+    ranges[count].offset = first;
+    ranges[count].length = last - first + 1;
+    total += ranges[count].length;
+    count++;
+  }
+
+  if (specs == 0 || total > size)
+    return -1;
+  return count;
+}
+
+/*
+ * Blocking wrapper around http_buffer_parse: reads from FD until the next
+ * request is available. With IDLE_MS >= 0, gives up if the client sends
+ * nothing for that long before the request begins. With HEAD_MS >= 0, gives
+ * up if the head of the request has not arrived HEAD_MS after its first byte,
+ * however the client spaces its bytes out. Returns 1 if a request was read,
+ * with *REQUEST pointing into BUFFER (or NULL if the request is malformed),
+ * or 0 on end of file, timeout (errno is ETIMEDOUT then) or error.
+ */
+int http_read_request(int fd, struct http_buffer *buffer, int idle_ms, int head_ms,
+    struct http_request **request) {
+  enum http_parse_status status;
+
+  errno = 0;
+  while ((status = http_buffer_parse(buffer)) == HTTP_PARSE_INCOMPLETE) {
+    int timeout_ms = idle_ms;
+    if (buffer->started > 0 && head_ms >= 0) {
+      long long left = buffer->started + head_ms * 1000000LL - http_now();
+      if (left <= 0) {
+        errno = ETIMEDOUT;
+        return 0;
+      }
+      timeout_ms = (left + 999999) / 1000000;
+    }
+
+    if (timeout_ms >= 0) {
+      struct pollfd pollfd = { .fd = fd, .events = POLLIN };
+      int ready = poll(&pollfd, 1, timeout_ms);
+      if (ready < 0 && errno == EINTR)
+        continue;
+      if (ready == 0)
+        errno = ETIMEDOUT;
+      if (ready <= 0)
+        return 0;
+    }
+
+    ssize_t bytes_read = http_buffer_fill(fd, buffer);
+    if (bytes_read < 0 && errno == EINTR)
+      continue;
+    if (bytes_read <= 0)
+      return 0;
+  }
+
+  *request = status == HTTP_PARSE_COMPLETE ? &buffer->request : NULL;
+  return 1;
+}
+
+char *http_get_response_message(int status_code) {
   switch (status_code) {
     case 100:
       return "Continue";
     case 200:
       return "OK";
+    case 206:
+      return "Partial Content";
     case 301:
       return "Moved Permanently";
     case 302:
@@ -89,22 +545,53 @@ char* http_get_response_message(int status_code) {
       return "Not Found";
     case 405:
       return "Method Not Allowed";
+    case 416:
+      return "Range Not Satisfiable";
+    case 502:
+      return "Bad Gateway";
+    case 504:
+      return "Gateway Timeout";
     default:
       return "Internal Server Error";
   }
 }
 
+void http_head_start(struct http_head *head, int status_code) {
+  head->length = snprintf(head->data, LIBHTTP_HEAD_MAX_SIZE, "HTTP/1.1 %d %s\r\n",
+      status_code, http_get_response_message(status_code));
+}
+
+/*
+ * Appends the header "KEY: VALUE" to HEAD. Headers that do not fit are
+ * dropped rather than truncated.
+ */
+void http_head_add(struct http_head *head, char *key, char *value) {
+  size_t space = LIBHTTP_HEAD_MAX_SIZE - head->length;
+  int length = snprintf(head->data + head->length, space, "%s: %s\r\n", key, value);
+  if (length > 0 && (size_t) length < space)
+    head->length += length;
+}
+
+void http_head_end(struct http_head *head) {
+  if (head->length + 2 <= LIBHTTP_HEAD_MAX_SIZE) {
+    memcpy(head->data + head->length, "\r\n", 2);
+    head->length += 2;
+  }
+}
+
+__thread struct http_head http_pending_head;
+
 void http_start_response(int fd, int status_code) {
-  dprintf(fd, "HTTP/1.0 %d %s\r\n", status_code,
-      http_get_response_message(status_code));
+  http_head_start(&http_pending_head, status_code);
 }
 
 void http_send_header(int fd, char *key, char *value) {
-  dprintf(fd, "%s: %s\r\n", key, value);
+  http_head_add(&http_pending_head, key, value);
 }
 
 void http_end_headers(int fd) {
-  dprintf(fd, "\r\n");
+  http_head_end(&http_pending_head);
+  http_send_data(fd, http_pending_head.data, http_pending_head.length);
 }
 
 void http_send_string(int fd, char *data) {
@@ -122,25 +609,300 @@ void http_send_data(int fd, char *data, size_t size) {
   }
 }
 
+/*
+ * Writes the COUNT buffers of IOV to FD with as few syscalls as possible,
+ * consuming IOV as it goes. With MORE, tells the kernel that more data (e.g.
+ * a sendfile() body) follows, so that a small head does not go out in a
+ * segment of its own. Returns the number of bytes written, which is short
+ * only if the socket would block or failed (see errno).
+ */
+size_t http_send_iov(int fd, struct iovec *iov, int count, int more) {
+  struct msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = iov;
+  message.msg_iovlen = count;
+
+  size_t total = 0;
+  while (message.msg_iovlen > 0) {
+    ssize_t bytes_sent = sendmsg(fd, &message, more ? MSG_MORE : 0);
+    if (bytes_sent < 0) {
+      if (errno == EINTR)
+        continue;
+      return total;
+    }
+    total += bytes_sent;
+
+    while (message.msg_iovlen > 0 && (size_t) bytes_sent >= message.msg_iov->iov_len) {
+      bytes_sent -= message.msg_iov->iov_len;
+      message.msg_iov++;
+      message.msg_iovlen--;
+    }
+    if (message.msg_iovlen > 0) {
+      message.msg_iov->iov_base = (char *) message.msg_iov->iov_base + bytes_sent;
+      message.msg_iov->iov_len -= bytes_sent;
+    }
+  }
+  return total;
+}
+
+/*
+ * Fallback for http_send_file: copies COUNT bytes of FILE_FD at *OFFSET to FD
+ * through a user-space buffer. Bytes that were read but could not be written
+ * are simply read again on the next call.
+ */
+int http_copy_file(int fd, int file_fd, off_t *offset, size_t count) {
+  char buffer[LIBHTTP_FILE_CHUNK_SIZE];
+
+  while (count > 0) {
+    size_t length = count < sizeof(buffer) ? count : sizeof(buffer);
+    ssize_t bytes_read = pread(file_fd, buffer, length, *offset);
+    if (bytes_read < 0 && errno == EINTR)
+      continue;
+    if (bytes_read <= 0) {
+      if (bytes_read == 0)
+        errno = ENODATA;
+      return -1;
+    }
+
+    char *data = buffer;
+    while (bytes_read > 0) {
+      ssize_t bytes_sent = write(fd, data, bytes_read);
+      if (bytes_sent < 0) {
+        if (errno == EINTR)
+          continue;
+        return -1;
+      }
+      data += bytes_sent;
+      bytes_read -= bytes_sent;
+      *offset += bytes_sent;
+      count -= bytes_sent;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Sends COUNT bytes of FILE_FD, starting at *OFFSET, to the socket FD without
+ * copying them through user space, and advances *OFFSET past the bytes sent.
+ * Falls back to http_copy_file when sendfile(2) does not support the file.
+ *
+ * Returns 0 once all COUNT bytes are sent. Returns -1 with errno set if an
+ * error occurred, if the file ended early (ENODATA) or, for a non-blocking
+ * socket, if it would block (EAGAIN); *OFFSET tells how far the send got.
+ */
+int http_send_file(int fd, int file_fd, off_t *offset, size_t count) {
+  while (count > 0) {
+    ssize_t bytes_sent = sendfile(fd, file_fd, offset, count);
+    if (bytes_sent > 0) {
+      count -= bytes_sent;
+    } else if (bytes_sent == 0) {
+      errno = ENODATA;
+      return -1;
+    } else if (errno == EINVAL || errno == ENOSYS) {
+      return http_copy_file(fd, file_fd, offset, count);
+    } else if (errno != EINTR) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void http_format_date(time_t time, char *date) {
+  static const char *days[] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+  static const char *months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+      "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+
+  /* strftime() spells day and month names in the locale's language. */
+  struct tm tm;
+  gmtime_r(&time, &tm);
+  strftime(date, LIBHTTP_DATE_SIZE, "Day, %d Mon %Y %H:%M:%S GMT", &tm);
+  memcpy(date, days[tm.tm_wday], 3);
+  memcpy(date + 8, months[tm.tm_mon], 3);
+}
+
+/*
+ * Parses an HTTP-date in any of the three formats of RFC 7231, section
+ * 7.1.1.1, into *TIME. Returns -1 if DATE is not a valid HTTP-date.
+ */
+int http_parse_date(char *date, time_t *time) {
+  static const char *formats[] = {
+    "%a, %d %b %Y %H:%M:%S GMT", // IMF-fixdate
+    "%A, %d-%b-%y %H:%M:%S GMT", // RFC 850
+    "%a %b %e %H:%M:%S %Y",      // asctime()
+  };
+
+  for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    char *end = strptime(date, formats[i], &tm);
+    if (end != NULL && *end == '\0') {
+      *time = timegm(&tm);
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/*
+ * Helper function: returns 1 if bodies of the content TYPE are worth
+ * compressing (text, and structured text formats).
+ */
+int http_type_compressible(char *type) {
+  return strncmp(type, "text/", 5) == 0 || strcmp(type, "application/javascript") == 0
+      || strcmp(type, "application/json") == 0 || strcmp(type, "application/xml") == 0
+      || strcmp(type, "image/svg+xml") == 0;
+}
+
+/*
+ * Helper function: compresses the LENGTH bytes at DATA into a new gzip
+ * buffer of *COMPRESSED_LENGTH bytes. Returns NULL on failure.
+ */
+char *http_gzip(char *data, size_t length, size_t *compressed_length) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  /* 15 window bits, +16 for a gzip rather than a zlib wrapper. */
+  if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+        Z_DEFAULT_STRATEGY) != Z_OK)
+    return NULL;
+
+  size_t capacity = deflateBound(&stream, length);
+  char *compressed = malloc(capacity);
+  stream.next_in = (Bytef *) data;
+  stream.avail_in = length;
+  stream.next_out = (Bytef *) compressed;
+  stream.avail_out = capacity;
+  int result = deflate(&stream, Z_FINISH);
+  *compressed_length = stream.total_out;
+  deflateEnd(&stream);
+
+  if (result != Z_STREAM_END) {
+    free(compressed);
+    return NULL;
+  }
+  return compressed;
+}
+
+/*
+ * Content types by file extension, in an open-addressing hash table that is
+ * filled with the built-in types on first use and with any mime.types file
+ * loaded at startup, and only read after that.
+ */
+struct http_mime_type {
+  char *extension;
+  char *type;
+};
+
+struct http_mime_type *http_mime_table;
+size_t http_mime_capacity;
+size_t http_mime_count;
+pthread_once_t http_mime_once = PTHREAD_ONCE_INIT;
+
+struct http_mime_type http_default_mime_types[] = {
+  {"html", "text/html"}, {"htm", "text/html"}, {"css", "text/css"},
+  {"txt", "text/plain"}, {"csv", "text/csv"}, {"xml", "application/xml"},
+  {"js", "application/javascript"}, {"mjs", "application/javascript"},
+  {"json", "application/json"}, {"pdf", "application/pdf"},
+  {"zip", "application/zip"}, {"gz", "application/gzip"},
+  {"tar", "application/x-tar"}, {"wasm", "application/wasm"},
+  {"jpg", "image/jpeg"}, {"jpeg", "image/jpeg"}, {"png", "image/png"},
+  {"gif", "image/gif"}, {"webp", "image/webp"}, {"svg", "image/svg+xml"},
+  {"ico", "image/x-icon"}, {"mp3", "audio/mpeg"}, {"ogg", "audio/ogg"},
+  {"mp4", "video/mp4"}, {"webm", "video/webm"}, {"woff", "font/woff"},
+  {"woff2", "font/woff2"}, {"ttf", "font/ttf"},
+};
+
+size_t http_mime_hash(char *extension, size_t length) {
+  size_t hash = 2166136261u;
+  for (size_t i = 0; i < length; i++)
+    hash = (hash ^ (unsigned char) tolower((unsigned char) extension[i])) * 16777619u;
+  return hash;
+}
+
+/* Returns the slot for EXTENSION (LENGTH bytes): its entry, or an empty one. */
+struct http_mime_type *http_mime_slot(char *extension, size_t length) {
+  size_t mask = http_mime_capacity - 1;
+  size_t index = http_mime_hash(extension, length) & mask;
+  while (http_mime_table[index].extension != NULL) {
+    struct http_mime_type *slot = &http_mime_table[index];
+    if (strncasecmp(slot->extension, extension, length) == 0
+        && slot->extension[length] == '\0')
+      return slot;
+    index = (index + 1) & mask;
+  }
+  return &http_mime_table[index];
+}
+
+/* Maps EXTENSION to TYPE (both static or never freed), replacing any mapping. */
+void http_mime_add(char *extension, char *type) {
+  if (2 * (http_mime_count + 1) > http_mime_capacity) {
+    struct http_mime_type *old_table = http_mime_table;
+    size_t old_capacity = http_mime_capacity;
+    http_mime_capacity = old_capacity ? 2 * old_capacity : 128;
+    http_mime_table = calloc(http_mime_capacity, sizeof(struct http_mime_type));
+    for (size_t i = 0; i < old_capacity; i++) {
+      if (old_table[i].extension != NULL) {
+        char *extension = old_table[i].extension;
+        *http_mime_slot(extension, strlen(extension)) = old_table[i];
+      }
+    }
+    free(old_table);
+  }
+
+  struct http_mime_type *slot = http_mime_slot(extension, strlen(extension));
+  if (slot->extension == NULL)
+    http_mime_count++;
+  slot->extension = extension;
+  slot->type = type;
+}
+
+void http_mime_init() {
+  size_t count = sizeof(http_default_mime_types) / sizeof(http_default_mime_types[0]);
+  for (size_t i = 0; i < count; i++)
+    http_mime_add(http_default_mime_types[i].extension, http_default_mime_types[i].type);
+}
+
+/*
+ * Adds the types listed in the mime.types file at PATH ("type ext1 ext2 ...",
+ * one type per line, # starts a comment) on top of the built-in ones. Must
+ * be called before any other thread uses http_get_mime_type. Returns -1 if
+ * the file cannot be read.
+ */
+int http_load_mime_types(char *path) {
+  pthread_once(&http_mime_once, http_mime_init);
+
+  FILE *file = fopen(path, "r");
+  if (file == NULL)
+    return -1;
+
+  char line[1024];
+  while (fgets(line, sizeof(line), file) != NULL) {
+    char *comment = strchr(line, '#');
+    if (comment != NULL)
+      *comment = '\0';
+
+    char *saveptr;
+    char *type = strtok_r(line, " \t\r\n", &saveptr);
+    if (type == NULL)
+      continue;
+    type = strdup(type);
+    char *extension;
+    while ((extension = strtok_r(NULL, " \t\r\n", &saveptr)) != NULL)
+      http_mime_add(strdup(extension), type);
+  }
+
+  fclose(file);
+  return 0;
+}
+
 char *http_get_mime_type(char *file_name) {
+  pthread_once(&http_mime_once, http_mime_init);
+
   char *file_extension = strrchr(file_name, '.');
-  if (file_extension == NULL) {
+  if (file_extension == NULL || file_extension[1] == '\0') {
     return "text/plain";
   }
 
-  if (strcmp(file_extension, ".html") == 0 || strcmp(file_extension, ".htm") == 0) {
-    return "text/html";
-  } else if (strcmp(file_extension, ".jpg") == 0 || strcmp(file_extension, ".jpeg") == 0) {
-    return "image/jpeg";
-  } else if (strcmp(file_extension, ".png") == 0) {
-    return "image/png";
-  } else if (strcmp(file_extension, ".css") == 0) {
-    return "text/css";
-  } else if (strcmp(file_extension, ".js") == 0) {
-    return "application/javascript";
-  } else if (strcmp(file_extension, ".pdf") == 0) {
-    return "application/pdf";
-  } else {
-    return "text/plain";
-  }
+  file_extension++;
+  struct http_mime_type *slot = http_mime_slot(file_extension, strlen(file_extension));
+  return slot->extension != NULL ? slot->type : "text/plain";
 }
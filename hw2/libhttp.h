@@ -3,10 +3,14 @@
  *
  * Usage example:
  *
- *     // Returns NULL if an error was encountered.
- *     struct http_request *request = http_request_parse(fd);
+ *     struct http_buffer buffer;
+ *     struct http_request *request;
+ *     http_buffer_init(&buffer);
  *
- *     ...
+ *     // Returns 0 at end of file; request is NULL if it was malformed.
+ *     if (http_read_request(fd, &buffer, -1, -1, &request)) {
+ *       ...
+ *     }
  *
  *     http_start_response(fd, 200);
  *     http_send_header(fd, "Content-type", http_get_mime_type("index.html"));
@@ -15,33 +19,163 @@
  *     http_send_string(fd, "<html><body><a href='/'>Home</a></body></html>");
  *
  *     close(fd);
+ *
+ * Callers that read the request themselves (e.g. from a non-blocking socket)
+ * can use http_buffer_fill() and http_buffer_parse() instead.
  */
 
 #ifndef LIBHTTP_H
 #define LIBHTTP_H
 
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#define LIBHTTP_REQUEST_MAX_SIZE 8192
+#define LIBHTTP_FILE_CHUNK_SIZE 16384
+
 /*
  * Functions for parsing an HTTP request.
+ *
+ * Requests are parsed incrementally from a per-connection struct http_buffer
+ * without allocating: the method and path are null-terminated in place, and
+ * headers are (offset, length) slices relative to the start of the request.
  */
+#define LIBHTTP_MAX_HEADERS 32
+
+struct http_slice {
+  unsigned short offset;
+  unsigned short length;
+};
+
+struct http_header {
+  struct http_slice name;
+  struct http_slice value;
+};
+
 struct http_request {
   char *method;
   char *path;
+  int version;           // Minor version: 1 for HTTP/1.1, 0 otherwise.
+  int keep_alive;        // The client wants the connection kept open.
+  size_t content_length; // Length of the request body, if any.
+  int has_content_length;
+  int chunked;           // Sent Transfer-Encoding; libhttp does not frame its body.
+  char *base;            // Start of the request; header slices are relative to it.
+  int num_headers;
+  struct http_header headers[LIBHTTP_MAX_HEADERS];
 };
 
-struct http_request *http_request_parse(int fd);
+enum http_parse_status {
+  HTTP_PARSE_INCOMPLETE,
+  HTTP_PARSE_COMPLETE,
+  HTTP_PARSE_MALFORMED,
+};
+
+enum http_parse_state {
+  HTTP_STATE_REQUEST_LINE,
+  HTTP_STATE_HEADERS,
+  HTTP_STATE_DONE,
+  HTTP_STATE_ERROR,
+};
 
 /*
- * Functions for sending an HTTP response.
+ * Bytes read from a persistent connection that have not been consumed yet,
+ * together with the state of the parser working through them. Pipelined
+ * requests that arrive in the same read stay buffered for the next call, and
+ * the body of a consumed request is skipped.
  */
+struct http_buffer {
+  char data[LIBHTTP_REQUEST_MAX_SIZE];
+  size_t start;    // Offset of the request being parsed.
+  size_t length;   // Bytes in data.
+  size_t consumed; // Length of the request returned last, including its body.
+  size_t discard;  // Body bytes of that request that have not arrived yet.
+
+  enum http_parse_state state;
+  size_t line_start; // Offsets from start: the line being parsed, and where
+  size_t scan;       // to resume looking for its end.
+  size_t method_offset;
+  size_t path_offset;
+  struct http_request request;
+
+  /* When parsing of the current request began (CLOCK_MONOTONIC, in
+   * nanoseconds), or 0 before any of it has arrived. */
+  long long started;
+};
+
+void http_buffer_init(struct http_buffer *buffer);
+void http_buffer_consume(struct http_buffer *buffer);
+ssize_t http_buffer_fill(int fd, struct http_buffer *buffer);
+enum http_parse_status http_buffer_parse(struct http_buffer *buffer);
+int http_read_request(int fd, struct http_buffer *buffer, int idle_ms, int head_ms,
+    struct http_request **request);
+char *http_request_header(struct http_request *request, char *name, size_t *length);
+int http_header_has_token(char *value, char *token);
+char *http_request_line_path(char *data, size_t length, size_t *path_length);
+
+/*
+ * A byte range of a representation, as requested with a Range header.
+ */
+#define LIBHTTP_MAX_RANGES 16
+
+struct http_range {
+  off_t offset;
+  off_t length;
+};
+
+int http_parse_range(char *value, off_t size, struct http_range *ranges,
+    int max_ranges);
+int http_etag_matches(char *value, char *etag);
+int http_accepts_encoding(char *value, char *coding);
+
+/*
+ * Functions for building the status line and headers of a response in
+ * memory, so that they can go out together with the body in one syscall.
+ */
+#define LIBHTTP_HEAD_MAX_SIZE 1024
+
+struct http_head {
+  char data[LIBHTTP_HEAD_MAX_SIZE];
+  size_t length;
+};
+
+void http_head_start(struct http_head *head, int status_code);
+void http_head_add(struct http_head *head, char *key, char *value);
+void http_head_end(struct http_head *head);
+
+/*
+ * Functions for sending an HTTP response. http_start_response() and
+ * http_send_header() build the head in a per-thread http_head, which
+ * http_end_headers() writes out in one go.
+ */
+char *http_get_response_message(int status_code);
 void http_start_response(int fd, int status_code);
 void http_send_header(int fd, char *key, char *value);
 void http_end_headers(int fd);
 void http_send_string(int fd, char *data);
 void http_send_data(int fd, char *data, size_t size);
+size_t http_send_iov(int fd, struct iovec *iov, int count, int more);
+int http_send_file(int fd, int file_fd, off_t *offset, size_t count);
 
 /*
- * Helper function: gets the Content-Type based on a file name.
+ * Helper functions: gets the Content-Type based on a file name (from built-in
+ * types and an optional mime.types file), tells whether that type is worth
+ * compressing, and gzips a buffer.
  */
+int http_load_mime_types(char *path);
 char *http_get_mime_type(char *file_name);
+int http_type_compressible(char *type);
+char *http_gzip(char *data, size_t length, size_t *compressed_length);
+
+/*
+ * Helper functions: formats TIME as an HTTP-date (RFC 7231, section 7.1.1.1)
+ * into DATE, which must hold at least LIBHTTP_DATE_SIZE bytes, and parses one.
+ */
+#define LIBHTTP_DATE_SIZE 30
+
+void http_format_date(time_t time, char *date);
+int http_parse_date(char *date, time_t *time);
 
 #endif
@@ -0,0 +1,318 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "alog.h"
+#include "httpserver.h"
+#include "metrics.h"
+
+#define METRICS_SUB_BITS 4
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BITS)
+#define METRICS_MAX_BITS 40 // Larger values are counted as 2^40 - 1.
+#define METRICS_BUCKETS ((METRICS_MAX_BITS - METRICS_SUB_BITS + 1) * METRICS_SUB_BUCKETS)
+#define METRICS_MAX_STATUS 600
+
+typedef struct metrics_histogram {
+  uint64_t counts[METRICS_BUCKETS];
+  uint64_t sum;
+} metrics_histogram_t;
+
+/* The counters of one thread. Blocks are never freed: a thread that exits
+ * leaves its block to the next thread that starts, so totals never drop. */
+typedef struct metrics_block {
+  uint64_t connections;
+  uint64_t responses[METRICS_MAX_STATUS];
+  uint64_t bytes_sent;
+  uint64_t shed[METRICS_SHED_REASONS];
+  uint64_t timeouts[METRICS_TIMEOUTS];
+  metrics_histogram_t parse;       // Nanoseconds.
+  metrics_histogram_t queue_wait;  // Nanoseconds.
+  metrics_histogram_t first_byte;  // Nanoseconds.
+  metrics_histogram_t response_size;
+  metrics_histogram_t queue_depth;
+
+  int in_use;
+  struct metrics_block *next;
+} metrics_block_t;
+
+metrics_block_t *metrics_blocks;
+__thread metrics_block_t *metrics_local;
+pthread_key_t metrics_key;
+pthread_once_t metrics_key_once = PTHREAD_ONCE_INIT;
+
+
+/* Returns the time on the monotonic clock, in nanoseconds. */
+long long metrics_now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+
+void metrics_thread_exit(void *block) {
+  __atomic_store_n(&((metrics_block_t *) block)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+
+void metrics_key_init() {
+  pthread_key_create(&metrics_key, metrics_thread_exit);
+}
+
+
+/* Returns the calling thread's block, adopting or adding one the first time. */
+metrics_block_t *metrics_block() {
+  if (metrics_local != NULL)
+    return metrics_local;
+  pthread_once(&metrics_key_once, metrics_key_init);
+
+  metrics_block_t *block = __atomic_load_n(&metrics_blocks, __ATOMIC_ACQUIRE);
+  for (; block != NULL; block = block->next) {
+    int free = 0;
+    if (__atomic_compare_exchange_n(&block->in_use, &free, 1, 0,
+          __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      break;
+  }
+  if (block == NULL) {
+    block = calloc(1, sizeof(metrics_block_t));
+    block->in_use = 1;
+    block->next = __atomic_load_n(&metrics_blocks, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&metrics_blocks, &block->next, block, 1,
+          __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      ;
+  }
+  pthread_setspecific(metrics_key, block);
+  metrics_local = block;
+  return block;
+}
+
+
+/* Adds N to COUNTER, which only the calling thread writes. */
+void metrics_add(uint64_t *counter, uint64_t n) {
+  __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+
+/* Returns the bucket holding VALUE: values below 16 get a bucket each, and
+ * every power of two above is split into 16 equal buckets. */
+int metrics_index(uint64_t value) {
+  if (value >= 1ULL << METRICS_MAX_BITS)
+    value = (1ULL << METRICS_MAX_BITS) - 1;
+  if (value < METRICS_SUB_BUCKETS)
+    return value;
+  int shift = 63 - __builtin_clzll(value) - METRICS_SUB_BITS;
+  return (shift + 1) * METRICS_SUB_BUCKETS + (value >> shift) - METRICS_SUB_BUCKETS;
+}
+
+
+/* Returns the smallest value above bucket INDEX. */
+uint64_t metrics_bucket_end(int index) {
+  if (index < METRICS_SUB_BUCKETS)
+    return index + 1;
+  int shift = index / METRICS_SUB_BUCKETS - 1;
+  return (uint64_t) (index % METRICS_SUB_BUCKETS + METRICS_SUB_BUCKETS + 1) << shift;
+}
+
+
+void metrics_record(metrics_histogram_t *histogram, long long value) {
+  if (value < 0)
+    value = 0;
+  metrics_add(&histogram->counts[metrics_index(value)], 1);
+  metrics_add(&histogram->sum, value);
+}
+
+
+void metrics_connection() {
+  metrics_add(&metrics_block()->connections, 1);
+}
+
+
+/* A request head that began to arrive at STARTED has been parsed. */
+void metrics_parsed(long long started) {
+  if (started > 0)
+    metrics_record(&metrics_block()->parse, metrics_now() - started);
+}
+
+
+/* A connection was taken off work_queue after WAITED nanoseconds. */
+void metrics_queue_wait(long long waited) {
+  metrics_record(&metrics_block()->queue_wait, waited);
+}
+
+
+/* A connection was put on work_queue, which now holds DEPTH of them. */
+void metrics_queue_depth(int depth) {
+  metrics_record(&metrics_block()->queue_depth, depth);
+}
+
+
+/* The first byte of the response to a request that began at STARTED went out. */
+void metrics_first_byte(long long started) {
+  if (started > 0)
+    metrics_record(&metrics_block()->first_byte, metrics_now() - started);
+}
+
+
+/* A response with STATUS and BYTES bytes in all has been sent. */
+void metrics_response(int status, size_t bytes) {
+  metrics_block_t *block = metrics_block();
+  if (status >= 0 && status < METRICS_MAX_STATUS)
+    metrics_add(&block->responses[status], 1);
+  metrics_add(&block->bytes_sent, bytes);
+  metrics_record(&block->response_size, bytes);
+}
+
+
+/* A connection was turned away for REASON. */
+void metrics_shed(enum metrics_shed_reason reason) {
+  metrics_add(&metrics_block()->shed[reason], 1);
+}
+
+
+/* A connection was closed when TIMEOUT ran out. */
+void metrics_timeout(enum metrics_timeout timeout) {
+  metrics_add(&metrics_block()->timeouts[timeout], 1);
+}
+
+
+/* Adds the N counters at FROM, which other threads may be writing, to TO. */
+void metrics_sum(uint64_t *to, uint64_t *from, size_t n) {
+  for (size_t i = 0; i < n; i++)
+    to[i] += __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+}
+
+
+uint64_t metrics_total(metrics_histogram_t *histogram) {
+  uint64_t total = 0;
+  for (int i = 0; i < METRICS_BUCKETS; i++)
+    total += histogram->counts[i];
+  return total;
+}
+
+
+/*
+ * Prints HISTOGRAM as the Prometheus histogram NAME, with buckets at the
+ * powers of two from 2^FIRST_BIT to 2^LAST_BIT (every STEP), which are
+ * bucket boundaries of the HDR histogram too. Values are multiplied by SCALE,
+ * e.g. to turn nanoseconds into seconds.
+ */
+void metrics_print_histogram(FILE *out, char *name, char *help, metrics_histogram_t *histogram,
+    double scale, int first_bit, int last_bit, int step) {
+  fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+  uint64_t cumulative = 0;
+  int index = 0;
+  for (int bit = first_bit; bit <= last_bit; bit += step) {
+    for (int end = metrics_index(1ULL << bit); index < end; index++)
+      cumulative += histogram->counts[index];
+    fprintf(out, "%s_bucket{le=\"%.9g\"} %llu\n", name, (double) (1ULL << bit) * scale,
+        (unsigned long long) cumulative);
+  }
+  uint64_t total = metrics_total(histogram);
+  fprintf(out, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long) total);
+  fprintf(out, "%s_sum %.9g\n", name, histogram->sum * scale);
+  fprintf(out, "%s_count %llu\n", name, (unsigned long long) total);
+}
+
+
+/*
+ * Prints the 50th, 90th, 99th and 99.9th percentiles of HISTOGRAM, as the
+ * upper ends of the buckets they fall in, labelled STAGE.
+ */
+void metrics_print_quantiles(FILE *out, char *stage, metrics_histogram_t *histogram) {
+  double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+  uint64_t total = metrics_total(histogram);
+  if (total == 0)
+    return;
+  for (int i = 0; i < 4; i++) {
+    uint64_t rank = quantiles[i] * total, cumulative = 0;
+    int index = 0;
+    while (index < METRICS_BUCKETS - 1
+        && (cumulative += histogram->counts[index]) <= rank)
+      index++;
+    fprintf(out, "httpserver_latency_quantile_seconds{stage=\"%s\",quantile=\"%g\"} %.9g\n",
+        stage, quantiles[i], metrics_bucket_end(index) * 1e-9);
+  }
+}
+
+
+/*
+ * Renders all metrics, added up over the threads, in the Prometheus text
+ * exposition format. Returns a malloc()ed buffer of *LENGTH bytes.
+ */
+char *metrics_render(size_t *length) {
+  metrics_block_t *total = calloc(1, sizeof(metrics_block_t));
+  metrics_block_t *block = __atomic_load_n(&metrics_blocks, __ATOMIC_ACQUIRE);
+  for (; block != NULL; block = block->next)
+    metrics_sum((uint64_t *) total, (uint64_t *) block,
+        offsetof(metrics_block_t, in_use) / sizeof(uint64_t));
+
+  char *data = NULL;
+  FILE *out = open_memstream(&data, length);
+
+  fprintf(out, "# HELP httpserver_connections_total Client connections accepted.\n"
+      "# TYPE httpserver_connections_total counter\n"
+      "httpserver_connections_total %llu\n", (unsigned long long) total->connections);
+  fprintf(out, "# HELP httpserver_responses_total Responses sent, by status code.\n"
+      "# TYPE httpserver_responses_total counter\n");
+  for (int status = 0; status < METRICS_MAX_STATUS; status++)
+    if (total->responses[status] > 0)
+      fprintf(out, "httpserver_responses_total{code=\"%d\"} %llu\n", status,
+          (unsigned long long) total->responses[status]);
+  fprintf(out, "# HELP httpserver_sent_bytes_total Bytes of responses sent.\n"
+      "# TYPE httpserver_sent_bytes_total counter\n"
+      "httpserver_sent_bytes_total %llu\n", (unsigned long long) total->bytes_sent);
+  char *shed_reasons[] = {"high_water", "deadline", "codel", "per_ip"};
+  fprintf(out, "# HELP httpserver_shed_connections_total Connections turned away unserved.\n"
+      "# TYPE httpserver_shed_connections_total counter\n");
+  for (int reason = 0; reason < METRICS_SHED_REASONS; reason++)
+    fprintf(out, "httpserver_shed_connections_total{reason=\"%s\"} %llu\n",
+        shed_reasons[reason], (unsigned long long) total->shed[reason]);
+  char *timeouts[] = {"header", "body", "idle", "connect"};
+  fprintf(out, "# HELP httpserver_timeouts_total Connections closed (or upstream connects given up on) for taking too long, by phase.\n"
+      "# TYPE httpserver_timeouts_total counter\n");
+  for (int timeout = 0; timeout < METRICS_TIMEOUTS; timeout++)
+    fprintf(out, "httpserver_timeouts_total{phase=\"%s\"} %llu\n",
+        timeouts[timeout], (unsigned long long) total->timeouts[timeout]);
+  fprintf(out, "# HELP httpserver_access_log_dropped_total Access log lines dropped because a thread's ring was full.\n"
+      "# TYPE httpserver_access_log_dropped_total counter\n"
+      "httpserver_access_log_dropped_total %llu\n", (unsigned long long) alog_dropped());
+  fprintf(out, "# HELP httpserver_work_queue_depth Connections waiting in the work queue.\n"
+      "# TYPE httpserver_work_queue_depth gauge\n"
+      "httpserver_work_queue_depth %d\n", __atomic_load_n(&work_queue.size, __ATOMIC_RELAXED));
+  fprintf(out, "# HELP httpserver_pool_threads Pool threads serving the work queue.\n"
+      "# TYPE httpserver_pool_threads gauge\n"
+      "httpserver_pool_threads %d\n", __atomic_load_n(&worker_pool.threads, __ATOMIC_RELAXED));
+  fprintf(out, "# HELP httpserver_pool_idle_threads Pool threads waiting for a connection.\n"
+      "# TYPE httpserver_pool_idle_threads gauge\n"
+      "httpserver_pool_idle_threads %d\n", __atomic_load_n(&worker_pool.idle, __ATOMIC_RELAXED));
+
+  metrics_print_histogram(out, "httpserver_request_parse_seconds",
+      "Time from the first byte of a request to its parsed head.",
+      &total->parse, 1e-9, 10, 36, 1);
+  metrics_print_histogram(out, "httpserver_queue_wait_seconds",
+      "Time connections spent in the work queue before a thread took them.",
+      &total->queue_wait, 1e-9, 10, 36, 1);
+  metrics_print_histogram(out, "httpserver_time_to_first_byte_seconds",
+      "Time from the first byte of a request to the first byte of its response.",
+      &total->first_byte, 1e-9, 10, 36, 1);
+  metrics_print_histogram(out, "httpserver_response_size_bytes",
+      "Bytes sent per response, head included.",
+      &total->response_size, 1, 6, 30, 2);
+  metrics_print_histogram(out, "httpserver_work_queue_enqueue_depth",
+      "Connections in the work queue right after each was queued.",
+      &total->queue_depth, 1, 0, 12, 1);
+
+  fprintf(out, "# HELP httpserver_latency_quantile_seconds Latency percentiles since start.\n"
+      "# TYPE httpserver_latency_quantile_seconds gauge\n");
+  metrics_print_quantiles(out, "parse", &total->parse);
+  metrics_print_quantiles(out, "queue_wait", &total->queue_wait);
+  metrics_print_quantiles(out, "first_byte", &total->first_byte);
+
+  fclose(out);
+  free(total);
+  return data;
+}
@@ -0,0 +1,47 @@
+#ifndef __METRICS__
+#define __METRICS__
+
+#include <stddef.h>
+
+/* METRICS counts what the server does and how long it takes, and renders it
+ * on METRICS_PATH in the Prometheus text format.
+ *
+ * Every thread records into its own block of counters, which only that
+ * thread writes, so recording takes no lock and no atomic read-modify-write;
+ * a scrape adds the blocks up. Latencies and sizes go into HDR-style
+ * histograms: log-linear buckets with 16 sub-buckets per power of two, so
+ * any value is known to within about 6% across the whole range, and
+ * quantiles can be read off them as well as Prometheus buckets. */
+
+#define METRICS_PATH "/__metrics"
+
+/* Why a connection was turned away without being served. */
+enum metrics_shed_reason {
+  METRICS_SHED_HIGH_WATER, // The work queue was at its high-water mark.
+  METRICS_SHED_DEADLINE,   // It waited in the work queue past the deadline.
+  METRICS_SHED_CODEL,      // CoDel dropped it.
+  METRICS_SHED_PER_IP,     // Its address had --max-conns-per-ip open already.
+  METRICS_SHED_REASONS,
+};
+
+/* Why a connection was closed for taking too long. */
+enum metrics_timeout {
+  METRICS_TIMEOUT_HEADER, // The request head did not arrive in time.
+  METRICS_TIMEOUT_BODY,   // A request or response body stalled.
+  METRICS_TIMEOUT_IDLE,   // No next request within the keep-alive timeout.
+  METRICS_TIMEOUT_CONNECT, // An upstream connect was given up on.
+  METRICS_TIMEOUTS,
+};
+
+long long metrics_now();
+void metrics_connection();
+void metrics_parsed(long long started);
+void metrics_queue_wait(long long waited);
+void metrics_queue_depth(int depth);
+void metrics_first_byte(long long started);
+void metrics_response(int status, size_t bytes);
+void metrics_shed(enum metrics_shed_reason reason);
+void metrics_timeout(enum metrics_timeout timeout);
+char *metrics_render(size_t *length);
+
+#endif
@@ -0,0 +1,600 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "libhttp.h"
+#include "pcache.h"
+
+#define PCACHE_BUCKETS 4096
+
+/* A response being fetched (or read back from disk), and the requests
+ * waiting for it. */
+struct pcache_fill {
+  char *key;
+  int *waiters; // Eventfds to signal once the fill is over.
+  int num_waiters;
+  struct pcache_fill *next;
+  pcache_entry_t *spilled;     // The entry to read back, for a load.
+  struct pcache_fill *io_next; // In the spill thread's queue of loads.
+};
+
+pthread_mutex_t pcache_mutex = PTHREAD_MUTEX_INITIALIZER;
+pcache_entry_t *pcache_table[PCACHE_BUCKETS];
+pcache_fill_t *pcache_fills[PCACHE_BUCKETS];
+size_t pcache_capacity;
+size_t pcache_size;
+char *pcache_spill_dir;
+size_t pcache_spill_capacity;
+size_t pcache_spill_size;
+unsigned long pcache_spill_serial;
+
+/* Entries in memory and on disk, each most recently used first. */
+pcache_entry_t *pcache_memory_head;
+pcache_entry_t *pcache_memory_tail;
+pcache_entry_t *pcache_disk_head;
+pcache_entry_t *pcache_disk_tail;
+
+/* Entries no longer referenced, chained by hash_next, to be freed by
+ * pcache_unlock once pcache_mutex is released. */
+pcache_entry_t *pcache_dead;
+
+/* Work for the spill thread, which does all the file I/O, also guarded by
+ * pcache_mutex: entries to write out (chained by lru_next, oldest first),
+ * loads to read entries back, and dead spilled entries whose files are to be
+ * removed (chained by hash_next). */
+pthread_cond_t pcache_io_wanted = PTHREAD_COND_INITIALIZER;
+pcache_entry_t *pcache_to_spill;
+pcache_entry_t **pcache_to_spill_tail = &pcache_to_spill;
+pcache_fill_t *pcache_to_load;
+pcache_fill_t **pcache_to_load_tail = &pcache_to_load;
+pcache_entry_t *pcache_to_delete;
+
+void *pcache_io(void *args);
+
+/*
+ * Initializes the cache to hold up to CAPACITY bytes in memory, and up to
+ * SPILL_CAPACITY more in files in SPILL_DIR if it is not NULL. A CAPACITY of
+ * 0 disables it.
+ */
+void pcache_init(size_t capacity, char *spill_dir, size_t spill_capacity) {
+  pcache_capacity = capacity;
+  pcache_spill_dir = spill_dir;
+  pcache_spill_capacity = spill_capacity;
+  if (capacity > 0 && spill_dir != NULL) {
+    pthread_t thread;
+    pthread_create(&thread, NULL, pcache_io, NULL);
+    pthread_detach(thread);
+  }
+}
+
+int pcache_enabled() {
+  return pcache_capacity > 0;
+}
+
+uint32_t pcache_hash(char *key) {
+  uint32_t hash = 2166136261u;
+  for (; *key != '\0'; key++)
+    hash = (hash ^ (unsigned char) *key) * 16777619u;
+  return hash;
+}
+
+size_t pcache_entry_size(pcache_entry_t *entry) {
+  if (entry->spill_path != NULL)
+    return entry->head_length + entry->body_length;
+  return sizeof(pcache_entry_t) + strlen(entry->key) + entry->head_length
+      + entry->body_length;
+}
+
+void pcache_free(pcache_entry_t *entry) {
+  if (entry->spill_path != NULL)
+    unlink(entry->spill_path);
+  free(entry->spill_path);
+  free(entry->key);
+  free(entry->head);
+  free(entry->body);
+  free(entry);
+}
+
+/* Drops a reference to ENTRY. Must be called with pcache_mutex held. */
+void pcache_unref(pcache_entry_t *entry) {
+  if (--entry->refcount > 0)
+    return;
+  entry->hash_next = pcache_dead;
+  pcache_dead = entry;
+}
+
+/*
+ * Releases pcache_mutex, then frees the entries that died while it was held.
+ * Spilled ones go to the spill thread instead, which removes their files.
+ */
+void pcache_unlock() {
+  pcache_entry_t *dead = NULL;
+  while (pcache_dead != NULL) {
+    pcache_entry_t *entry = pcache_dead;
+    pcache_dead = entry->hash_next;
+    pcache_entry_t **list = entry->spill_path != NULL ? &pcache_to_delete : &dead;
+    entry->hash_next = *list;
+    *list = entry;
+  }
+  if (pcache_to_delete != NULL)
+    pthread_cond_signal(&pcache_io_wanted);
+  pthread_mutex_unlock(&pcache_mutex);
+  while (dead != NULL) {
+    pcache_entry_t *next = dead->hash_next;
+    pcache_free(dead);
+    dead = next;
+  }
+}
+
+/* Returns the LRU list of ENTRY: in memory or on disk. */
+pcache_entry_t **pcache_list(pcache_entry_t *entry, pcache_entry_t ***tail) {
+  *tail = entry->spill_path ? &pcache_disk_tail : &pcache_memory_tail;
+  return entry->spill_path ? &pcache_disk_head : &pcache_memory_head;
+}
+
+void pcache_lru_unlink(pcache_entry_t *entry) {
+  pcache_entry_t **tail, **head = pcache_list(entry, &tail);
+  if (entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+  else *head = entry->lru_next;
+  if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+  else *tail = entry->lru_prev;
+  entry->lru_prev = entry->lru_next = NULL;
+}
+
+void pcache_lru_push(pcache_entry_t *entry) {
+  pcache_entry_t **tail, **head = pcache_list(entry, &tail);
+  entry->lru_next = *head;
+  if (*head) (*head)->lru_prev = entry;
+  else *tail = entry;
+  *head = entry;
+}
+
+/* Puts ENTRY in the cache. Must be called with pcache_mutex held. */
+void pcache_link(pcache_entry_t *entry) {
+  pcache_entry_t **bucket = &pcache_table[pcache_hash(entry->key) % PCACHE_BUCKETS];
+  entry->hash_next = *bucket;
+  *bucket = entry;
+  pcache_lru_push(entry);
+  if (entry->spill_path != NULL)
+    pcache_spill_size += pcache_entry_size(entry);
+  else
+    pcache_size += pcache_entry_size(entry);
+}
+
+/* Takes ENTRY out of the cache. Must be called with pcache_mutex held. */
+void pcache_remove(pcache_entry_t *entry) {
+  pcache_entry_t **link = &pcache_table[pcache_hash(entry->key) % PCACHE_BUCKETS];
+  while (*link != entry)
+    link = &(*link)->hash_next;
+  *link = entry->hash_next;
+
+  if (entry->spilling) {
+    entry->spilling = 0; // pcache_shrink already took it off the lists.
+  } else {
+    pcache_lru_unlink(entry);
+    if (entry->spill_path != NULL)
+      pcache_spill_size -= pcache_entry_size(entry);
+    else
+      pcache_size -= pcache_entry_size(entry);
+  }
+  entry->cached = 0;
+  pcache_unref(entry);
+}
+
+pcache_entry_t *pcache_new_entry(pcache_entry_t *from) {
+  pcache_entry_t *entry = calloc(1, sizeof(pcache_entry_t));
+  entry->key = strdup(from->key);
+  entry->stored_at = from->stored_at;
+  entry->expires = from->expires;
+  entry->head_length = from->head_length;
+  entry->body_length = from->body_length;
+  entry->refcount = 1;
+  entry->cached = 1;
+  return entry;
+}
+
+int pcache_write_all(int fd, char *data, size_t length) {
+  while (length > 0) {
+    ssize_t written = write(fd, data, length);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written <= 0)
+      return -1;
+    data += written;
+    length -= written;
+  }
+  return 0;
+}
+
+int pcache_read_all(int fd, char *data, size_t length, off_t offset) {
+  while (length > 0) {
+    ssize_t bytes_read = pread(fd, data, length, offset);
+    if (bytes_read < 0 && errno == EINTR)
+      continue;
+    if (bytes_read <= 0)
+      return -1;
+    data += bytes_read;
+    length -= bytes_read;
+    offset += bytes_read;
+  }
+  return 0;
+}
+
+/*
+ * Writes the in-memory ENTRY to a new file in the spill directory. Returns
+ * its path (malloc()ed), or NULL if it cannot be written.
+ */
+char *pcache_write_file(pcache_entry_t *entry) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%08x-%lu", pcache_spill_dir, pcache_hash(entry->key),
+      __atomic_fetch_add(&pcache_spill_serial, 1, __ATOMIC_RELAXED));
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0)
+    return NULL;
+  int result = pcache_write_all(fd, entry->head, entry->head_length);
+  if (result == 0)
+    result = pcache_write_all(fd, entry->body, entry->body_length);
+  close(fd);
+  if (result != 0) {
+    unlink(path);
+    return NULL;
+  }
+  return strdup(path);
+}
+
+/*
+ * Makes room in memory after KEEP has been added, by taking out the least
+ * recently used entries until the rest fit. Without a spill directory they
+ * are dropped. Otherwise they stay cached (and are served from memory) but
+ * are marked as spilling, and are queued, with a reference held, for the
+ * spill thread to write out. Must be called with pcache_mutex held.
+ */
+void pcache_shrink(pcache_entry_t *keep) {
+  while (pcache_size > pcache_capacity && pcache_memory_tail != keep) {
+    pcache_entry_t *entry = pcache_memory_tail;
+    if (pcache_spill_dir == NULL) {
+      pcache_remove(entry);
+      continue;
+    }
+    pcache_lru_unlink(entry);
+    pcache_size -= pcache_entry_size(entry);
+    entry->spilling = 1;
+    entry->refcount++;
+    *pcache_to_spill_tail = entry;
+    pcache_to_spill_tail = &entry->lru_next;
+    pthread_cond_signal(&pcache_io_wanted);
+  }
+}
+
+/*
+ * Moves the VICTIMS of pcache_shrink, chained by lru_next, to the spill
+ * directory: writes each to a file, then replaces it with its spilled copy
+ * if it is still cached, or drops it if it could not be written. Then drops
+ * the least recently used entries on disk until they fit. Runs on the spill
+ * thread, without pcache_mutex held.
+ */
+void pcache_spill(pcache_entry_t *victims) {
+  if (victims == NULL)
+    return;
+  int num_victims = 0;
+  for (pcache_entry_t *entry = victims; entry != NULL; entry = entry->lru_next)
+    num_victims++;
+  char **paths = calloc(num_victims, sizeof(char *));
+  int i = 0;
+  for (pcache_entry_t *entry = victims; entry != NULL; entry = entry->lru_next)
+    paths[i++] = pcache_write_file(entry);
+
+  pthread_mutex_lock(&pcache_mutex);
+  i = 0;
+  for (pcache_entry_t *entry = victims, *next; entry != NULL; entry = next, i++) {
+    next = entry->lru_next;
+    entry->lru_next = NULL;
+    if (!entry->cached) {
+      pcache_unref(entry); // Replaced or expired meanwhile.
+      continue;
+    }
+    pcache_entry_t *spilled = NULL;
+    if (paths[i] != NULL) {
+      spilled = pcache_new_entry(entry);
+      spilled->spill_path = paths[i];
+      paths[i] = NULL;
+    }
+    pcache_remove(entry);
+    pcache_unref(entry);
+    if (spilled != NULL)
+      pcache_link(spilled);
+  }
+  while (pcache_spill_size > pcache_spill_capacity && pcache_disk_tail != NULL)
+    pcache_remove(pcache_disk_tail);
+  pcache_unlock();
+
+  for (i = 0; i < num_victims; i++) {
+    if (paths[i] != NULL)
+      unlink(paths[i]);
+    free(paths[i]);
+  }
+  free(paths);
+}
+
+pcache_fill_t **pcache_find_fill(char *key) {
+  pcache_fill_t **link = &pcache_fills[pcache_hash(key) % PCACHE_BUCKETS];
+  while (*link != NULL && strcmp((*link)->key, key) != 0)
+    link = &(*link)->next;
+  return link;
+}
+
+/* Ends FILL, waking its waiters. Must be called with pcache_mutex held. */
+void pcache_end_fill(pcache_fill_t *fill) {
+  *pcache_find_fill(fill->key) = fill->next;
+  uint64_t one = 1;
+  for (int i = 0; i < fill->num_waiters; i++)
+    if (write(fill->waiters[i], &one, sizeof(one)) < 0)
+      perror("Failed to wake a request waiting for the proxy cache");
+}
+
+void pcache_free_fill(pcache_fill_t *fill) {
+  free(fill->key);
+  free(fill->waiters);
+  free(fill);
+}
+
+/*
+ * Puts up a fill at LINK (see pcache_find_fill) that reads the spilled entry
+ * SPILLED back on the spill thread. Lookups of its key wait for it as for a
+ * fetch. Must be called with pcache_mutex held.
+ */
+void pcache_start_load(pcache_entry_t *spilled, pcache_fill_t **link) {
+  pcache_fill_t *fill = calloc(1, sizeof(pcache_fill_t));
+  fill->key = strdup(spilled->key);
+  fill->spilled = spilled;
+  spilled->refcount++;
+  *link = fill;
+  *pcache_to_load_tail = fill;
+  pcache_to_load_tail = &fill->io_next;
+  pthread_cond_signal(&pcache_io_wanted);
+}
+
+/*
+ * Reads the spilled entry of the load FILL back into memory and caches it in
+ * place of the spilled one (dropping that if the file cannot be read), then
+ * ends FILL, so that the lookups waiting for it look again. Runs on the
+ * spill thread, without pcache_mutex held.
+ */
+void pcache_load(pcache_fill_t *fill) {
+  pcache_entry_t *spilled = fill->spilled;
+  pcache_entry_t *entry = pcache_new_entry(spilled);
+  entry->head = malloc(entry->head_length);
+  entry->body = malloc(entry->body_length + 1);
+  int fd = open(spilled->spill_path, O_RDONLY | O_CLOEXEC);
+  int result = fd < 0 ? -1 : pcache_read_all(fd, entry->head, entry->head_length, 0);
+  if (result == 0)
+    result = pcache_read_all(fd, entry->body, entry->body_length, entry->head_length);
+  if (fd >= 0)
+    close(fd);
+
+  pthread_mutex_lock(&pcache_mutex);
+  if (spilled->cached)
+    pcache_remove(spilled);
+  pcache_unref(spilled);
+  if (result == 0) {
+    pcache_link(entry);
+    pcache_shrink(entry);
+  } else {
+    pcache_unref(entry);
+  }
+  pcache_end_fill(fill);
+  pcache_unlock();
+  pcache_free_fill(fill);
+}
+
+/*
+ * Spill thread: does the cache's file I/O, so that neither lookups nor
+ * stores (which may run on an event loop) wait for the disk. Entries being
+ * written out are still served from memory, and lookups of ones being read
+ * back wait on their fill.
+ */
+void *pcache_io(void *args) {
+  pthread_mutex_lock(&pcache_mutex);
+  while (1) {
+    while (pcache_to_spill == NULL && pcache_to_load == NULL && pcache_to_delete == NULL)
+      pthread_cond_wait(&pcache_io_wanted, &pcache_mutex);
+    pcache_entry_t *victims = pcache_to_spill, *deleted = pcache_to_delete;
+    pcache_fill_t *loads = pcache_to_load;
+    pcache_to_spill = pcache_to_delete = NULL;
+    pcache_to_spill_tail = &pcache_to_spill;
+    pcache_to_load = NULL;
+    pcache_to_load_tail = &pcache_to_load;
+    pthread_mutex_unlock(&pcache_mutex);
+
+    while (loads != NULL) {
+      pcache_fill_t *next = loads->io_next;
+      pcache_load(loads);
+      loads = next;
+    }
+    pcache_spill(victims);
+    while (deleted != NULL) {
+      pcache_entry_t *next = deleted->hash_next;
+      pcache_free(deleted);
+      deleted = next;
+    }
+    pthread_mutex_lock(&pcache_mutex);
+  }
+  return NULL;
+}
+
+/*
+ * Looks KEY up. On a hit, returns PCACHE_HIT with the entry in *ENTRY and a
+ * reference held for the caller. If the response is being fetched for
+ * another request, or read back from the spill directory, returns
+ * PCACHE_WAIT and signals WAIT_FD (an eventfd) once that is over, when the
+ * caller should look again. Otherwise returns PCACHE_MISS; if MAY_FILL is
+ * set, the caller is then the one fetching the response, and must end *FILL
+ * with pcache_complete or pcache_abandon.
+ */
+enum pcache_result pcache_lookup(char *key, int may_fill, int wait_fd,
+    pcache_entry_t **entry, pcache_fill_t **fill) {
+  *entry = NULL;
+  *fill = NULL;
+  if (!pcache_enabled())
+    return PCACHE_MISS;
+
+  pthread_mutex_lock(&pcache_mutex);
+  pcache_entry_t *found = pcache_table[pcache_hash(key) % PCACHE_BUCKETS];
+  while (found != NULL && strcmp(found->key, key) != 0)
+    found = found->hash_next;
+  if (found != NULL && found->expires <= time(NULL)) {
+    pcache_remove(found);
+    found = NULL;
+  }
+  if (found != NULL && found->spill_path != NULL) {
+    pcache_fill_t **link = pcache_find_fill(key);
+    if (*link == NULL)
+      pcache_start_load(found, link);
+    found = NULL; // Being read back: wait for it as for a fill.
+  }
+  if (found != NULL) {
+    if (!found->spilling) {
+      pcache_lru_unlink(found);
+      pcache_lru_push(found);
+    }
+    found->refcount++;
+    pcache_unlock();
+    *entry = found;
+    return PCACHE_HIT;
+  }
+
+  pcache_fill_t **link = pcache_find_fill(key);
+  if (*link != NULL && wait_fd >= 0) {
+    pcache_fill_t *pending = *link;
+    pending->waiters = realloc(pending->waiters, (pending->num_waiters + 1) * sizeof(int));
+    pending->waiters[pending->num_waiters++] = wait_fd;
+    pcache_unlock();
+    return PCACHE_WAIT;
+  }
+  if (*link == NULL && may_fill) {
+    *link = calloc(1, sizeof(pcache_fill_t));
+    (*link)->key = strdup(key);
+    *fill = *link;
+  }
+  pcache_unlock();
+  return PCACHE_MISS;
+}
+
+/*
+ * Stops WAIT_FD from being signalled when the fill for KEY is over, e.g.
+ * because the waiting client went away.
+ */
+void pcache_cancel_wait(char *key, int wait_fd) {
+  pthread_mutex_lock(&pcache_mutex);
+  pcache_fill_t *pending = *pcache_find_fill(key);
+  for (int i = 0; pending != NULL && i < pending->num_waiters; i++)
+    if (pending->waiters[i] == wait_fd)
+      pending->waiters[i--] = pending->waiters[--pending->num_waiters];
+  pthread_mutex_unlock(&pcache_mutex);
+}
+
+/*
+ * Stores the response fetched by FILL: the rendered HEAD (see pcache_entry_t)
+ * and BODY, both malloc()ed buffers that the cache takes over, fresh until
+ * EXPIRES.
+ */
+void pcache_complete(pcache_fill_t *fill, char *head, size_t head_length,
+    char *body, size_t body_length, time_t expires) {
+  pcache_entry_t *entry = calloc(1, sizeof(pcache_entry_t));
+  entry->key = strdup(fill->key);
+  entry->stored_at = time(NULL);
+  entry->expires = expires;
+  entry->head = head;
+  entry->head_length = head_length;
+  entry->body = body;
+  entry->body_length = body_length;
+  entry->refcount = 1;
+  entry->cached = 1;
+
+  pthread_mutex_lock(&pcache_mutex);
+  if (pcache_entry_size(entry) <= pcache_capacity) {
+    pcache_entry_t *old = pcache_table[pcache_hash(entry->key) % PCACHE_BUCKETS];
+    while (old != NULL && strcmp(old->key, entry->key) != 0)
+      old = old->hash_next;
+    if (old != NULL)
+      pcache_remove(old);
+    pcache_link(entry);
+    pcache_shrink(entry);
+  } else {
+    pcache_unref(entry);
+  }
+  pcache_end_fill(fill);
+  pcache_unlock();
+  pcache_free_fill(fill);
+}
+
+/* Ends FILL without storing anything, e.g. the response is not cacheable. */
+void pcache_abandon(pcache_fill_t *fill) {
+  pthread_mutex_lock(&pcache_mutex);
+  pcache_end_fill(fill);
+  pthread_mutex_unlock(&pcache_mutex);
+  pcache_free_fill(fill);
+}
+
+/* Drops the caller's reference to ENTRY. */
+void pcache_release(pcache_entry_t *entry) {
+  pthread_mutex_lock(&pcache_mutex);
+  pcache_unref(entry);
+  pcache_unlock();
+}
+
+/*
+ * Returns the value of the directive NAME (e.g. "max-age") in the
+ * CACHE_CONTROL header, or -1 if it is not there.
+ */
+long pcache_directive(char *cache_control, char *name) {
+  size_t name_length = strlen(name);
+  for (char *directive = cache_control; *directive != '\0';) {
+    while (*directive == ' ' || *directive == '\t' || *directive == ',') directive++;
+    if (strncasecmp(directive, name, name_length) == 0 && directive[name_length] == '=') {
+      char *value = directive + name_length + 1;
+      if (*value == '"') value++;
+      return strtol(value, NULL, 10);
+    }
+    while (*directive != '\0' && *directive != ',') directive++;
+  }
+  return -1;
+}
+
+/*
+ * Works out until when a response with the given CACHE_CONTROL, EXPIRES and
+ * DATE headers (each NULL if missing) may be served from the cache, as a
+ * shared cache (RFC 7234, section 4.2.1). Returns 0 if it must not be stored
+ * or would not be fresh.
+ */
+time_t pcache_expires(char *cache_control, char *expires, char *date, time_t now) {
+  long lifetime = -1;
+  if (cache_control != NULL) {
+    if (http_header_has_token(cache_control, "no-store")
+        || http_header_has_token(cache_control, "no-cache")
+        || http_header_has_token(cache_control, "private"))
+      return 0;
+    lifetime = pcache_directive(cache_control, "s-maxage");
+    if (lifetime < 0)
+      lifetime = pcache_directive(cache_control, "max-age");
+  }
+
+  if (lifetime < 0 && expires != NULL) {
+    time_t expires_time, date_time;
+    if (http_parse_date(expires, &expires_time) != 0)
+      return 0;
+    if (date == NULL || http_parse_date(date, &date_time) != 0)
+      date_time = now;
+    lifetime = expires_time - date_time;
+  }
+  return lifetime > 0 ? now + lifetime : 0;
+}
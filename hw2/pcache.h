@@ -0,0 +1,68 @@
+#ifndef __PCACHE__
+#define __PCACHE__
+
+#include <sys/types.h>
+#include <time.h>
+
+/* PCACHE caches upstream responses in proxy mode, keyed by method and path.
+ * Only responses that are explicitly fresh for a while (Cache-Control
+ * max-age/s-maxage, or Expires) are stored, and an entry is dropped once it
+ * expires; there is no revalidation.
+ *
+ * Concurrent misses for the same key are coalesced: the first one becomes
+ * the fill and fetches the response, and the others wait (on an eventfd,
+ * so that event loops can wait too) until it is stored or abandoned.
+ *
+ * Entries live in memory up to the cache's capacity. With a spill
+ * directory, the least recently used ones are then written to disk instead
+ * of being dropped, up to the disk capacity, and read back when hit. A
+ * spill thread writes, reads and removes the files, so no request (nor event
+ * loop) waits for the disk: an entry being spilled is still served from
+ * memory meanwhile, and lookups of one being read back wait for it as for a
+ * fill.
+ * Entries are immutable and reference counted, like FCACHE's. */
+
+/* Larger responses are never cached. */
+#define PCACHE_MAX_ENTRY_SIZE (4 << 20)
+
+typedef struct pcache_entry {
+  char *key;
+  time_t stored_at;
+  time_t expires;
+
+  /* The status line and end-to-end headers, without Content-Length, Age,
+   * Connection or the blank line. NULL (with the body) while on disk. */
+  char *head;
+  size_t head_length;
+  char *body;
+  size_t body_length;
+  char *spill_path; // The file the entry is spilled to, if on disk.
+
+  int refcount;
+  int cached;
+  int spilling; // Being written to the spill directory; off the LRU lists.
+  struct pcache_entry *hash_next;
+  struct pcache_entry *lru_prev;
+  struct pcache_entry *lru_next;
+} pcache_entry_t;
+
+typedef struct pcache_fill pcache_fill_t;
+
+enum pcache_result {
+  PCACHE_HIT,  // *ENTRY is fresh.
+  PCACHE_MISS, // Fetch from upstream; with *FILL, store the response with it.
+  PCACHE_WAIT, // It is being fetched or read back; WAIT_FD will be signalled.
+};
+
+void pcache_init(size_t capacity, char *spill_dir, size_t spill_capacity);
+int pcache_enabled();
+enum pcache_result pcache_lookup(char *key, int may_fill, int wait_fd,
+    pcache_entry_t **entry, pcache_fill_t **fill);
+void pcache_cancel_wait(char *key, int wait_fd);
+time_t pcache_expires(char *cache_control, char *expires, char *date, time_t now);
+void pcache_complete(pcache_fill_t *fill, char *head, size_t head_length,
+    char *body, size_t body_length, time_t expires);
+void pcache_abandon(pcache_fill_t *fill);
+void pcache_release(pcache_entry_t *entry);
+
+#endif
@@ -0,0 +1,1073 @@
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "httpserver.h"
+#include "metrics.h"
+#include "proxy.h"
+
+/* Results of the steps of proxy_pump. */
+#define PROXY_BLOCKED 0
+#define PROXY_PROGRESS 1
+#define PROXY_FAILED -1
+#define PROXY_STALE -2 // A reused upstream connection had been closed.
+
+#define PROXY_MAX_HEADERS 100
+
+enum proxy_chunk_state {
+  PROXY_CHUNK_SIZE,
+  PROXY_CHUNK_EXTENSION,
+  PROXY_CHUNK_DATA,
+  PROXY_CHUNK_DATA_END,
+  PROXY_CHUNK_TRAILER,
+  PROXY_CHUNK_TRAILER_LINE,
+  PROXY_CHUNK_END,
+};
+
+/* Headers that only concern one connection, and are never forwarded. */
+char *proxy_hop_by_hop[] = {
+  "Connection", "Keep-Alive", "Proxy-Connection", "Proxy-Authenticate",
+  "Proxy-Authorization", "TE", "Trailer", "Upgrade", NULL,
+};
+
+
+void proxy_body_init(proxy_body_t *body, enum proxy_framing framing, off_t length) {
+  body->framing = framing;
+  body->remaining = length;
+  body->chunk_state = PROXY_CHUNK_SIZE;
+  body->chunk_digits = 0;
+  body->done = framing == PROXY_BODY_LENGTH && length == 0;
+}
+
+
+int proxy_hex_digit(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+
+/*
+ * Scans the LENGTH body bytes at DATA and moves BODY past the run at their
+ * start that is either all payload (*IS_DATA set) or all chunked framing.
+ * Returns the length of that run, 0 if the body is already complete, or -1
+ * if the chunked framing is malformed. Scanning a prefix of a run again moves
+ * past just that prefix.
+ */
+ssize_t proxy_body_scan(proxy_body_t *body, char *data, size_t length, int *is_data) {
+  if (body->done || length == 0)
+    return 0;
+
+  if (body->framing != PROXY_BODY_CHUNKED || body->chunk_state == PROXY_CHUNK_DATA) {
+    *is_data = 1;
+    if (body->framing == PROXY_BODY_CLOSE)
+      return length;
+    size_t run = (off_t) length < body->remaining ? length : (size_t) body->remaining;
+    body->remaining -= run;
+    if (body->remaining == 0 && body->framing == PROXY_BODY_LENGTH)
+      body->done = 1;
+    else if (body->remaining == 0)
+      body->chunk_state = PROXY_CHUNK_DATA_END;
+    return run;
+  }
+
+  *is_data = 0;
+  size_t run = 0;
+  while (run < length && body->chunk_state != PROXY_CHUNK_DATA && !body->done) {
+    char c = data[run++];
+    switch (body->chunk_state) {
+      case PROXY_CHUNK_SIZE:
+        if (proxy_hex_digit(c) >= 0) {
+          if (++body->chunk_digits > 15)
+            return -1;
+          body->remaining = body->remaining * 16 + proxy_hex_digit(c);
+          break;
+        }
+        if (body->chunk_digits == 0)
+          return -1;
+        body->chunk_state = PROXY_CHUNK_EXTENSION;
+        /* Fall through: C may already end the line. */
+      case PROXY_CHUNK_EXTENSION:
+        if (c == '\n')
+          body->chunk_state = body->remaining > 0 ? PROXY_CHUNK_DATA : PROXY_CHUNK_TRAILER;
+        break;
+      case PROXY_CHUNK_DATA_END:
+        if (c == '\n') {
+          body->chunk_state = PROXY_CHUNK_SIZE;
+          body->chunk_digits = 0;
+        } else if (c != '\r') {
+          return -1;
+        }
+        break;
+      case PROXY_CHUNK_TRAILER:
+        if (c == '\n')
+          body->done = 1;
+        else
+          body->chunk_state = c == '\r' ? PROXY_CHUNK_END : PROXY_CHUNK_TRAILER_LINE;
+        break;
+      case PROXY_CHUNK_TRAILER_LINE:
+        if (c == '\n')
+          body->chunk_state = PROXY_CHUNK_TRAILER;
+        break;
+      case PROXY_CHUNK_END:
+        if (c != '\n')
+          return -1;
+        body->done = 1;
+        break;
+    }
+  }
+  return run;
+}
+
+
+/*
+ * Returns 1 if the header NAME is end-to-end, i.e. neither hop-by-hop nor
+ * listed in the CONNECTION header of the same message.
+ */
+int proxy_end_to_end(char *name, char *connection) {
+  for (char **hop = proxy_hop_by_hop; *hop != NULL; hop++)
+    if (strcasecmp(name, *hop) == 0)
+      return 0;
+  return connection == NULL || !http_header_has_token(connection, name);
+}
+
+
+/*
+ * Returns the flags for sending a head. Both sockets have Nagle's algorithm
+ * off, so that a head sent on its own is not held back waiting for an ACK
+ * (which a delayed-ACK client sends only after ~40 ms); when MORE of the
+ * message is already at hand, MSG_MORE lets the kernel put the head in one
+ * segment with it instead.
+ */
+int proxy_send_flags(int more) {
+  return MSG_NOSIGNAL | (more ? MSG_MORE : 0);
+}
+
+
+/* Appends to conn->head. Returns -1 if it does not fit. */
+int proxy_head_printf(proxy_conn_t *conn, char *format, ...) {
+  size_t space = sizeof(conn->head) - conn->head_length;
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(conn->head + conn->head_length, space, format, args);
+  va_end(args);
+  if (length < 0 || (size_t) length >= space)
+    return -1;
+  conn->head_length += length;
+  return 0;
+}
+
+
+proxy_conn_t *proxy_conn_new(int client_fd) {
+  proxy_conn_t *conn = calloc(1, sizeof(proxy_conn_t));
+  conn->client_fd = client_fd;
+  conn->upstream_fd = -1;
+  conn->wait_fd = -1;
+  conn->created = metrics_now();
+  http_buffer_init(&conn->request);
+
+  struct sockaddr_in address;
+  socklen_t address_length = sizeof(address);
+  if (getpeername(client_fd, (struct sockaddr *) &address, &address_length) != 0
+      || inet_ntop(AF_INET, &address.sin_addr, conn->client_address,
+        sizeof(conn->client_address)) == NULL)
+    strcpy(conn->client_address, "unknown");
+  return conn;
+}
+
+
+/*
+ * Lets go of the upstream connection: hands it back to the pool if it is
+ * REUSABLE, closes it otherwise.
+ */
+void proxy_drop_upstream(proxy_conn_t *conn, int reusable) {
+  if (conn->upstream_fd < 0)
+    return;
+  if (conn->detach != NULL)
+    conn->detach(conn);
+  if (reusable)
+    upstream_put(conn->backend, conn->upstream_fd);
+  else
+    close(conn->upstream_fd);
+  upstream_release(conn->backend);
+  conn->upstream_fd = -1;
+  conn->backend = NULL;
+}
+
+
+/* Stops storing the current response in the cache. */
+void proxy_cache_abandon(proxy_conn_t *conn) {
+  if (conn->fill == NULL)
+    return;
+  pcache_abandon(conn->fill);
+  free(conn->fill_head);
+  free(conn->fill_body);
+  conn->fill = NULL;
+  conn->fill_head = conn->fill_body = NULL;
+  conn->fill_head_length = conn->fill_body_length = conn->fill_body_capacity = 0;
+}
+
+
+/* Stores the current response, which has been forwarded in full. */
+void proxy_cache_store(proxy_conn_t *conn) {
+  pcache_complete(conn->fill, conn->fill_head, conn->fill_head_length,
+      conn->fill_body, conn->fill_body_length, conn->fill_expires);
+  conn->fill = NULL;
+  conn->fill_head = conn->fill_body = NULL;
+  conn->fill_head_length = conn->fill_body_length = conn->fill_body_capacity = 0;
+}
+
+
+/*
+ * Frees CONN. An upstream connection between exchanges goes back to the
+ * pool. The client socket is left to the caller.
+ */
+void proxy_conn_free(proxy_conn_t *conn) {
+  proxy_drop_upstream(conn, !conn->forwarding);
+  proxy_cache_abandon(conn);
+  if (conn->waiting)
+    pcache_cancel_wait(conn->cache_key, conn->wait_fd);
+  if (conn->cached != NULL)
+    pcache_release(conn->cached);
+  free(conn->reply_buffer);
+  if (conn->wait_fd >= 0)
+    close(conn->wait_fd);
+  free(conn->cache_key);
+  free(conn);
+}
+
+
+/*
+ * Gives CONN the connection FD to BACKEND, after proxy_pump asked for one.
+ * REUSED tells whether it may have been closed by the upstream already (it
+ * came from the pool), in which case a request without a body is retried
+ * on another connection.
+ */
+void proxy_set_upstream(proxy_conn_t *conn, upstream_t *backend, int fd, int reused) {
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+  conn->upstream_fd = fd;
+  conn->backend = backend;
+  conn->upstream_reused = reused;
+}
+
+
+/* Returns 1 if CONN is waiting for the client's next request. */
+int proxy_idle(proxy_conn_t *conn) {
+  return !conn->forwarding && conn->requests_served > 0
+      && conn->request.start == conn->request.length;
+}
+
+
+/*
+ * Returns how many milliseconds CONN may still wait for its sockets, or -1 if
+ * there is no limit, and sets *TIMEOUT to what runs out then. An idle client
+ * has the keep-alive timeout to start its next request, whose head must then
+ * arrive within server_header_timeout of its first byte (the first request's,
+ * of the connection being taken on). Once a request is being forwarded,
+ * neither the client, nor the upstream, nor another request filling the
+ * cache may keep it waiting for more than server_body_timeout at a time.
+ */
+int proxy_timeout(proxy_conn_t *conn, enum metrics_timeout *timeout) {
+  if (proxy_idle(conn)) {
+    *timeout = METRICS_TIMEOUT_IDLE;
+    return server_keep_alive_timeout * 1000;
+  }
+
+  if (!conn->forwarding) {
+    *timeout = METRICS_TIMEOUT_HEADER;
+    if (server_header_timeout <= 0)
+      return -1;
+    long long since = conn->request.started;
+    if (since == 0)
+      since = conn->requests_served > 0 ? metrics_now() : conn->created;
+    long long left = since + server_header_timeout * 1000000000LL - metrics_now();
+    return left > 0 ? (left + 999999) / 1000000 : 0;
+  }
+
+  *timeout = METRICS_TIMEOUT_BODY;
+  return server_timeout_ms(server_body_timeout);
+}
+
+
+/*
+ * CONN has waited as long as proxy_timeout() allowed. Gives up the current
+ * exchange: its response is not stored, so that requests waiting for it go
+ * upstream themselves. Returns PROXY_ERROR, with 504 in conn->error_status,
+ * if it was the upstream or the cache that kept the client waiting and
+ * nothing of the response has been sent yet, PROXY_DONE otherwise.
+ */
+enum proxy_status proxy_expire(proxy_conn_t *conn) {
+  proxy_cache_abandon(conn);
+  if (conn->waiting) {
+    pcache_cancel_wait(conn->cache_key, conn->wait_fd);
+    conn->waiting = 0;
+  }
+  if (!conn->forwarding || conn->client_written || conn->client_wants != 0)
+    return PROXY_DONE;
+  conn->error_status = 504;
+  return PROXY_ERROR;
+}
+
+
+/*
+ * Returns the cache key for REQUEST, or NULL if its response must not come
+ * from the cache: only plain GETs without credentials are looked up.
+ * Conditional and range requests are always forwarded, as the cache holds
+ * neither validators nor partial responses.
+ */
+char *proxy_cache_key(struct http_request *request) {
+  if (!pcache_enabled() || strcmp(request->method, "GET") != 0 || request->content_length > 0)
+    return NULL;
+  for (int i = 0; i < request->num_headers; i++) {
+    char *name = request->base + request->headers[i].name.offset;
+    char *value = request->base + request->headers[i].value.offset;
+    if (strcasecmp(name, "Authorization") == 0 || strcasecmp(name, "Range") == 0
+        || strcasecmp(name, "Transfer-Encoding") == 0 || strncasecmp(name, "If-", 3) == 0)
+      return NULL;
+    if ((strcasecmp(name, "Cache-Control") == 0 || strcasecmp(name, "Pragma") == 0)
+        && (http_header_has_token(value, "no-cache") || http_header_has_token(value, "no-store")))
+      return NULL;
+  }
+
+  char *key = malloc(strlen(request->path) + 5);
+  sprintf(key, "GET %s", request->path);
+  return key;
+}
+
+
+/*
+ * Starts a reply from the proxy itself, with the LENGTH bytes at BODY: renders
+ * its head into conn->head from STATUS_LINE, the HEADERS_LENGTH bytes of
+ * HEADERS and the rendered headers EXTRA, adding the framing and connection
+ * headers. Returns -1 if the head does not fit.
+ */
+int proxy_start_reply(proxy_conn_t *conn, char *status_line, char *headers,
+    size_t headers_length, char *body, size_t length, char *extra) {
+  conn->head_length = conn->head_sent = 0;
+  if (proxy_head_printf(conn, "%s%.*s", status_line, (int) headers_length, headers) < 0
+      || proxy_head_printf(conn, "Content-Length: %zu\r\n%s", length, extra) < 0
+      || (!conn->keep_alive && proxy_head_printf(conn, "Connection: close\r\n") < 0)
+      || (conn->keep_alive && conn->client_version == 0
+        && proxy_head_printf(conn, "Connection: keep-alive\r\n") < 0)
+      || proxy_head_printf(conn, "\r\n") < 0) {
+    conn->head_length = 0;
+    return -1;
+  }
+  conn->replying = 1;
+  conn->reply = body;
+  conn->reply_length = length;
+  conn->reply_sent = 0;
+  conn->response_head_done = 1;
+  return 0;
+}
+
+
+/* Answers the current request with the metrics page. */
+void proxy_reply_metrics(proxy_conn_t *conn) {
+  size_t length;
+  conn->reply_buffer = metrics_render(&length);
+  conn->response_status = 200;
+  proxy_start_reply(conn, "HTTP/1.1 200 OK\r\n", "", 0, conn->reply_buffer, length,
+      "Content-Type: text/plain; version=0.0.4\r\nCache-Control: no-store\r\n");
+}
+
+
+/*
+ * Returns 1 if chunked is the last coding in the Transfer-Encoding VALUE. A
+ * request body coded otherwise cannot be framed (RFC 7230, section 3.3.3).
+ */
+int proxy_chunked_last(char *value) {
+  char *last = strrchr(value, ',');
+  last = last != NULL ? last + 1 : value;
+  while (*last == ' ' || *last == '\t') last++;
+  return strcasecmp(last, "chunked") == 0;
+}
+
+
+/*
+ * Starts forwarding REQUEST, whose head has just been parsed: renders the
+ * head to send upstream into conn->head and works out where the body ends.
+ * Returns -1 if the request cannot be forwarded.
+ */
+int proxy_start_request(proxy_conn_t *conn, struct http_request *request) {
+  char *connection = http_request_header(request, "Connection", NULL);
+  char *transfer_encoding = http_request_header(request, "Transfer-Encoding", NULL);
+  char *forwarded_for = http_request_header(request, "X-Forwarded-For", NULL);
+  if (request->chunked && !proxy_chunked_last(transfer_encoding))
+    return -1;
+
+  conn->head_length = conn->head_sent = 0;
+  int result = proxy_head_printf(conn, "%s %s HTTP/1.1\r\n", request->method, request->path);
+  for (int i = 0; i < request->num_headers && result == 0; i++) {
+    char *name = request->base + request->headers[i].name.offset;
+    char *value = request->base + request->headers[i].value.offset;
+    if (strcasecmp(name, "X-Forwarded-For") != 0 && proxy_end_to_end(name, connection))
+      result = proxy_head_printf(conn, "%s: %s\r\n", name, value);
+  }
+  if (result == 0)
+    result = proxy_head_printf(conn, "X-Forwarded-For: %s%s%s\r\n\r\n",
+        forwarded_for ? forwarded_for : "", forwarded_for ? ", " : "", conn->client_address);
+  if (result < 0)
+    return -1;
+
+  conn->requests_served++;
+  conn->keep_alive = request_keep_alive(request, conn->requests_served);
+  conn->client_version = request->version;
+  conn->head_request = strcmp(request->method, "HEAD") == 0;
+  conn->hash = upstream_hash(request->path, strcspn(request->path, "?"));
+  conn->request_has_body = request->chunked || request->content_length > 0;
+  if (request->chunked)
+    proxy_body_init(&conn->request_body, PROXY_BODY_CHUNKED, 0);
+  else
+    proxy_body_init(&conn->request_body, PROXY_BODY_LENGTH, request->content_length);
+
+  conn->response_started = 0;
+  conn->response_head_done = 0;
+  conn->response_done = 0;
+  conn->client_written = 0;
+  conn->response_bytes = 0;
+  conn->forwarding = 1;
+  conn->started = conn->request.started;
+  metrics_parsed(conn->started);
+  if (alog_enabled()) {
+    snprintf(conn->log_method, sizeof(conn->log_method), "%s", request->method);
+    snprintf(conn->log_path, sizeof(conn->log_path), "%s", request->path);
+  }
+  if (strcmp(request->method, "GET") == 0 && strcmp(request->path, METRICS_PATH) == 0
+      && !conn->request_has_body)
+    proxy_reply_metrics(conn);
+  else
+    conn->cache_key = proxy_cache_key(request);
+  conn->cache_may_fill = 1;
+
+  /* Only the head is consumed; the body is forwarded from the buffer. */
+  conn->request.consumed = conn->request.line_start;
+  http_buffer_consume(&conn->request);
+
+  /* Requests are balanced on their own paths, even on a connection that is
+   * already open to another backend. */
+  if (conn->upstream_fd >= 0 && upstream_policy() == UPSTREAM_HASH
+      && upstream_choose(conn->hash, 0) != conn->backend)
+    proxy_drop_upstream(conn, 1);
+  return 0;
+}
+
+
+/*
+ * Returns the length of the response head at the start of the LENGTH bytes
+ * at DATA, including the empty line that ends it, or 0 if it is incomplete.
+ */
+size_t proxy_find_head_end(char *data, size_t length) {
+  char *end = data + length;
+  for (char *newline = data; (newline = memchr(newline, '\n', end - newline)) != NULL; newline++) {
+    if (newline + 1 < end && newline[1] == '\n')
+      return newline + 2 - data;
+    if (newline + 2 < end && newline[1] == '\r' && newline[2] == '\n')
+      return newline + 3 - data;
+  }
+  return 0;
+}
+
+
+/*
+ * Decides whether the response with STATUS and the NUM_HEADERS headers in
+ * NAMES and VALUES may be stored in the cache, and if so renders the head to
+ * store. Otherwise gives up the fill, so that requests waiting for it go
+ * upstream themselves.
+ */
+void proxy_cache_begin(proxy_conn_t *conn, int status, char *reason, int reason_length,
+    char **names, char **values, int num_headers, char *connection) {
+  char *cache_control = NULL, *expires = NULL, *date = NULL;
+  int storable = (status == 200 || status == 203 || status == 301 || status == 404
+      || status == 410) && conn->response_body.framing != PROXY_BODY_CLOSE;
+  for (int i = 0; i < num_headers; i++) {
+    if (strcasecmp(names[i], "Cache-Control") == 0 && cache_control == NULL)
+      cache_control = values[i];
+    else if (strcasecmp(names[i], "Expires") == 0)
+      expires = values[i];
+    else if (strcasecmp(names[i], "Date") == 0)
+      date = values[i];
+    else if (strcasecmp(names[i], "Vary") == 0 || strcasecmp(names[i], "Set-Cookie") == 0)
+      storable = 0;
+  }
+  if (storable)
+    conn->fill_expires = pcache_expires(cache_control, expires, date, time(NULL));
+  if (!storable || conn->fill_expires == 0) {
+    proxy_cache_abandon(conn);
+    return;
+  }
+
+  /* Framing and connection headers are added when the entry is served. */
+  char *head = malloc(PROXY_HEAD_SIZE);
+  size_t length = snprintf(head, PROXY_HEAD_SIZE, "HTTP/1.1 %d %.*s\r\n",
+      status, reason_length, reason);
+  for (int i = 0; i < num_headers && length < PROXY_HEAD_SIZE; i++) {
+    if (!proxy_end_to_end(names[i], connection) || strcasecmp(names[i], "Content-Length") == 0
+        || strcasecmp(names[i], "Transfer-Encoding") == 0 || strcasecmp(names[i], "Age") == 0)
+      continue;
+    length += snprintf(head + length, PROXY_HEAD_SIZE - length, "%s: %s\r\n",
+        names[i], values[i]);
+  }
+  conn->fill_head = head;
+  conn->fill_head_length = length;
+  if (length >= PROXY_HEAD_SIZE)
+    proxy_cache_abandon(conn);
+}
+
+
+/* Adds the LENGTH payload bytes at DATA to the response being stored. */
+void proxy_cache_append(proxy_conn_t *conn, char *data, size_t length) {
+  size_t needed = conn->fill_body_length + length;
+  if (conn->fill_head_length + needed > PCACHE_MAX_ENTRY_SIZE) {
+    proxy_cache_abandon(conn);
+    return;
+  }
+  if (needed > conn->fill_body_capacity) {
+    conn->fill_body_capacity = needed > 2 * conn->fill_body_capacity
+        ? needed : 2 * conn->fill_body_capacity;
+    conn->fill_body = realloc(conn->fill_body, conn->fill_body_capacity);
+  }
+  memcpy(conn->fill_body + conn->fill_body_length, data, length);
+  conn->fill_body_length = needed;
+}
+
+
+/*
+ * Parses the LENGTH byte response head at DATA (in place), works out where
+ * the body ends and renders the head for the client into conn->head.
+ * Returns -1 if the head is malformed or too large.
+ */
+int proxy_start_response(proxy_conn_t *conn, char *data, size_t length) {
+  if (length < 13 || strncmp(data, "HTTP/1.", 7) != 0 || !isdigit(data[7])
+      || data[8] != ' ' || !isdigit(data[9]) || !isdigit(data[10]) || !isdigit(data[11]))
+    return -1;
+  int version = data[7] != '0';
+  int status = (data[9] - '0') * 100 + (data[10] - '0') * 10 + (data[11] - '0');
+  char *reason = data + 12;
+  while (*reason == ' ') reason++;
+  char *line = memchr(data, '\n', length) + 1;
+  int reason_length = line - 1 - reason;
+  if (reason_length > 0 && reason[reason_length - 1] == '\r')
+    reason_length--;
+
+  char *names[PROXY_MAX_HEADERS], *values[PROXY_MAX_HEADERS];
+  int num_headers = 0;
+  char *connection = NULL, *transfer_encoding = NULL, *content_length = NULL;
+  char *end = data + length;
+  while (1) {
+    char *newline = memchr(line, '\n', end - line);
+    char *line_end = newline;
+    if (line_end > line && line_end[-1] == '\r')
+      line_end--;
+    if (line_end == line)
+      break;
+
+    char *colon = memchr(line, ':', line_end - line);
+    if (colon == NULL || colon == line || num_headers == PROXY_MAX_HEADERS)
+      return -1;
+    char *value = colon + 1;
+    while (value < line_end && (*value == ' ' || *value == '\t')) value++;
+    while (line_end > value && (line_end[-1] == ' ' || line_end[-1] == '\t')) line_end--;
+    *colon = '\0';
+    *line_end = '\0';
+
+    if (strcasecmp(line, "Connection") == 0) connection = value;
+    else if (strcasecmp(line, "Transfer-Encoding") == 0) transfer_encoding = value;
+    else if (strcasecmp(line, "Content-Length") == 0) content_length = value;
+    names[num_headers] = line;
+    values[num_headers++] = value;
+    line = newline + 1;
+  }
+
+  /* Where the body ends (RFC 7230, section 3.3.3). */
+  int informational = status / 100 == 1 && status != 101;
+  enum proxy_framing framing = PROXY_BODY_CLOSE;
+  off_t body_length = 0;
+  if (conn->head_request || informational || status == 204 || status == 304) {
+    framing = PROXY_BODY_LENGTH;
+  } else if (status == 101) {
+    framing = PROXY_BODY_CLOSE;
+  } else if (transfer_encoding != NULL) {
+    if (http_header_has_token(transfer_encoding, "chunked"))
+      framing = PROXY_BODY_CHUNKED;
+  } else if (content_length != NULL) {
+    char *digits_end;
+    body_length = strtoll(content_length, &digits_end, 10);
+    if (digits_end == content_length || *digits_end != '\0' || body_length < 0)
+      return -1;
+    framing = PROXY_BODY_LENGTH;
+  }
+  proxy_body_init(&conn->response_body, framing, body_length);
+
+  conn->response_status = status;
+  conn->dechunk = framing == PROXY_BODY_CHUNKED && conn->client_version == 0;
+  conn->upstream_keep_alive = framing != PROXY_BODY_CLOSE && (version
+      ? connection == NULL || !http_header_has_token(connection, "close")
+      : connection != NULL && http_header_has_token(connection, "keep-alive"));
+  if (!informational)
+    conn->keep_alive = conn->keep_alive && framing != PROXY_BODY_CLOSE
+        && !conn->dechunk && conn->request_body.done;
+
+  if (conn->fill != NULL && !informational)
+    proxy_cache_begin(conn, status, reason, reason_length, names, values, num_headers,
+        connection);
+
+  conn->head_length = conn->head_sent = 0;
+  conn->response_head_done = 1;
+  if (informational && conn->client_version == 0)
+    return 0; // HTTP/1.0 clients do not expect interim responses.
+
+  int result = proxy_head_printf(conn, "HTTP/1.1 %d %.*s\r\n", status, reason_length, reason);
+  for (int i = 0; i < num_headers && result == 0; i++) {
+    if (!proxy_end_to_end(names[i], connection))
+      continue;
+    /* A chunked body's Content-Length is meaningless, and the chunked
+     * coding is removed for HTTP/1.0 clients. */
+    if (strcasecmp(names[i], "Content-Length") == 0 && transfer_encoding != NULL)
+      continue;
+    if (strcasecmp(names[i], "Transfer-Encoding") == 0 && conn->dechunk)
+      continue;
+    result = proxy_head_printf(conn, "%s: %s\r\n", names[i], values[i]);
+  }
+  if (result == 0 && !informational && !conn->keep_alive)
+    result = proxy_head_printf(conn, "Connection: close\r\n");
+  else if (result == 0 && !informational && conn->client_version == 0)
+    result = proxy_head_printf(conn, "Connection: keep-alive\r\n");
+  if (result == 0)
+    result = proxy_head_printf(conn, "\r\n");
+  return result;
+}
+
+
+/*
+ * Sending to or receiving from the upstream failed. A reused connection that
+ * fails before any of the response arrives has most likely been closed by
+ * the upstream while idle, and a request without a body can safely be sent
+ * again on another one.
+ */
+int proxy_upstream_failed(proxy_conn_t *conn) {
+  if (conn->upstream_reused && !conn->response_started && !conn->request_has_body)
+    return PROXY_STALE;
+  if (!conn->client_written)
+    conn->error_status = 502;
+  return PROXY_FAILED;
+}
+
+
+/*
+ * Interprets the result of a send() of (part of) the current exchange on FD,
+ * which the other side of CONN is waiting for.
+ */
+int proxy_send_result(proxy_conn_t *conn, int fd, ssize_t sent) {
+  if (sent >= 0 || errno == EINTR)
+    return PROXY_PROGRESS;
+  if (errno == EAGAIN || errno == EWOULDBLOCK) {
+    if (fd == conn->upstream_fd)
+      conn->upstream_wants |= PROXY_WRITE;
+    else
+      conn->client_wants |= PROXY_WRITE;
+    return PROXY_BLOCKED;
+  }
+  return fd == conn->upstream_fd ? proxy_upstream_failed(conn) : PROXY_FAILED;
+}
+
+
+/*
+ * Moves the request along: sends the rewritten head upstream, then the body
+ * as it arrives from the client.
+ */
+int proxy_send_request(proxy_conn_t *conn) {
+  if (!conn->response_head_done && conn->head_sent < conn->head_length) {
+    ssize_t sent = send(conn->upstream_fd, conn->head + conn->head_sent,
+        conn->head_length - conn->head_sent,
+        proxy_send_flags(conn->request_has_body && conn->request.start < conn->request.length));
+    if (sent > 0)
+      conn->head_sent += sent;
+    return proxy_send_result(conn, conn->upstream_fd, sent);
+  }
+  if (conn->request_body.done)
+    return PROXY_BLOCKED;
+
+  struct http_buffer *buffer = &conn->request;
+  if (buffer->start == buffer->length) {
+    ssize_t bytes_read = http_buffer_fill(conn->client_fd, buffer);
+    if (bytes_read > 0 || (bytes_read < 0 && errno == EINTR))
+      return PROXY_PROGRESS;
+    if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      conn->client_wants |= PROXY_READ;
+      return PROXY_BLOCKED;
+    }
+    return PROXY_FAILED;
+  }
+
+  char *data = buffer->data + buffer->start;
+  proxy_body_t probe = conn->request_body;
+  int is_data;
+  ssize_t run = proxy_body_scan(&probe, data, buffer->length - buffer->start, &is_data);
+  if (run < 0) {
+    conn->error_status = 400;
+    return PROXY_FAILED;
+  }
+
+  ssize_t sent = send(conn->upstream_fd, data, run, MSG_NOSIGNAL);
+  if (sent > 0) {
+    proxy_body_scan(&conn->request_body, data, sent, &is_data);
+    buffer->start += sent;
+    if (buffer->start == buffer->length)
+      buffer->start = buffer->length = 0;
+  }
+  return proxy_send_result(conn, conn->upstream_fd, sent);
+}
+
+
+/* SENT bytes of the current response have just been sent to the client. */
+void proxy_wrote_client(proxy_conn_t *conn, ssize_t sent) {
+  if (sent <= 0)
+    return;
+  if (conn->response_bytes == 0)
+    metrics_first_byte(conn->started);
+  conn->response_bytes += sent;
+  conn->client_written = 1;
+}
+
+
+/*
+ * Moves the response along: reads it from the upstream, and once its head
+ * is complete, sends the rewritten head and then the body to the client.
+ */
+int proxy_forward_response(proxy_conn_t *conn) {
+  if (!conn->response_head_done && conn->head_sent < conn->head_length)
+    return PROXY_BLOCKED; // The request head is still going out.
+
+  char *data = conn->response + conn->response_start;
+  size_t available = conn->response_length - conn->response_start;
+
+  if (!conn->response_head_done && available > 0) {
+    size_t head_length = proxy_find_head_end(data, available);
+    if (head_length > 0) {
+      conn->response_start += head_length;
+      if (proxy_start_response(conn, data, head_length) < 0) {
+        conn->error_status = 502;
+        return PROXY_FAILED;
+      }
+      return PROXY_PROGRESS;
+    }
+    if (available == sizeof(conn->response)) {
+      conn->error_status = 502;
+      return PROXY_FAILED;
+    }
+  }
+
+  if (conn->response_head_done && conn->head_sent < conn->head_length) {
+    ssize_t sent = send(conn->client_fd, conn->head + conn->head_sent,
+        conn->head_length - conn->head_sent,
+        proxy_send_flags(available > 0 && !conn->dechunk));
+    if (sent > 0)
+      conn->head_sent += sent;
+    proxy_wrote_client(conn, sent);
+    return proxy_send_result(conn, conn->client_fd, sent);
+  }
+
+  if (conn->response_head_done && conn->response_body.done) {
+    if (conn->response_status / 100 == 1 && conn->response_status != 101) {
+      /* An interim response; the real one follows. */
+      conn->response_head_done = 0;
+      conn->head_length = conn->head_sent = 0;
+    } else {
+      conn->response_done = 1;
+    }
+    return PROXY_PROGRESS;
+  }
+
+  if (conn->response_head_done && available > 0) {
+    proxy_body_t probe = conn->response_body;
+    int is_data;
+    ssize_t run = proxy_body_scan(&probe, data, available, &is_data);
+    if (run < 0) {
+      if (!conn->client_written)
+        conn->error_status = 502;
+      return PROXY_FAILED;
+    }
+
+    ssize_t sent = run;
+    if (is_data || !conn->dechunk) {
+      sent = send(conn->client_fd, data, run, MSG_NOSIGNAL);
+      proxy_wrote_client(conn, sent);
+    }
+    if (sent > 0) {
+      proxy_body_scan(&conn->response_body, data, sent, &is_data);
+      if (is_data && conn->fill != NULL)
+        proxy_cache_append(conn, data, sent);
+      conn->response_start += sent;
+      if (conn->response_start == conn->response_length)
+        conn->response_start = conn->response_length = 0;
+    }
+    return proxy_send_result(conn, conn->client_fd, sent);
+  }
+
+  if (conn->response_length == sizeof(conn->response)) {
+    memmove(conn->response, data, available);
+    conn->response_start = 0;
+    conn->response_length = available;
+  }
+  ssize_t received = recv(conn->upstream_fd, conn->response + conn->response_length,
+      sizeof(conn->response) - conn->response_length, 0);
+  if (received > 0) {
+    conn->response_started = 1;
+    conn->response_length += received;
+    return PROXY_PROGRESS;
+  }
+  if (received < 0 && errno == EINTR)
+    return PROXY_PROGRESS;
+  if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    conn->upstream_wants |= PROXY_READ;
+    return PROXY_BLOCKED;
+  }
+  if (received == 0 && conn->response_head_done
+      && conn->response_body.framing == PROXY_BODY_CLOSE) {
+    conn->response_body.done = 1;
+    conn->upstream_keep_alive = 0;
+    return PROXY_PROGRESS;
+  }
+  return proxy_upstream_failed(conn);
+}
+
+
+/*
+ * Looks the current request up in the cache. A hit is then served by
+ * proxy_send_reply. Returns PROXY_BLOCKED while waiting for another
+ * request to fetch the same response.
+ */
+int proxy_cache_lookup(proxy_conn_t *conn) {
+  int wait_fd = conn->wait_fd;
+  if (conn->waiting) {
+    uint64_t count;
+    if (read(conn->wait_fd, &count, sizeof(count)) < 0
+        && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return PROXY_BLOCKED;
+    /* That fetch is over. Look again, but go upstream rather than wait
+     * twice if the response was not stored. */
+    conn->waiting = 0;
+    wait_fd = -1;
+  } else if (wait_fd < 0) {
+    wait_fd = conn->wait_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  }
+
+  pcache_entry_t *entry;
+  char age[32];
+  switch (pcache_lookup(conn->cache_key, conn->cache_may_fill, wait_fd, &entry, &conn->fill)) {
+    case PCACHE_WAIT:
+      conn->waiting = 1;
+      return PROXY_BLOCKED;
+    case PCACHE_HIT:
+      snprintf(age, sizeof(age), "Age: %ld\r\n", (long) (time(NULL) - entry->stored_at));
+      if (proxy_start_reply(conn, "", entry->head, entry->head_length, entry->body,
+            entry->body_length, age) < 0) {
+        pcache_release(entry);
+        break;
+      }
+      conn->cached = entry;
+      conn->response_status = atoi(entry->head + 9);
+      break;
+    case PCACHE_MISS:
+      break;
+  }
+  free(conn->cache_key);
+  conn->cache_key = NULL;
+  return PROXY_PROGRESS;
+}
+
+
+/* Sends the reply from the proxy itself to the current request. */
+int proxy_send_reply(proxy_conn_t *conn) {
+  ssize_t sent;
+  if (conn->head_sent < conn->head_length) {
+    sent = send(conn->client_fd, conn->head + conn->head_sent,
+        conn->head_length - conn->head_sent, proxy_send_flags(conn->reply_length > 0));
+    if (sent > 0)
+      conn->head_sent += sent;
+  } else if (conn->reply_sent < conn->reply_length) {
+    sent = send(conn->client_fd, conn->reply + conn->reply_sent,
+        conn->reply_length - conn->reply_sent, MSG_NOSIGNAL);
+    if (sent > 0)
+      conn->reply_sent += sent;
+  } else {
+    conn->response_done = 1;
+    return PROXY_PROGRESS;
+  }
+  proxy_wrote_client(conn, sent);
+  return proxy_send_result(conn, conn->client_fd, sent);
+}
+
+
+/*
+ * Logs a response with STATUS and BYTES bytes in all to the current request,
+ * or to the one that could not be forwarded or even parsed.
+ */
+void proxy_log(proxy_conn_t *conn, int status, size_t bytes) {
+  int known = conn->log_method[0] != '\0';
+  alog_request(conn->client_address, known ? conn->log_method : NULL,
+      known ? conn->log_path : NULL, status, bytes,
+      known ? conn->started : conn->request.started);
+  conn->log_method[0] = '\0';
+}
+
+
+/*
+ * The response has been delivered. Keeps the upstream connection for the
+ * next request if the upstream allows it.
+ */
+void proxy_finish(proxy_conn_t *conn) {
+  conn->forwarding = 0;
+  metrics_response(conn->response_status, conn->response_bytes);
+  proxy_log(conn, conn->response_status, conn->response_bytes);
+  if (conn->replying) {
+    if (conn->cached != NULL)
+      pcache_release(conn->cached);
+    free(conn->reply_buffer);
+    conn->cached = NULL;
+    conn->reply_buffer = NULL;
+    conn->replying = 0;
+    return;
+  }
+  if (conn->fill != NULL)
+    proxy_cache_store(conn);
+  if (conn->upstream_keep_alive && conn->request_body.done
+      && conn->response_start == conn->response_length)
+    conn->upstream_reused = 1;
+  else
+    proxy_drop_upstream(conn, 0);
+  conn->response_start = conn->response_length = 0;
+}
+
+
+/*
+ * Makes as much progress on CONN as its non-blocking sockets allow: reads
+ * the client's next request, forwards it and relays the response back.
+ */
+enum proxy_status proxy_pump(proxy_conn_t *conn) {
+  while (1) {
+    conn->client_wants = conn->upstream_wants = 0;
+
+    if (!conn->forwarding) {
+      enum http_parse_status status = http_buffer_parse(&conn->request);
+      if (status == HTTP_PARSE_INCOMPLETE) {
+        ssize_t bytes_read = http_buffer_fill(conn->client_fd, &conn->request);
+        if (bytes_read > 0 || (bytes_read < 0 && errno == EINTR))
+          continue;
+        if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+          conn->client_wants = PROXY_READ;
+          return PROXY_WAIT;
+        }
+        return PROXY_DONE;
+      }
+      if (status == HTTP_PARSE_MALFORMED
+          || proxy_start_request(conn, &conn->request.request) < 0) {
+        conn->error_status = 400;
+        return PROXY_ERROR;
+      }
+    }
+    if (conn->cache_key != NULL && proxy_cache_lookup(conn) == PROXY_BLOCKED)
+      return PROXY_WAIT;
+
+    int request, response;
+    if (conn->replying) {
+      request = PROXY_BLOCKED;
+      response = proxy_send_reply(conn);
+    } else if (conn->upstream_fd < 0) {
+      return PROXY_UPSTREAM;
+    } else {
+      request = proxy_send_request(conn);
+      response = request < 0 ? request : proxy_forward_response(conn);
+    }
+    if (request == PROXY_STALE || response == PROXY_STALE) {
+      proxy_drop_upstream(conn, 0);
+      conn->head_sent = 0;
+      return PROXY_UPSTREAM;
+    }
+    if (request < 0 || response < 0)
+      return conn->error_status != 0 ? PROXY_ERROR : PROXY_DONE;
+
+    if (conn->response_done) {
+      proxy_finish(conn);
+      if (!conn->keep_alive)
+        return PROXY_DONE;
+      continue;
+    }
+    if (request == PROXY_BLOCKED && response == PROXY_BLOCKED)
+      return PROXY_WAIT;
+  }
+}
+
+
+short proxy_poll_events(int wants) {
+  return (wants & PROXY_READ ? POLLIN : 0) | (wants & PROXY_WRITE ? POLLOUT : 0);
+}
+
+
+/*
+ * Serves the client of CONN on the calling thread, waiting with poll() and
+ * connecting to backends as requests need them. Returns PROXY_DONE, or
+ * PROXY_ERROR if the client should get conn->error_status before the caller
+ * closes it.
+ */
+enum proxy_status proxy_run(proxy_conn_t *conn) {
+  fcntl(conn->client_fd, F_SETFL, fcntl(conn->client_fd, F_GETFL, 0) | O_NONBLOCK);
+
+  while (1) {
+    enum proxy_status status = proxy_pump(conn);
+    if (status == PROXY_UPSTREAM) {
+      uint64_t tried = 0;
+      upstream_t *backend;
+      int pooled;
+      int fd = upstream_open(conn->hash, &tried, &backend, &pooled);
+      if (fd < 0) {
+        conn->error_status = 502;
+        return PROXY_ERROR;
+      }
+      proxy_set_upstream(conn, backend, fd, pooled);
+      continue;
+    }
+    if (status != PROXY_WAIT)
+      return status;
+
+    /* A socket with nothing to wait for is left out, as in relay_run. */
+    struct pollfd fds[3];
+    fds[0].fd = conn->client_fd;
+    fds[0].events = proxy_poll_events(conn->client_wants);
+    fds[1].fd = conn->upstream_fd;
+    fds[1].events = proxy_poll_events(conn->upstream_wants);
+    fds[2].fd = conn->wait_fd;
+    fds[2].events = conn->waiting ? POLLIN : 0;
+    for (int i = 0; i < 3; i++)
+      if (fds[i].events == 0)
+        fds[i].fd = -1;
+
+    enum metrics_timeout phase;
+    int timeout = proxy_timeout(conn, &phase);
+    int ready = timeout == 0 ? 0 : poll(fds, 3, timeout);
+    if (ready == 0) {
+      metrics_timeout(phase);
+      return proxy_expire(conn);
+    }
+    if (ready < 0 && errno != EINTR)
+      return PROXY_DONE;
+  }
+}
@@ -0,0 +1,142 @@
+#ifndef __PROXY__
+#define __PROXY__
+
+#include <netinet/in.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "alog.h"
+#include "libhttp.h"
+#include "metrics.h"
+#include "pcache.h"
+#include "upstream.h"
+
+/* PROXY forwards HTTP requests to the upstream one at a time, instead of
+ * relaying raw bytes. Each request and response is parsed just enough to
+ * find where it ends (Content-Length, chunked or, for responses, end of
+ * file), its hop-by-hop headers are dropped and X-Forwarded-For is added.
+ * Knowing where each exchange ends lets one upstream connection carry the
+ * client's requests one after another, and go back to the upstream pool
+ * when the client is done.
+ *
+ * A proxy_conn_t is driven by proxy_pump() on non-blocking sockets, like a
+ * relay channel: it makes as much progress as the sockets allow and then
+ * says what it is waiting for, so the same code runs on pool workers
+ * (proxy_run, with poll()) and in the event loop (with epoll).
+ *
+ * With PCACHE enabled, fresh cached responses to GET requests are served
+ * without an upstream, and cacheable ones are stored as they are forwarded.
+ * A request whose response is already being fetched for another client
+ * waits for it on wait_fd, an eventfd the driver polls like the sockets. */
+
+#define PROXY_BUFFER_SIZE 16384
+#define PROXY_HEAD_SIZE (PROXY_BUFFER_SIZE + 256)
+
+/* What a socket of a proxy_conn_t is waiting for. */
+#define PROXY_READ 1
+#define PROXY_WRITE 2
+
+enum proxy_status {
+  PROXY_WAIT,     // Waiting for client_wants/upstream_wants.
+  PROXY_UPSTREAM, // Needs a connection to the backend for conn->hash.
+  PROXY_DONE,     // The client connection is finished.
+  PROXY_ERROR,    // Answer with conn->error_status, then close.
+};
+
+enum proxy_framing {
+  PROXY_BODY_LENGTH,  // remaining more bytes.
+  PROXY_BODY_CHUNKED, // Transfer-Encoding: chunked.
+  PROXY_BODY_CLOSE,   // Until the upstream closes the connection.
+};
+
+/* Where a message body ends. */
+typedef struct proxy_body {
+  enum proxy_framing framing;
+  off_t remaining;
+  int chunk_state;
+  int chunk_digits;
+  int done;
+} proxy_body_t;
+
+typedef struct proxy_conn {
+  int client_fd;
+  char client_address[INET_ADDRSTRLEN];
+  int requests_served;
+  long long created;          // When the proxy took the client on (see metrics.h).
+  struct http_buffer request; // Bytes from the client.
+
+  int upstream_fd; // -1 while there is none.
+  upstream_t *backend;
+  int upstream_reused; // upstream_fd may have been closed by the upstream.
+  uint32_t hash;       // Of the current request's path.
+
+  /* The current exchange. */
+  int forwarding;     // Its request head has been read.
+  int keep_alive;     // The client connection stays open after it.
+  int client_version;
+  int head_request;
+  long long started;  // When the request began to arrive (see metrics.h).
+  char log_method[16]; // For the access log; empty once logged.
+  char log_path[ALOG_PATH_MAX + 1];
+  char head[PROXY_HEAD_SIZE]; // The rewritten request head, then response head.
+  size_t head_length;
+  size_t head_sent;
+  int request_has_body;
+  proxy_body_t request_body;
+
+  char response[PROXY_BUFFER_SIZE]; // Bytes from the upstream.
+  size_t response_start;
+  size_t response_length;
+  int response_started;   // The upstream has sent anything.
+  int response_head_done; // head holds the response head.
+  int response_status;
+  int response_done;
+  int upstream_keep_alive;
+  int dechunk;            // Strip chunked framing for an HTTP/1.0 client.
+  int client_written;     // Part of the response has been sent.
+  size_t response_bytes;  // Sent to the client, head included.
+  proxy_body_t response_body;
+
+  /* The response cache, for the current exchange. */
+  char *cache_key;         // Set until the cache has been looked up.
+  int cache_may_fill;      // The response may be stored.
+  int waiting;             // For another request's fill; watch wait_fd.
+  int wait_fd;             // An eventfd, -1 until first needed.
+
+  /* A response made by the proxy itself (a cache hit or the metrics page):
+   * head, then REPLY_LENGTH bytes at REPLY. */
+  int replying;
+  char *reply;
+  size_t reply_length;
+  size_t reply_sent;
+  pcache_entry_t *cached;  // Holding REPLY, for a cache hit.
+  char *reply_buffer;      // Holding REPLY, otherwise.
+  pcache_fill_t *fill;     // Storing the response.
+  char *fill_head;
+  size_t fill_head_length;
+  char *fill_body;
+  size_t fill_body_length;
+  size_t fill_body_capacity;
+  time_t fill_expires;
+
+  int client_wants;   // PROXY_READ/PROXY_WRITE, after PROXY_WAIT.
+  int upstream_wants;
+  int error_status;
+
+  /* Called before upstream_fd is closed or handed back to the pool, so that
+   * an event loop can stop watching it. DATA is for the owner. */
+  void (*detach)(struct proxy_conn *conn);
+  void *data;
+} proxy_conn_t;
+
+proxy_conn_t *proxy_conn_new(int client_fd);
+void proxy_conn_free(proxy_conn_t *conn);
+void proxy_set_upstream(proxy_conn_t *conn, upstream_t *backend, int fd, int reused);
+enum proxy_status proxy_pump(proxy_conn_t *conn);
+int proxy_idle(proxy_conn_t *conn);
+int proxy_timeout(proxy_conn_t *conn, enum metrics_timeout *timeout);
+enum proxy_status proxy_expire(proxy_conn_t *conn);
+enum proxy_status proxy_run(proxy_conn_t *conn);
+void proxy_log(proxy_conn_t *conn, int status, size_t bytes);
+
+#endif
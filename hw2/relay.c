@@ -0,0 +1,183 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "relay.h"
+
+/* Pipes of the pool worker running relay_run. */
+__thread relay_pool_t relay_thread_pool;
+
+
+int relay_pool_get(relay_pool_t *pool, int pipe_fds[2]) {
+  if (pool->count > 0) {
+    pool->count--;
+    pipe_fds[0] = pool->pipes[pool->count][0];
+    pipe_fds[1] = pool->pipes[pool->count][1];
+    return 0;
+  }
+  return pipe2(pipe_fds, O_NONBLOCK | O_CLOEXEC);
+}
+
+
+void relay_pool_put(relay_pool_t *pool, int pipe_fds[2]) {
+  if (pool->count < RELAY_POOL_SIZE) {
+    pool->pipes[pool->count][0] = pipe_fds[0];
+    pool->pipes[pool->count][1] = pipe_fds[1];
+    pool->count++;
+  } else {
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+  }
+  pipe_fds[0] = pipe_fds[1] = -1;
+}
+
+
+/* Closes the pipes the calling pool worker keeps, before it exits. */
+void relay_thread_exit() {
+  relay_pool_t *pool = &relay_thread_pool;
+  while (pool->count > 0) {
+    pool->count--;
+    close(pool->pipes[pool->count][0]);
+    close(pool->pipes[pool->count][1]);
+  }
+}
+
+
+void relay_channel_init(relay_channel_t *channel) {
+  channel->pipe[0] = channel->pipe[1] = -1;
+  channel->pending = 0;
+  channel->eof = 0;
+}
+
+
+/*
+ * Gives CHANNEL's pipe back to POOL. A pipe that still holds bytes of a torn
+ * down connection cannot be reused and is closed instead.
+ */
+void relay_channel_release(relay_pool_t *pool, relay_channel_t *channel) {
+  if (channel->pipe[0] < 0)
+    return;
+  if (channel->pending == 0) {
+    relay_pool_put(pool, channel->pipe);
+  } else {
+    close(channel->pipe[0]);
+    close(channel->pipe[1]);
+    channel->pipe[0] = channel->pipe[1] = -1;
+  }
+}
+
+
+int relay_channel_wants_read(relay_channel_t *channel) {
+  return !channel->eof && channel->pending < RELAY_PIPE_CAPACITY;
+}
+
+
+int relay_channel_done(relay_channel_t *channel) {
+  return channel->eof && channel->pending == 0;
+}
+
+
+/*
+ * Splices bytes from SRC into CHANNEL's pipe and from the pipe to DST until
+ * neither side can make progress. Both sockets must be non-blocking. Returns
+ * -1 if the connection should be torn down.
+ */
+int relay_pump(relay_pool_t *pool, relay_channel_t *channel, int src, int dst) {
+  int progress = 1;
+
+  while (progress) {
+    progress = 0;
+
+    if (channel->pending > 0) {
+      ssize_t bytes_sent = splice(channel->pipe[0], NULL, dst, NULL,
+          channel->pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (bytes_sent > 0) {
+        channel->pending -= bytes_sent;
+        progress = 1;
+      } else if (bytes_sent < 0 && errno != EAGAIN && errno != EINTR) {
+        return -1;
+      }
+    }
+
+    if (relay_channel_wants_read(channel)) {
+      if (channel->pipe[0] < 0 && relay_pool_get(pool, channel->pipe) < 0)
+        return -1;
+      ssize_t bytes_read = splice(src, NULL, channel->pipe[1], NULL,
+          RELAY_PIPE_CAPACITY - channel->pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (bytes_read > 0) {
+        channel->pending += bytes_read;
+        progress = 1;
+      } else if (bytes_read == 0) {
+        channel->eof = 1;
+        progress = 1;
+      } else if (errno != EAGAIN && errno != EINTR) {
+        return -1;
+      }
+    }
+  }
+
+  if (channel->pending == 0 && channel->pipe[0] >= 0)
+    relay_pool_put(pool, channel->pipe);
+  return 0;
+}
+
+
+/*
+ * Relays traffic between CLIENT_FD and UPSTREAM_FD on the calling thread,
+ * waiting with poll(). The client's end of file is forwarded as a half-close,
+ * and the relay ends once the upstream response has been fully delivered or
+ * either socket fails, or, with TIMEOUT_MS >= 0, once neither socket has
+ * been ready for that long. Returns -1 if it timed out, 0 otherwise. Leaves
+ * both sockets non-blocking; the caller closes them.
+ */
+int relay_run(int client_fd, int upstream_fd, int timeout_ms) {
+  relay_pool_t *pool = &relay_thread_pool;
+  relay_channel_t to_upstream, to_client;
+  relay_channel_init(&to_upstream);
+  relay_channel_init(&to_client);
+  int upstream_shut = 0;
+  int result = 0;
+
+  fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL, 0) | O_NONBLOCK);
+  fcntl(upstream_fd, F_SETFL, fcntl(upstream_fd, F_GETFL, 0) | O_NONBLOCK);
+
+  while (1) {
+    if (relay_pump(pool, &to_upstream, client_fd, upstream_fd) < 0
+        || relay_pump(pool, &to_client, upstream_fd, client_fd) < 0)
+      break;
+
+    if (relay_channel_done(&to_upstream) && !upstream_shut) {
+      shutdown(upstream_fd, SHUT_WR);
+      upstream_shut = 1;
+    }
+    if (relay_channel_done(&to_client))
+      break;
+
+    /* A socket with nothing to wait for is left out, since poll() reports
+     * POLLHUP even when no events are requested. */
+    struct pollfd fds[2];
+    fds[0].fd = client_fd;
+    fds[0].events = (relay_channel_wants_read(&to_upstream) ? POLLIN : 0)
+        | (to_client.pending > 0 ? POLLOUT : 0);
+    fds[1].fd = upstream_fd;
+    fds[1].events = (relay_channel_wants_read(&to_client) ? POLLIN : 0)
+        | (to_upstream.pending > 0 ? POLLOUT : 0);
+    for (int i = 0; i < 2; i++)
+      if (fds[i].events == 0)
+        fds[i].fd = -1;
+
+    int ready = poll(fds, 2, timeout_ms);
+    if (ready == 0)
+      result = -1;
+    if (ready == 0 || (ready < 0 && errno != EINTR))
+      break;
+  }
+
+  relay_channel_release(pool, &to_upstream);
+  relay_channel_release(pool, &to_client);
+  return result;
+}
@@ -0,0 +1,36 @@
+#ifndef __RELAY__
+#define __RELAY__
+
+/* RELAY moves bytes from one socket to another with splice(2) through a pipe,
+ * so proxied data never has to be copied into user space.
+ *
+ * Pipes are taken from a relay_pool_t only while a channel actually has bytes
+ * in flight and are returned as soon as it is drained, so idle connections
+ * hold no pipes. A pool is owned by one thread (a pool worker or an event
+ * loop) and needs no locking. */
+
+#define RELAY_PIPE_CAPACITY 65536
+#define RELAY_POOL_SIZE 16
+
+typedef struct relay_pool {
+  int pipes[RELAY_POOL_SIZE][2];
+  int count;
+} relay_pool_t;
+
+/* One direction of a relayed connection. */
+typedef struct relay_channel {
+  int pipe[2];    // Pipe held while bytes are in flight, or -1.
+  size_t pending; // Bytes in the pipe still to be written to the destination.
+  int eof;        // The source has reached end of file.
+} relay_channel_t;
+
+void relay_channel_init(relay_channel_t *channel);
+void relay_channel_release(relay_pool_t *pool, relay_channel_t *channel);
+int relay_channel_wants_read(relay_channel_t *channel);
+int relay_channel_done(relay_channel_t *channel);
+int relay_pump(relay_pool_t *pool, relay_channel_t *channel, int src, int dst);
+
+int relay_run(int client_fd, int upstream_fd, int timeout_ms);
+void relay_thread_exit();
+
+#endif
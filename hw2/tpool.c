@@ -0,0 +1,224 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "tpool.h"
+
+#define TPOOL_NODE_DIR "/sys/devices/system/node"
+
+/* The CPU sets threads are pinned to, and how many threads each one has. */
+cpu_set_t *tpool_slots;
+int *tpool_slot_threads;
+int tpool_num_slots;
+pthread_mutex_t tpool_slots_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* Adds the CPUs of LIST, like "0-3,8,10-11", to SET. */
+void tpool_parse_cpulist(char *list, cpu_set_t *set) {
+  char *end;
+  while (*list >= '0' && *list <= '9') {
+    long first = strtol(list, &end, 10), last = first;
+    if (*end == '-')
+      last = strtol(end + 1, &end, 10);
+    for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+      CPU_SET(cpu, set);
+    list = *end == ',' ? end + 1 : end;
+  }
+}
+
+
+/* Adds SET as a slot, unless it is empty. */
+void tpool_add_slot(cpu_set_t *set) {
+  if (CPU_COUNT(set) == 0)
+    return;
+  tpool_slots = realloc(tpool_slots, (tpool_num_slots + 1) * sizeof(cpu_set_t));
+  tpool_slots[tpool_num_slots++] = *set;
+}
+
+
+/*
+ * Makes tpool_pin() pin threads as AFFINITY says, to the CPUs the process
+ * may run on. Returns -1 if they (or, for TPOOL_AFFINITY_NUMA, the NUMA
+ * nodes) cannot be found out; threads are not pinned then.
+ */
+int tpool_set_affinity(enum tpool_affinity affinity) {
+  if (affinity == TPOOL_AFFINITY_NONE)
+    return 0;
+
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+    return -1;
+
+  if (affinity == TPOOL_AFFINITY_CORES) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (!CPU_ISSET(cpu, &allowed))
+        continue;
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(cpu, &set);
+      tpool_add_slot(&set);
+    }
+  } else {
+    DIR *nodes = opendir(TPOOL_NODE_DIR);
+    struct dirent *entry;
+    while (nodes != NULL && (entry = readdir(nodes)) != NULL) {
+      int node;
+      char path[300], list[4096];
+      if (sscanf(entry->d_name, "node%d", &node) != 1)
+        continue;
+      snprintf(path, sizeof(path), TPOOL_NODE_DIR "/%s/cpulist", entry->d_name);
+      FILE *file = fopen(path, "r");
+      if (file == NULL)
+        continue;
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      if (fgets(list, sizeof(list), file) != NULL)
+        tpool_parse_cpulist(list, &set);
+      fclose(file);
+      CPU_AND(&set, &set, &allowed);
+      tpool_add_slot(&set);
+    }
+    if (nodes != NULL)
+      closedir(nodes);
+  }
+
+  if (tpool_num_slots == 0)
+    return -1;
+  tpool_slot_threads = calloc(tpool_num_slots, sizeof(int));
+  return 0;
+}
+
+
+/*
+ * Pins the calling thread to the slot with the fewest threads. Returns the
+ * slot, to be given back with tpool_unpin() if the thread exits, or -1 if
+ * threads are not pinned.
+ */
+int tpool_pin() {
+  if (tpool_num_slots == 0)
+    return -1;
+
+  pthread_mutex_lock(&tpool_slots_mutex);
+  int slot = 0;
+  for (int i = 1; i < tpool_num_slots; i++)
+    if (tpool_slot_threads[i] < tpool_slot_threads[slot])
+      slot = i;
+  tpool_slot_threads[slot]++;
+  pthread_mutex_unlock(&tpool_slots_mutex);
+
+  pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &tpool_slots[slot]);
+  return slot;
+}
+
+
+void tpool_unpin(int slot) {
+  if (slot < 0)
+    return;
+  pthread_mutex_lock(&tpool_slots_mutex);
+  tpool_slot_threads[slot]--;
+  pthread_mutex_unlock(&tpool_slots_mutex);
+}
+
+
+void *tpool_thread(void *args) {
+  tpool_t *pool = args;
+  int slot = tpool_pin();
+  pool->worker(pool->args);
+  tpool_unpin(slot);
+  return NULL;
+}
+
+
+/* Starts a worker, which pool->threads already counts. */
+void tpool_spawn(tpool_t *pool) {
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, tpool_thread, pool) != 0) {
+    __atomic_sub_fetch(&pool->threads, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  pthread_detach(thread);
+}
+
+
+/*
+ * Grows the pool while connections wait in its queue for longer than
+ * TPOOL_GROW_WAIT_MS and no worker is idle to take them, i.e. while all the
+ * workers are busy serving, up to max_threads.
+ */
+void *tpool_manage(void *args) {
+  tpool_t *pool = args;
+  struct timespec interval = { 0, TPOOL_TICK_MS * 1000000L };
+  while (1) {
+    nanosleep(&interval, NULL);
+    int threads = __atomic_load_n(&pool->threads, __ATOMIC_RELAXED);
+    if (threads >= pool->max_threads || __atomic_load_n(&pool->idle, __ATOMIC_RELAXED) > 0
+        || wq_oldest_wait(pool->queue) < TPOOL_GROW_WAIT_MS * 1000000LL)
+      continue;
+
+    int add = __atomic_load_n(&pool->queue->size, __ATOMIC_RELAXED);
+    if (add > threads)
+      add = threads;
+    if (add > pool->max_threads - threads)
+      add = pool->max_threads - threads;
+    __atomic_add_fetch(&pool->threads, add, __ATOMIC_RELAXED);
+    for (int i = 0; i < add; i++)
+      tpool_spawn(pool);
+  }
+  return NULL;
+}
+
+
+/*
+ * Starts MIN_THREADS workers that serve connections from QUEUE, each of which
+ * runs WORKER with ARGS, and, if MAX_THREADS is larger, the manager that adds
+ * more. Workers beyond MIN_THREADS exit after IDLE_TIMEOUT_MS without work.
+ */
+void tpool_start(tpool_t *pool, wq_t *queue, int min_threads, int max_threads,
+    int idle_timeout_ms, void *(*worker)(void *), void *args) {
+  pool->queue = queue;
+  pool->min_threads = min_threads;
+  pool->max_threads = max_threads > min_threads ? max_threads : min_threads;
+  pool->idle_timeout_ms = idle_timeout_ms;
+  pool->worker = worker;
+  pool->args = args;
+  pool->threads = min_threads;
+  pool->idle = 0;
+  for (int i = 0; i < min_threads; i++)
+    tpool_spawn(pool);
+
+  if (pool->max_threads > min_threads) {
+    pthread_t thread;
+    pthread_create(&thread, NULL, tpool_manage, pool);
+    pthread_detach(thread);
+  }
+}
+
+
+/*
+ * Takes the next connection from the pool's queue for a worker, blocking
+ * until there is one, and sets *WAITED to the nanoseconds it was queued.
+ * Returns -1 if the worker has been idle for long enough and should exit;
+ * the pool no longer counts it then.
+ */
+int tpool_pop(tpool_t *pool, long long *waited) {
+  while (1) {
+    __atomic_add_fetch(&pool->idle, 1, __ATOMIC_RELAXED);
+    int fd = pool->max_threads == pool->min_threads ? wq_pop(pool->queue, waited)
+        : wq_timed_pop(pool->queue, pool->idle_timeout_ms, waited);
+    __atomic_sub_fetch(&pool->idle, 1, __ATOMIC_RELAXED);
+    if (fd >= 0)
+      return fd;
+
+    int threads = __atomic_load_n(&pool->threads, __ATOMIC_RELAXED);
+    while (threads > pool->min_threads)
+      if (__atomic_compare_exchange_n(&pool->threads, &threads, threads - 1, 0,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        return -1;
+  }
+}
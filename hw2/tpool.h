@@ -0,0 +1,51 @@
+#ifndef __TPOOL__
+#define __TPOOL__
+
+#include "wq.h"
+
+/* TPOOL runs the pool threads that serve connections from the work queue,
+ * and pins the server's threads to CPUs with --cpu-affinity.
+ *
+ * The pool is elastic between MIN_THREADS and MAX_THREADS. A manager thread
+ * looks at the queue every TPOOL_TICK_MS, and while no worker is idle and
+ * the oldest queued connection has waited longer than TPOOL_GROW_WAIT_MS, it
+ * adds a worker per queued connection (at most doubling the pool per tick).
+ * A worker that finds the queue empty for the idle timeout exits, unless
+ * that would leave fewer than MIN_THREADS. With MIN_THREADS equal to
+ * MAX_THREADS the pool is fixed, and has no manager.
+ *
+ * Pinned threads are spread over slots, each the CPU set of one CPU the
+ * process may run on (cores) or of one NUMA node, as listed in
+ * /sys/devices/system/node (numa); a thread takes the slot with the fewest
+ * threads and gives it back when it exits. Since the kernel places memory on
+ * the node of the CPU that first touches it, what a thread allocates for
+ * itself stays on its node too. */
+
+#define TPOOL_TICK_MS 10
+#define TPOOL_GROW_WAIT_MS 5
+
+enum tpool_affinity {
+  TPOOL_AFFINITY_NONE,
+  TPOOL_AFFINITY_CORES,
+  TPOOL_AFFINITY_NUMA,
+};
+
+typedef struct tpool {
+  wq_t *queue;
+  int min_threads;
+  int max_threads;
+  int idle_timeout_ms;
+  void *(*worker)(void *); // Serves connections until tpool_pop says to exit.
+  void *args;
+  int threads; // Workers running, for monitoring too.
+  int idle;    // Workers waiting in tpool_pop.
+} tpool_t;
+
+int tpool_set_affinity(enum tpool_affinity affinity);
+int tpool_pin();
+void tpool_unpin(int slot);
+void tpool_start(tpool_t *pool, wq_t *queue, int min_threads, int max_threads,
+    int idle_timeout_ms, void *(*worker)(void *), void *args);
+int tpool_pop(tpool_t *pool, long long *waited);
+
+#endif
@@ -0,0 +1,485 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "metrics.h"
+#include "upstream.h"
+
+/* How often the pool thread checks on idle connections. */
+#define UPSTREAM_CHECK_INTERVAL_MS 250
+
+/* Points on the consistent hashing ring per backend. */
+#define UPSTREAM_RING_REPLICAS 160
+
+typedef struct upstream_idle {
+  int fd;
+  long since; // When the connection became idle, in ms.
+} upstream_idle_t;
+
+struct upstream {
+  int index;
+  char *hostname;
+  int port;
+
+  /* The cached address. Guarded by upstream_mutex, like the rest. */
+  struct sockaddr_in address;
+  int resolved;
+  long resolved_until;
+  int resolving;
+
+  upstream_idle_t *idle; // Idle connections, oldest first.
+  int idle_count;
+
+  int active;       // Connections in use by clients.
+  int fails;        // Failed connects in a row.
+  long eject_until; // Skipped by upstream_choose until then.
+};
+
+typedef struct upstream_point {
+  uint32_t hash;
+  int backend;
+} upstream_point_t;
+
+upstream_config_t upstream_config;
+upstream_t upstream_backends[UPSTREAM_MAX_BACKENDS];
+int upstream_count;
+unsigned int upstream_next; // Round robin position.
+upstream_point_t *upstream_ring;
+int upstream_ring_size;
+
+pthread_mutex_t upstream_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t upstream_wanted = PTHREAD_COND_INITIALIZER;
+
+long upstream_now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+uint32_t upstream_hash(char *key, size_t length) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < length; i++)
+    hash = (hash ^ (unsigned char) key[i]) * 16777619u;
+  /* FNV-1a mixes the last bytes poorly; finish with a murmur3 avalanche. */
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6b;
+  hash ^= hash >> 13;
+  hash *= 0xc2b2ae35;
+  hash ^= hash >> 16;
+  return hash;
+}
+
+enum upstream_policy upstream_policy() {
+  return upstream_config.policy;
+}
+
+int upstream_index(upstream_t *upstream) {
+  return upstream->index;
+}
+
+int upstream_connect_timeout() {
+  return upstream_config.connect_timeout_ms;
+}
+
+/*
+ * Returns 1 if BACKEND may be chosen: it has not been TRIED yet and is not
+ * ejected (ejected ones are only considered if ALLOW_EJECTED is set). Must
+ * be called with upstream_mutex held.
+ */
+int upstream_eligible(upstream_t *backend, uint64_t tried, long now, int allow_ejected) {
+  return !(tried & (1ULL << backend->index))
+      && (allow_ejected || backend->eject_until <= now);
+}
+
+/*
+ * Chooses the backend for a client connection whose request path hashes to
+ * HASH (only used by UPSTREAM_HASH), skipping the backends whose bits are
+ * set in TRIED. Returns NULL if every backend has been tried.
+ */
+upstream_t *upstream_choose(uint32_t hash, uint64_t tried) {
+  upstream_t *chosen = NULL;
+  long now = upstream_now();
+
+  pthread_mutex_lock(&upstream_mutex);
+  /* Skip ejected backends, unless there is nothing else left. */
+  for (int allow_ejected = 0; chosen == NULL && allow_ejected < 2; allow_ejected++) {
+    if (upstream_config.policy == UPSTREAM_HASH) {
+      int low = 0, high = upstream_ring_size;
+      while (low < high) {
+        int middle = (low + high) / 2;
+        if (upstream_ring[middle].hash < hash) low = middle + 1;
+        else high = middle;
+      }
+      for (int i = 0; i < upstream_ring_size && chosen == NULL; i++) {
+        upstream_t *backend =
+            &upstream_backends[upstream_ring[(low + i) % upstream_ring_size].backend];
+        if (upstream_eligible(backend, tried, now, allow_ejected))
+          chosen = backend;
+      }
+    } else if (upstream_config.policy == UPSTREAM_LEAST_CONN) {
+      /* Start at a rotating position so that ties are spread out. */
+      unsigned int start = upstream_next++;
+      for (int i = 0; i < upstream_count; i++) {
+        upstream_t *backend = &upstream_backends[(start + i) % upstream_count];
+        if (upstream_eligible(backend, tried, now, allow_ejected)
+            && (chosen == NULL || backend->active < chosen->active))
+          chosen = backend;
+      }
+    } else {
+      for (int i = 0; i < upstream_count && chosen == NULL; i++) {
+        upstream_t *backend = &upstream_backends[upstream_next++ % upstream_count];
+        if (upstream_eligible(backend, tried, now, allow_ejected))
+          chosen = backend;
+      }
+    }
+  }
+  pthread_mutex_unlock(&upstream_mutex);
+  return chosen;
+}
+
+/*
+ * Fills in ADDRESS with BACKEND's address, looking it up again if the cached
+ * one is older than the DNS TTL. While one thread looks it up, the others
+ * keep using the old address. Returns -1 if the name has never been resolved
+ * successfully; after a failed lookup, the next one waits for the TTL too.
+ */
+int upstream_resolve(upstream_t *backend, struct sockaddr_in *address) {
+  pthread_mutex_lock(&upstream_mutex);
+  if (backend->resolving || upstream_now() < backend->resolved_until) {
+    int resolved = backend->resolved;
+    *address = backend->address;
+    pthread_mutex_unlock(&upstream_mutex);
+    return resolved ? 0 : -1;
+  }
+  backend->resolving = 1;
+  pthread_mutex_unlock(&upstream_mutex);
+
+  struct addrinfo hints, *result;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  int status = getaddrinfo(backend->hostname, NULL, &hints, &result);
+
+  pthread_mutex_lock(&upstream_mutex);
+  backend->resolving = 0;
+  if (status == 0) {
+    memcpy(&backend->address, result->ai_addr, sizeof(backend->address));
+    backend->address.sin_port = htons(backend->port);
+    backend->resolved = 1;
+    freeaddrinfo(result);
+  } else {
+    fprintf(stderr, "Cannot find host: %s: %s\n", backend->hostname, gai_strerror(status));
+  }
+  /* After a failure, keep the old address (if any) and retry after a TTL. */
+  backend->resolved_until = upstream_now() + upstream_config.dns_ttl_ms;
+  int resolved = backend->resolved;
+  *address = backend->address;
+  pthread_mutex_unlock(&upstream_mutex);
+
+  return resolved ? 0 : -1;
+}
+
+/*
+ * Connects FD to ADDRESS, giving up after the connect timeout. Returns 0 on
+ * success. FD is left blocking.
+ */
+int upstream_connect_address(int fd, struct sockaddr_in *address) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+
+  int result = connect(fd, (struct sockaddr *) address, sizeof(*address));
+  if (result != 0 && errno == EINPROGRESS) {
+    struct pollfd pollfd = {fd, POLLOUT, 0};
+    int error = 0;
+    socklen_t error_length = sizeof(error);
+    int ready = poll(&pollfd, 1, upstream_config.connect_timeout_ms);
+    if (ready == 0)
+      metrics_timeout(METRICS_TIMEOUT_CONNECT);
+    if (ready == 1
+        && getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &error_length) == 0
+        && error == 0)
+      result = 0;
+  }
+
+  fcntl(fd, F_SETFL, flags);
+  return result;
+}
+
+/*
+ * Opens a new blocking connection to BACKEND for a client and records the
+ * outcome. Returns its fd, or -1 if the backend cannot be resolved or
+ * reached.
+ */
+int upstream_connect(upstream_t *backend) {
+  struct sockaddr_in address;
+  if (upstream_resolve(backend, &address) != 0) {
+    upstream_report(backend, 0, 0);
+    return -1;
+  }
+
+  int fd = socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    fprintf(stderr, "Failed to create a new socket: error %d: %s\n", errno, strerror(errno));
+    return -1;
+  }
+
+  long started = upstream_now();
+  if (upstream_connect_address(fd, &address) != 0) {
+    upstream_report(backend, 0, upstream_now() - started);
+    close(fd);
+    return -1;
+  }
+  upstream_report(backend, 1, upstream_now() - started);
+  upstream_acquire(backend);
+  return fd;
+}
+
+/* Returns 1 if the idle connection FD has neither been closed nor sent data. */
+int upstream_healthy(int fd) {
+  char byte;
+  ssize_t result = recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+  return result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/*
+ * Takes an idle connection to BACKEND for a client, the most recently used
+ * first. Returns -1 if there is none, in which case the caller connects
+ * itself. Each one is probed after upstream_mutex is released, and closed if
+ * it is no longer healthy.
+ */
+int upstream_get(upstream_t *backend) {
+  if (upstream_config.pool_size == 0)
+    return -1;
+
+  while (1) {
+    int fd = -1;
+    pthread_mutex_lock(&upstream_mutex);
+    if (backend->idle_count > 0) {
+      fd = backend->idle[--backend->idle_count].fd;
+      backend->active++;
+    }
+    pthread_cond_signal(&upstream_wanted);
+    pthread_mutex_unlock(&upstream_mutex);
+    if (fd < 0 || upstream_healthy(fd))
+      return fd;
+    close(fd);
+    upstream_release(backend);
+  }
+}
+
+/*
+ * Opens a connection for a client to the backend chosen for HASH, a pooled
+ * one if there is one, trying the other backends in turn if it cannot be
+ * reached. The backends tried are added to *TRIED. Returns the fd, with the
+ * backend in *CHOSEN and *POOLED set if the connection came from the pool,
+ * or -1 if no backend could be reached.
+ */
+int upstream_open(uint32_t hash, uint64_t *tried, upstream_t **chosen, int *pooled) {
+  upstream_t *backend;
+  while ((backend = upstream_choose(hash, *tried)) != NULL) {
+    *tried |= 1ULL << backend->index;
+    *chosen = backend;
+    int fd = upstream_get(backend);
+    *pooled = fd >= 0;
+    if (fd < 0)
+      fd = upstream_connect(backend);
+    if (fd >= 0)
+      return fd;
+  }
+  return -1;
+}
+
+
+/* Counts a connection to BACKEND opened by the caller as in use. */
+void upstream_acquire(upstream_t *backend) {
+  pthread_mutex_lock(&upstream_mutex);
+  backend->active++;
+  pthread_mutex_unlock(&upstream_mutex);
+}
+
+/* A client is done with its connection to BACKEND (closed or put back). */
+void upstream_release(upstream_t *backend) {
+  pthread_mutex_lock(&upstream_mutex);
+  backend->active--;
+  pthread_mutex_unlock(&upstream_mutex);
+}
+
+/*
+ * Hands back a connection to BACKEND that is idle again. It is closed
+ * instead if the pool is full.
+ */
+void upstream_put(upstream_t *backend, int fd) {
+  pthread_mutex_lock(&upstream_mutex);
+  if (backend->idle_count < upstream_config.pool_size) {
+    backend->idle[backend->idle_count].fd = fd;
+    backend->idle[backend->idle_count++].since = upstream_now();
+    fd = -1;
+  }
+  pthread_mutex_unlock(&upstream_mutex);
+  if (fd >= 0)
+    close(fd);
+}
+
+/*
+ * Records the outcome of a connect to BACKEND that took CONNECT_MS. Connects
+ * slower than the connect timeout count as failures too, and max_fails
+ * failures in a row eject the backend for fail_timeout_ms.
+ */
+void upstream_report(upstream_t *backend, int ok, long connect_ms) {
+  if (connect_ms > upstream_config.connect_timeout_ms)
+    ok = 0;
+
+  pthread_mutex_lock(&upstream_mutex);
+  if (ok) {
+    backend->fails = 0;
+  } else if (++backend->fails >= upstream_config.max_fails) {
+    if (backend->eject_until <= upstream_now())
+      fprintf(stderr, "Ejecting upstream %s:%d for %d ms\n", backend->hostname,
+          backend->port, upstream_config.fail_timeout_ms);
+    backend->eject_until = upstream_now() + upstream_config.fail_timeout_ms;
+    backend->fails = 0;
+  }
+  pthread_mutex_unlock(&upstream_mutex);
+}
+
+/*
+ * Drops BACKEND's idle connections that are too old or no longer healthy.
+ * Must be called with upstream_mutex held. The connections are taken out of
+ * the pool and the mutex is released while they are probed, then the
+ * healthy ones go back in before any put back meanwhile, as far as there is
+ * room.
+ */
+void upstream_expire(upstream_t *backend) {
+  int count = backend->idle_count;
+  if (count == 0)
+    return;
+  upstream_idle_t *idle = malloc(count * sizeof(upstream_idle_t));
+  memcpy(idle, backend->idle, count * sizeof(upstream_idle_t));
+  backend->idle_count = 0;
+  pthread_mutex_unlock(&upstream_mutex);
+
+  long now = upstream_now();
+  int kept = 0;
+  for (int i = 0; i < count; i++) {
+    if (now - idle[i].since < upstream_config.max_idle_ms && upstream_healthy(idle[i].fd))
+      idle[kept++] = idle[i];
+    else
+      close(idle[i].fd);
+  }
+
+  pthread_mutex_lock(&upstream_mutex);
+  int room = upstream_config.pool_size - backend->idle_count;
+  int back = kept < room ? kept : room;
+  memmove(backend->idle + back, backend->idle, backend->idle_count * sizeof(upstream_idle_t));
+  memcpy(backend->idle, idle + kept - back, back * sizeof(upstream_idle_t));
+  backend->idle_count += back;
+  if (back < kept) {
+    pthread_mutex_unlock(&upstream_mutex);
+    for (int i = 0; i < kept - back; i++)
+      close(idle[i].fd);
+    pthread_mutex_lock(&upstream_mutex);
+  }
+  free(idle);
+}
+
+/*
+ * Pool thread: keeps pool_size idle connections open to every backend that
+ * is not ejected, replacing the ones that are taken or expire.
+ */
+void *upstream_maintain(void *args) {
+  pthread_mutex_lock(&upstream_mutex);
+  while (1) {
+    for (int i = 0; i < upstream_count; i++) {
+      upstream_t *backend = &upstream_backends[i];
+      upstream_expire(backend);
+
+      while (backend->idle_count < upstream_config.pool_size
+          && backend->eject_until <= upstream_now()) {
+        pthread_mutex_unlock(&upstream_mutex);
+        int fd = upstream_connect(backend);
+        pthread_mutex_lock(&upstream_mutex);
+        if (fd < 0)
+          break; // Down; wait for the next check before retrying.
+        /* upstream_connect counted it as in use; it is idle instead. */
+        backend->active--;
+        pthread_mutex_unlock(&upstream_mutex);
+        upstream_put(backend, fd);
+        pthread_mutex_lock(&upstream_mutex);
+      }
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += UPSTREAM_CHECK_INTERVAL_MS * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(&upstream_wanted, &upstream_mutex, &deadline);
+  }
+  return NULL;
+}
+
+int upstream_point_compare(const void *a, const void *b) {
+  uint32_t hash_a = ((upstream_point_t *) a)->hash;
+  uint32_t hash_b = ((upstream_point_t *) b)->hash;
+  return hash_a < hash_b ? -1 : hash_a > hash_b;
+}
+
+/*
+ * Sets up connections to the comma-separated "HOSTNAME[:PORT]" TARGETS (port
+ * 80 by default). Returns -1 if there are none or too many of them.
+ */
+int upstream_init(char *targets, upstream_config_t *config) {
+  upstream_config = *config;
+
+  char *saveptr;
+  char *list = strdup(targets);
+  for (char *target = strtok_r(list, ",", &saveptr); target != NULL;
+      target = strtok_r(NULL, ",", &saveptr)) {
+    if (upstream_count == UPSTREAM_MAX_BACKENDS)
+      return -1;
+    upstream_t *backend = &upstream_backends[upstream_count];
+    backend->index = upstream_count++;
+    backend->hostname = target;
+    backend->port = 80;
+    char *colon_pointer = strchr(target, ':');
+    if (colon_pointer != NULL) {
+      *colon_pointer = '\0';
+      backend->port = atoi(colon_pointer + 1);
+    }
+    backend->idle = calloc(config->pool_size + 1, sizeof(upstream_idle_t));
+  }
+  if (upstream_count == 0)
+    return -1;
+
+  /* Each backend owns UPSTREAM_RING_REPLICAS points on the hashing ring, so
+   * adding or removing one only moves the paths next to its points. */
+  upstream_ring_size = upstream_count * UPSTREAM_RING_REPLICAS;
+  upstream_ring = calloc(upstream_ring_size, sizeof(upstream_point_t));
+  for (int i = 0; i < upstream_count; i++) {
+    for (int j = 0; j < UPSTREAM_RING_REPLICAS; j++) {
+      char point[300];
+      int length = snprintf(point, sizeof(point), "%s:%d#%d",
+          upstream_backends[i].hostname, upstream_backends[i].port, j);
+      upstream_ring[i * UPSTREAM_RING_REPLICAS + j].hash = upstream_hash(point, length);
+      upstream_ring[i * UPSTREAM_RING_REPLICAS + j].backend = i;
+    }
+  }
+  qsort(upstream_ring, upstream_ring_size, sizeof(upstream_point_t), upstream_point_compare);
+
+  if (config->pool_size > 0) {
+    pthread_t thread;
+    pthread_create(&thread, NULL, upstream_maintain, NULL);
+    pthread_detach(thread);
+  }
+  return 0;
+}
@@ -0,0 +1,60 @@
+#ifndef __UPSTREAM__
+#define __UPSTREAM__
+
+#include <netinet/in.h>
+#include <stdint.h>
+
+/* UPSTREAM hands out TCP connections to the proxy targets (backends).
+ *
+ * Each backend's address is resolved with getaddrinfo() and cached for the
+ * DNS TTL, so lookups are off the request path; a failed lookup only fails
+ * the requests that needed it. With a pool size, a background thread keeps
+ * that many connections to every backend established ahead of time, and a
+ * client takes a warm one instead of waiting for connect(). Idle connections
+ * are dropped once they have been idle for max_idle_ms, or as soon as the
+ * backend closes them or sends anything unsolicited. Connections whose
+ * exchange has ended cleanly can be handed back with upstream_put() to be
+ * reused.
+ *
+ * A backend is chosen per client connection by the balancing policy. Failed
+ * or slow connects count against a backend, and after max_fails of them in
+ * a row it is ejected (skipped) for fail_timeout_ms, unless every backend is
+ * ejected. */
+
+#define UPSTREAM_MAX_BACKENDS 64
+
+enum upstream_policy {
+  UPSTREAM_ROUND_ROBIN,
+  UPSTREAM_LEAST_CONN, // The backend with the fewest connections in use.
+  UPSTREAM_HASH,       // Consistent hashing on the request path.
+};
+
+typedef struct upstream_config {
+  enum upstream_policy policy;
+  int pool_size;          // Idle connections kept per backend.
+  int max_idle_ms;
+  int dns_ttl_ms;
+  int connect_timeout_ms; // Slower connects fail (or count as failures).
+  int max_fails;
+  int fail_timeout_ms;
+} upstream_config_t;
+
+typedef struct upstream upstream_t;
+
+int upstream_init(char *targets, upstream_config_t *config);
+enum upstream_policy upstream_policy();
+uint32_t upstream_hash(char *key, size_t length);
+upstream_t *upstream_choose(uint32_t hash, uint64_t tried);
+int upstream_index(upstream_t *upstream);
+int upstream_resolve(upstream_t *upstream, struct sockaddr_in *address);
+
+int upstream_get(upstream_t *upstream);
+int upstream_connect(upstream_t *upstream);
+int upstream_open(uint32_t hash, uint64_t *tried, upstream_t **chosen, int *pooled);
+void upstream_acquire(upstream_t *upstream);
+void upstream_release(upstream_t *upstream);
+void upstream_put(upstream_t *upstream, int fd);
+void upstream_report(upstream_t *upstream, int ok, long connect_ms);
+int upstream_connect_timeout();
+
+#endif
@@ -0,0 +1,468 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+#define URING_ENTRIES 64
+#define URING_PIPE_SIZE (1 << 20) // Asked for; the kernel may give less.
+
+/* Indexes of the pipe's ends among the ring's registered files. */
+#define URING_PIPE_READ 0
+#define URING_PIPE_WRITE 1
+
+enum uring_step {
+  URING_SEND,
+  URING_SPLICE_IN,  // File to pipe.
+  URING_SPLICE_OUT, // Pipe to socket.
+  URING_CLOSE,
+  URING_TIMEOUT,    // Of the send before.
+};
+
+typedef struct uring {
+  int fd;
+  void *ring;
+  size_t ring_size;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  unsigned queued;             // SQEs added since the last submission.
+  int results[URING_ENTRIES];  // Of the last submission, in SQE order.
+
+  int pipe[2];
+  size_t pipe_size;
+} uring_t;
+
+int uring_on;
+long uring_page_size;
+__thread uring_t *uring_local;
+pthread_key_t uring_key;
+pthread_once_t uring_key_once = PTHREAD_ONCE_INIT;
+
+
+/* Opens the ring's pipe, as large as the kernel allows, and registers it. */
+int uring_open_pipe(uring_t *ring) {
+  if (pipe2(ring->pipe, O_CLOEXEC) != 0) {
+    ring->pipe[0] = ring->pipe[1] = -1;
+    return -1;
+  }
+  fcntl(ring->pipe[1], F_SETPIPE_SZ, URING_PIPE_SIZE);
+  ring->pipe_size = fcntl(ring->pipe[1], F_GETPIPE_SZ);
+  return 0;
+}
+
+
+void uring_close_pipe(uring_t *ring) {
+  if (ring->pipe[0] >= 0) {
+    close(ring->pipe[0]);
+    close(ring->pipe[1]);
+  }
+  ring->pipe[0] = ring->pipe[1] = -1;
+}
+
+
+void uring_destroy(void *data) {
+  uring_t *ring = data;
+  if (ring->sqes != NULL)
+    munmap(ring->sqes, ring->sqes_size);
+  if (ring->ring != NULL)
+    munmap(ring->ring, ring->ring_size);
+  close(ring->fd);
+  uring_close_pipe(ring);
+  free(ring);
+}
+
+
+/* Sets up a ring with its pipe registered. Returns NULL if that fails. */
+uring_t *uring_create() {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+  if (fd < 0)
+    return NULL;
+
+  uring_t *ring = calloc(1, sizeof(uring_t));
+  ring->fd = fd;
+  ring->pipe[0] = ring->pipe[1] = -1;
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+    uring_destroy(ring);
+    return NULL;
+  }
+
+  size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->ring_size = sq_size > cq_size ? sq_size : cq_size;
+  ring->ring = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (ring->ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+    if (ring->ring == MAP_FAILED)
+      ring->ring = NULL;
+    if (ring->sqes == MAP_FAILED)
+      ring->sqes = NULL;
+    uring_destroy(ring);
+    return NULL;
+  }
+
+  char *base = ring->ring;
+  ring->sq_tail = (unsigned *) (base + params.sq_off.tail);
+  ring->sq_mask = (unsigned *) (base + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *) (base + params.sq_off.array);
+  ring->cq_head = (unsigned *) (base + params.cq_off.head);
+  ring->cq_tail = (unsigned *) (base + params.cq_off.tail);
+  ring->cq_mask = (unsigned *) (base + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) (base + params.cq_off.cqes);
+
+  if (uring_open_pipe(ring) != 0 || syscall(__NR_io_uring_register, fd,
+        IORING_REGISTER_FILES, ring->pipe, 2) != 0) {
+    uring_destroy(ring);
+    return NULL;
+  }
+  return ring;
+}
+
+
+void uring_key_init() {
+  pthread_key_create(&uring_key, uring_destroy);
+}
+
+
+/* Returns the calling thread's ring, setting it up the first time. */
+uring_t *uring_get() {
+  if (uring_local != NULL)
+    return uring_local;
+  pthread_once(&uring_key_once, uring_key_init);
+  uring_local = uring_create();
+  if (uring_local != NULL)
+    pthread_setspecific(uring_key, uring_local);
+  return uring_local;
+}
+
+
+/*
+ * Turns the engine on if the kernel supports io_uring and every operation it
+ * uses. Returns -1 (leaving it off) otherwise.
+ */
+int uring_init() {
+  uring_t *ring = uring_create();
+  if (ring == NULL)
+    return -1;
+
+  int ops[] = {IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_SENDMSG,
+      IORING_OP_SPLICE, IORING_OP_CLOSE, IORING_OP_LINK_TIMEOUT};
+  size_t probe_size = sizeof(struct io_uring_probe)
+      + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe *probe = calloc(1, probe_size);
+  int supported = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PROBE,
+      probe, IORING_OP_LAST) == 0;
+  for (int i = 0; supported && i < (int) (sizeof(ops) / sizeof(ops[0])); i++)
+    supported = ops[i] < probe->ops_len
+        && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+  free(probe);
+  uring_destroy(ring);
+  if (!supported)
+    return -1;
+
+  uring_page_size = sysconf(_SC_PAGESIZE);
+  uring_on = 1;
+  return 0;
+}
+
+
+int uring_enabled() {
+  return uring_on;
+}
+
+
+/* Adds an SQE for OPCODE on FD to the next submission. */
+struct io_uring_sqe *uring_sqe(uring_t *ring, int opcode, int fd) {
+  unsigned index = (*ring->sq_tail + ring->queued) & *ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  sqe->user_data = ring->queued;
+  ring->sq_array[index] = index;
+  ring->queued++;
+  return sqe;
+}
+
+
+/*
+ * Submits the queued SQEs and waits for all of them to complete, with their
+ * results in ring->results. Returns the number of SQEs.
+ */
+int uring_submit(uring_t *ring) {
+  unsigned count = ring->queued, submitted = 0, completed = 0;
+  ring->queued = 0;
+  __atomic_store_n(ring->sq_tail, *ring->sq_tail + count, __ATOMIC_RELEASE);
+
+  while (completed < count) {
+    int result = syscall(__NR_io_uring_enter, ring->fd, count - submitted,
+        count - completed, IORING_ENTER_GETEVENTS, NULL, 0);
+    if (result < 0) {
+      if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+        continue;
+      /* The SQEs point into our callers' stacks; they cannot be given up. */
+      perror("io_uring_enter");
+      exit(EXIT_FAILURE);
+    }
+    submitted += result;
+
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++, completed++) {
+      struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+      if (cqe->user_data < URING_ENTRIES)
+        ring->results[cqe->user_data] = cqe->res;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+  }
+  return count;
+}
+
+
+void uring_stat_from_statx(struct stat *st, struct statx *stx) {
+  memset(st, 0, sizeof(*st));
+  st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+  st->st_ino = stx->stx_ino;
+  st->st_mode = stx->stx_mode;
+  st->st_nlink = stx->stx_nlink;
+  st->st_uid = stx->stx_uid;
+  st->st_gid = stx->stx_gid;
+  st->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+  st->st_size = stx->stx_size;
+  st->st_blksize = stx->stx_blksize;
+  st->st_blocks = stx->stx_blocks;
+  st->st_atim.tv_sec = stx->stx_atime.tv_sec;
+  st->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+  st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+  st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+  st->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+  st->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+
+
+/*
+ * Stats the file at PATH into *ST like stat(), and opens it in the same
+ * submission: *FD is the open file if it is a regular file, and -1 if not.
+ * It is opened with O_NONBLOCK so that a FIFO cannot hold the thread up,
+ * which makes no difference to reading a regular file.
+ */
+int uring_open_stat(char *path, struct stat *st, int *fd) {
+  *fd = -1;
+  uring_t *ring = uring_get();
+  if (ring == NULL)
+    return stat(path, st);
+
+  struct statx stx;
+  struct io_uring_sqe *sqe = uring_sqe(ring, IORING_OP_OPENAT, AT_FDCWD);
+  sqe->addr = (unsigned long) path;
+  sqe->open_flags = O_RDONLY | O_CLOEXEC | O_NONBLOCK;
+  sqe = uring_sqe(ring, IORING_OP_STATX, AT_FDCWD);
+  sqe->addr = (unsigned long) path;
+  sqe->len = STATX_BASIC_STATS;
+  sqe->off = (unsigned long) &stx;
+  uring_submit(ring);
+
+  int opened = ring->results[0];
+  if (ring->results[1] < 0 || !S_ISREG(stx.stx_mode)) {
+    if (opened >= 0)
+      close(opened);
+    if (ring->results[1] < 0) {
+      errno = -ring->results[1];
+      return -1;
+    }
+  } else if (opened >= 0) {
+    *fd = opened;
+  }
+  uring_stat_from_statx(st, &stx);
+  return 0;
+}
+
+
+/* Adds a linked timeout of TIMEOUT for the SQE added before, which lets the
+ * chain go on behind it. */
+struct io_uring_sqe *uring_link_timeout(uring_t *ring, struct __kernel_timespec *timeout) {
+  struct io_uring_sqe *sqe = uring_sqe(ring, IORING_OP_LINK_TIMEOUT, -1);
+  sqe->addr = (unsigned long) timeout;
+  sqe->len = 1;
+  sqe->flags = IOSQE_IO_LINK;
+  return sqe;
+}
+
+
+/*
+ * Sends the COUNT CHUNKS to the socket FD, which may block, advancing *SENT
+ * past the bytes that went out, and then closes CLOSE_FD unless it is -1.
+ * With TIMEOUT_MS >= 0, a sendmsg is given up if the client has not taken
+ * all of it after that long: it waits for the socket with a poll of the
+ * ring's own, which the socket's SO_SNDTIMEO does not limit. Splices to the
+ * socket block in an io_uring worker instead, which a linked timeout cannot
+ * interrupt, but SO_SNDTIMEO does.
+ *
+ * Every submission is one chain of linked SQEs, so that a step only starts
+ * once the one before has done all it was asked to: sendmsg for in-memory
+ * chunks, pairs of splices (file to pipe, pipe to socket) of at most a
+ * pipeful for file chunks, and the close at the end. A file chunk takes as
+ * many submissions as it has runs of (URING_ENTRIES - 1) / 2 pipefuls.
+ *
+ * Returns 0 once everything is sent and CLOSE_FD is closed. Returns -1 if the
+ * engine is off for this thread or the chain stopped short, for whatever
+ * reason; CLOSE_FD is left open then, and the caller can carry on from *SENT,
+ * unless errno is ETIMEDOUT: the client has stopped taking data.
+ */
+int uring_send(int fd, uring_chunk_t *chunks, int count, int close_fd, int timeout_ms,
+    size_t *sent) {
+  uring_t *ring = uring_get();
+  if (ring == NULL)
+    return -1;
+
+  struct iovec iov[count];
+  struct msghdr messages[URING_ENTRIES];
+  enum uring_step steps[URING_ENTRIES];
+  size_t expected[URING_ENTRIES];
+  int chunk = 0;
+  size_t done = 0; // Bytes of chunks[chunk] already queued.
+  struct __kernel_timespec timeout = { timeout_ms / 1000, timeout_ms % 1000 * 1000000LL };
+
+  while (chunk < count) {
+    int messages_used = 0;
+    struct io_uring_sqe *sqe = NULL;
+
+    while (chunk < count && ring->queued + 3 <= URING_ENTRIES) {
+      int step = ring->queued;
+      if (chunks[chunk].length == done) {
+        chunk++;
+        done = 0;
+        continue;
+      }
+
+      if (chunks[chunk].data != NULL) {
+        /* Gather this and any following in-memory chunks into one message. */
+        struct msghdr *message = &messages[messages_used++];
+        memset(message, 0, sizeof(*message));
+        message->msg_iov = &iov[chunk];
+        expected[step] = 0;
+        for (; chunk < count && chunks[chunk].data != NULL; chunk++, done = 0) {
+          iov[chunk].iov_base = chunks[chunk].data + done;
+          iov[chunk].iov_len = chunks[chunk].length - done;
+          expected[step] += iov[chunk].iov_len;
+          message->msg_iovlen++;
+        }
+        sqe = uring_sqe(ring, IORING_OP_SENDMSG, fd);
+        sqe->addr = (unsigned long) message;
+        sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL | (chunk < count ? MSG_MORE : 0);
+        sqe->flags = IOSQE_IO_LINK;
+        steps[step] = URING_SEND;
+        if (timeout_ms >= 0) {
+          steps[step + 1] = URING_TIMEOUT;
+          sqe = uring_link_timeout(ring, &timeout);
+        }
+        continue;
+      }
+
+      /* Pipefuls end on page boundaries, so that each one fits the pipe. */
+      off_t offset = chunks[chunk].offset + done;
+      size_t length = ring->pipe_size - offset % uring_page_size;
+      if (length > chunks[chunk].length - done)
+        length = chunks[chunk].length - done;
+      done += length;
+      int more = done < chunks[chunk].length || chunk + 1 < count;
+
+      sqe = uring_sqe(ring, IORING_OP_SPLICE, URING_PIPE_WRITE);
+      sqe->splice_fd_in = chunks[chunk].file_fd;
+      sqe->splice_off_in = offset;
+      sqe->off = -1;
+      sqe->len = length;
+      sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+      steps[step] = URING_SPLICE_IN;
+      expected[step] = length;
+
+      sqe = uring_sqe(ring, IORING_OP_SPLICE, fd);
+      sqe->splice_fd_in = URING_PIPE_READ;
+      sqe->splice_off_in = -1;
+      sqe->off = -1;
+      sqe->len = length;
+      sqe->splice_flags = SPLICE_F_FD_IN_FIXED | (more ? SPLICE_F_MORE : 0);
+      sqe->flags = IOSQE_IO_LINK;
+      steps[step + 1] = URING_SPLICE_OUT;
+      expected[step + 1] = length;
+    }
+
+    if (chunk == count && close_fd >= 0) {
+      steps[ring->queued] = URING_CLOSE;
+      sqe = uring_sqe(ring, IORING_OP_CLOSE, close_fd);
+    }
+    if (sqe == NULL)
+      break;
+    sqe->flags &= ~IOSQE_IO_LINK;
+
+    int submitted = uring_submit(ring);
+    size_t in_pipe = 0;
+    int complete = 1, timed_out = 0;
+    for (int i = 0; i < submitted; i++) {
+      int result = ring->results[i];
+      if ((steps[i] == URING_TIMEOUT && result == -ETIME)
+          || (steps[i] == URING_SPLICE_OUT && result == -EAGAIN))
+        timed_out = 1;
+      if (steps[i] == URING_CLOSE || steps[i] == URING_TIMEOUT)
+        continue;
+      if (steps[i] == URING_SPLICE_IN && result > 0)
+        in_pipe += result;
+      if (steps[i] != URING_SPLICE_IN && result > 0) {
+        *sent += result;
+        if (steps[i] == URING_SPLICE_OUT)
+          in_pipe -= result;
+      }
+      if (result < 0 || (size_t) result != expected[i])
+        complete = 0;
+    }
+
+    if (!complete) {
+      /* Whatever the chain left in the pipe would go out with the next
+       * response; start over with an empty pipe. */
+      if (in_pipe > 0) {
+        uring_close_pipe(ring);
+        if (uring_open_pipe(ring) == 0) {
+          struct io_uring_files_update update;
+          memset(&update, 0, sizeof(update));
+          update.fds = (unsigned long) ring->pipe;
+          syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES_UPDATE,
+              &update, 2);
+        }
+        if (ring->pipe[0] < 0) {
+          uring_local = NULL;
+          pthread_setspecific(uring_key, NULL);
+          uring_destroy(ring);
+        }
+      }
+      if (timed_out)
+        errno = ETIMEDOUT;
+      return -1;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,37 @@
+#ifndef __URING__
+#define __URING__
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/* URING is an io_uring I/O engine for --files mode, selected with
+ * --io-engine io_uring. It is written against the raw system calls, so it
+ * needs no liburing.
+ *
+ * Every thread gets its own small ring the first time it uses one, and a
+ * pipe that is registered with the ring. Looking a file up takes one
+ * submission that opens and statx()es it together. Sending a response from
+ * a pool worker (whose socket blocks) takes one submission of linked
+ * requests: sendmsg for the head, then splices of the file into the pipe
+ * and out of it to the socket, then the close of the file.
+ *
+ * The blocking calls stay in use wherever the engine is not: uring_init()
+ * turns it off if the kernel lacks io_uring or any of those operations, and
+ * if a chain comes up short the caller goes on from where it stopped. */
+
+/* A piece of a response: LENGTH bytes at DATA, or, if DATA is NULL, LENGTH
+ * bytes of FILE_FD starting at OFFSET. */
+typedef struct uring_chunk {
+  char *data;
+  int file_fd;
+  off_t offset;
+  size_t length;
+} uring_chunk_t;
+
+int uring_init();
+int uring_enabled();
+int uring_open_stat(char *path, struct stat *st, int *fd);
+int uring_send(int fd, uring_chunk_t *chunks, int count, int close_fd, int timeout_ms,
+    size_t *sent);
+
+#endif
@@ -1,49 +1,211 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <math.h>
+#include <sched.h>
 #include <stdlib.h>
+#include <time.h>
 #include "wq.h"
-#include "utlist.h"
 
 
-pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+long long wq_now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
 
 /* Initializes a work queue WQ. */
 void wq_init(wq_t *wq) {
-  pthread_mutex_lock(&mutex);
   wq->size = 0;
-  wq->head = NULL;
-  pthread_mutex_unlock(&mutex);
+  wq->mask = WQ_CAPACITY - 1;
+  wq->slots = malloc(WQ_CAPACITY * sizeof(wq_slot_t));
+  for (unsigned long i = 0; i < WQ_CAPACITY; i++)
+    wq->slots[i].sequence = i;
+  wq->head = 0;
+  wq->tail = 0;
+  sem_init(&wq->items, 0, 0);
+  sem_init(&wq->free_slots, 0, WQ_CAPACITY);
+  wq->high_water = WQ_CAPACITY;
+  wq->codel.target = 0;
+  pthread_mutex_init(&wq->codel.lock, NULL);
 }
 
-/* Remove an item from the WQ. This function should block until there
- * is at least one item on the queue. */
-int wq_pop(wq_t *wq) {
-  pthread_mutex_lock(&mutex);
+/* Frees a work queue WQ that no thread is using anymore. */
+void wq_destroy(wq_t *wq) {
+  sem_destroy(&wq->items);
+  sem_destroy(&wq->free_slots);
+  pthread_mutex_destroy(&wq->codel.lock);
+  free(wq->slots);
+  wq->slots = NULL;
+}
 
-  while (wq->size <= 0)
-    pthread_cond_wait(&cond, &mutex);
+void wq_sem_wait(sem_t *sem) {
+  while (sem_wait(sem) == -1 && errno == EINTR)
+    ;
+}
 
-  wq_item_t *wq_item = wq->head;
-  int client_socket_fd = wq->head->client_socket_fd;
-  wq->size--;
-  DL_DELETE(wq->head, wq->head);
-  
-  pthread_mutex_unlock(&mutex);
-  free(wq_item);
+/*
+ * Claims the slot at *INDEX, which is ready when its sequence number is
+ * *INDEX + OFFSET (0 for producers, 1 for consumers). The semaphores guarantee
+ * that a slot will become ready, but its previous user may still be finishing
+ * with it, in which case this spins briefly.
+ */
+wq_slot_t *wq_claim(wq_t *wq, unsigned long *index, unsigned long offset,
+    unsigned long *position) {
+  unsigned long pos = __atomic_load_n(index, __ATOMIC_RELAXED);
+  while (1) {
+    wq_slot_t *slot = &wq->slots[pos & wq->mask];
+    unsigned long sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+    long difference = (long) (sequence - (pos + offset));
 
+    if (difference == 0) {
+      if (__atomic_compare_exchange_n(index, &pos, pos + 1, 1,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        *position = pos;
+        return slot;
+      }
+    } else {
+      if (difference < 0)
+        sched_yield();
+      pos = __atomic_load_n(index, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+/* Takes the item that a wait on wq->items made available. */
+int wq_take(wq_t *wq, long long *waited) {
+  unsigned long pos;
+  wq_slot_t *slot = wq_claim(wq, &wq->head, 1, &pos);
+  int client_socket_fd = slot->client_socket_fd;
+  if (waited != NULL)
+    *waited = wq_now() - slot->enqueued;
+  __atomic_store_n(&slot->sequence, pos + wq->mask + 1, __ATOMIC_RELEASE);
+  __atomic_sub_fetch(&wq->size, 1, __ATOMIC_RELAXED);
+
+  sem_post(&wq->free_slots);
   return client_socket_fd;
 }
 
-/* Add ITEM to WQ. */
+/* Remove an item from the WQ. This function should block until there
+ * is at least one item on the queue. If WAITED is not NULL, sets it to the
+ * nanoseconds the item spent in the queue. */
+int wq_pop(wq_t *wq, long long *waited) {
+  wq_sem_wait(&wq->items);
+  return wq_take(wq, waited);
+}
+
+/* Like wq_pop, but gives up and returns -1 if the queue stays empty for
+ * TIMEOUT_MS. */
+int wq_timed_pop(wq_t *wq, int timeout_ms, long long *waited) {
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += timeout_ms / 1000;
+  deadline.tv_nsec += timeout_ms % 1000 * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+  while (sem_clockwait(&wq->items, CLOCK_MONOTONIC, &deadline) == -1)
+    if (errno != EINTR)
+      return -1;
+  return wq_take(wq, waited);
+}
+
+/* Add ITEM to WQ. Blocks while the queue is full. */
 void wq_push(wq_t *wq, int client_socket_fd) {
+  wq_sem_wait(&wq->free_slots);
+
+  unsigned long pos;
+  wq_slot_t *slot = wq_claim(wq, &wq->tail, 0, &pos);
+  slot->client_socket_fd = client_socket_fd;
+  __atomic_store_n(&slot->enqueued, wq_now(), __ATOMIC_RELAXED);
+  __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&wq->size, 1, __ATOMIC_RELAXED);
+
+  sem_post(&wq->items);
+}
+
+/* Adds ITEM to WQ, unless it already holds wq->high_water items (or about
+ * that many, with concurrent producers). Returns -1 if it was not added. */
+int wq_try_push(wq_t *wq, int client_socket_fd) {
+  if (__atomic_load_n(&wq->size, __ATOMIC_RELAXED) >= wq->high_water)
+    return -1;
+  wq_push(wq, client_socket_fd);
+  return 0;
+}
+
+/* Returns the nanoseconds the oldest item in WQ has been queued, or 0 if WQ
+ * is empty. The slot is only trusted if it still holds the same item after
+ * its time was read, so a concurrent pop and push cannot mix up the answer. */
+long long wq_oldest_wait(wq_t *wq) {
+  unsigned long pos = __atomic_load_n(&wq->head, __ATOMIC_ACQUIRE);
+  wq_slot_t *slot = &wq->slots[pos & wq->mask];
+  if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != pos + 1)
+    return 0;
+  long long enqueued = __atomic_load_n(&slot->enqueued, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  if (__atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) != pos + 1)
+    return 0;
+  return wq_now() - enqueued;
+}
+
+/* Turns CoDel on for WQ, with TARGET and INTERVAL in nanoseconds (see
+ * wq_codel_drop), or off if TARGET is 0. */
+void wq_set_codel(wq_t *wq, long long target, long long interval) {
+  pthread_mutex_lock(&wq->codel.lock);
+  wq->codel.target = target;
+  wq->codel.interval = interval;
+  wq->codel.first_above = 0;
+  wq->codel.dropping = 0;
+  wq->codel.count = wq->codel.last_count = 0;
+  pthread_mutex_unlock(&wq->codel.lock);
+}
+
+long long wq_codel_next(wq_codel_t *codel, long long from) {
+  return from + (long long) (codel->interval / sqrt(codel->count));
+}
 
-  pthread_mutex_lock(&mutex);
+/*
+ * Decides whether the item just popped from WQ, after WAITED nanoseconds in
+ * the queue, should be dropped rather than served. This is CoDel's dequeue
+ * side: once the waits have stayed above the target for a whole interval,
+ * items are dropped at a rate that grows with the square root of the number
+ * of drops, until a wait under the target (or an empty queue) shows that the
+ * consumers have caught up. Consumers must call it for every item.
+ */
+int wq_codel_drop(wq_t *wq, long long waited) {
+  wq_codel_t *codel = &wq->codel;
+  if (codel->target == 0)
+    return 0;
 
-  wq_item_t *wq_item = calloc(1, sizeof(wq_item_t));
-  wq_item->client_socket_fd = client_socket_fd;
-  DL_APPEND(wq->head, wq_item);
-  wq->size++;
+  pthread_mutex_lock(&codel->lock);
+  long long now = wq_now();
+  int drop = 0, ok_to_drop = 0;
+  if (waited < codel->target || __atomic_load_n(&wq->size, __ATOMIC_RELAXED) == 0)
+    codel->first_above = 0;
+  else if (codel->first_above == 0)
+    codel->first_above = now + codel->interval;
+  else if (now >= codel->first_above)
+    ok_to_drop = 1;
 
-  pthread_cond_signal(&cond);
-  pthread_mutex_unlock(&mutex);
-  
+  if (codel->dropping) {
+    if (!ok_to_drop) {
+      codel->dropping = 0;
+    } else if (now >= codel->drop_next) {
+      drop = 1;
+      codel->count++;
+      codel->drop_next = wq_codel_next(codel, codel->drop_next);
+    }
+  } else if (ok_to_drop) {
+    /* Pick up near the old drop rate if dropping stopped only recently. */
+    drop = 1;
+    codel->dropping = 1;
+    unsigned delta = codel->count - codel->last_count;
+    codel->count = delta > 1 && now - codel->drop_next < 16 * codel->interval ? delta : 1;
+    codel->drop_next = wq_codel_next(codel, now);
+    codel->last_count = codel->count;
+  }
+  pthread_mutex_unlock(&codel->lock);
+  return drop;
 }
@@ -2,24 +2,70 @@
 #define __WQ__
 
 #include <pthread.h>
+#include <semaphore.h>
 
 /* WQ defines a work queue which will be used to store accepted client sockets
- * waiting to be served. */
+ * waiting to be served.
+ *
+ * It is a bounded multi-producer multi-consumer ring buffer: producers and
+ * consumers claim slots with compare-and-swap on their own index, and each
+ * slot's sequence number says whether it is ready to be written or read, so
+ * pushing and popping take no lock and allocate nothing. Two semaphores count
+ * the filled and free slots, so wq_pop only sleeps while the queue is empty
+ * (wq_timed_pop at most for a timeout) and wq_push only while it is full.
+ * All state lives in the wq_t, so any number of independent queues can be
+ * used.
+ *
+ * For admission control, wq_try_push refuses items once the queue holds
+ * high_water of them instead of blocking, and wq_codel_drop tells consumers
+ * which items to drop so that the time items spend queued stays near a
+ * target (CoDel, RFC 8289). */
 
-typedef struct wq_item {
+#define WQ_CAPACITY 4096 // Must be a power of two.
+#define WQ_CACHE_LINE 64
+
+typedef struct wq_slot {
+  unsigned long sequence;
   int client_socket_fd; // Client socket to be served.
-  struct wq_item *next;
-  struct wq_item *prev;
-} wq_item_t;
+  long long enqueued;   // When it was pushed, in monotonic nanoseconds.
+} wq_slot_t;
+
+/* CoDel's state. Times are in monotonic nanoseconds; TARGET is 0 while
+ * CoDel is off. */
+typedef struct wq_codel {
+  long long target;      // The queueing delay to stay under.
+  long long interval;    // How long the delay may stay above TARGET.
+  long long first_above; // When the delay will have been above TARGET for INTERVAL.
+  long long drop_next;   // When to drop again, while dropping.
+  unsigned count;        // Drops since dropping started.
+  unsigned last_count;
+  int dropping;
+  pthread_mutex_t lock;
+} wq_codel_t;
 
 typedef struct wq {
-  int size;
-  wq_item_t *head;
-  /* TODO: More stuff here, maybe? */
+  int size; // Number of queued sockets, for monitoring.
+  int high_water; // wq_try_push refuses items past this many.
+  wq_codel_t codel;
+  unsigned long mask;
+  wq_slot_t *slots;
+  sem_t items;
+  sem_t free_slots;
+
+  /* Producers and consumers each update their own index; keep them on
+   * separate cache lines. */
+  unsigned long tail __attribute__((aligned(WQ_CACHE_LINE)));
+  unsigned long head __attribute__((aligned(WQ_CACHE_LINE)));
 } wq_t;
 
 void wq_init(wq_t *wq);
+void wq_destroy(wq_t *wq);
 void wq_push(wq_t *wq, int client_socket_fd);
-int wq_pop(wq_t *wq);
+int wq_try_push(wq_t *wq, int client_socket_fd);
+int wq_pop(wq_t *wq, long long *waited);
+int wq_timed_pop(wq_t *wq, int timeout_ms, long long *waited);
+long long wq_oldest_wait(wq_t *wq);
+void wq_set_codel(wq_t *wq, long long target, long long interval);
+int wq_codel_drop(wq_t *wq, long long waited);
 
 #endif